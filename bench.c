@@ -0,0 +1,604 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "commonfunction.h"
+#include "config.h"
+#include "histogram.h"
+#include "linereader.h"
+#include "outqueue.h"
+#include "protocol.h"
+
+/* Environment variables read by bench_configure */
+#define ENV_CLIENTS "BENCH_CLIENTS"
+#define ENV_SECONDS "BENCH_SECONDS"
+#define ENV_RATE "BENCH_RATE"
+#define ENV_SAY "BENCH_SAY"
+#define ENV_LIST "BENCH_LIST"
+#define ENV_KICK "BENCH_KICK"
+#define ENV_SIZE "BENCH_SIZE"
+#define ENV_HANDSHAKES "BENCH_HANDSHAKES"
+
+/* States of a simulated client */
+#define SESSION_IDLE 0 // Not connected, waiting for its turn to connect
+#define SESSION_CONNECTING 1
+#define SESSION_AUTH 2
+#define SESSION_NAME 3
+#define SESSION_CHAT 4
+
+/* Phases of a run */
+#define PHASE_JOIN 1
+#define PHASE_LOAD 2
+#define PHASE_DRAIN 3
+
+/* Microseconds in a second */
+#define USEC 1000000LL
+
+/* Longest a phase waits for the server before giving up(microsecond) */
+#define JOIN_TIMEOUT (60 * USEC)
+#define DRAIN_TIMEOUT (5 * USEC)
+#define DRAIN_QUIET (USEC / 2)
+
+/* Longest line taken from the server, LIST: of a big chat is long */
+#define MAX_LINE (16 * 1024 * 1024)
+
+/* Frames written in one sendmsg call */
+#define IOV_BATCH 64
+
+/* Events taken from epoll at once */
+#define MAX_EVENTS 256
+
+/* One simulated client */
+typedef struct Session {
+    int fd;
+    int state;
+    int index; // Position in sessions
+    int chatIndex; // Position in chatting while in the chat
+    int taken; // NAME_TAKEN: received, added to the name
+    int kickPending; // Somebody sent KICK: for it
+    long long connectAt; // When the connection was started(microsecond)
+    long long listAt; // When an unanswered LIST: was sent, 0 if none
+    char name[32];
+    LineReader in;
+    OutQueue out;
+} Session;
+
+/* Settings and results of a run */
+typedef struct Bench {
+    long clients;
+    long seconds;
+    long rate; // Commands per second, across every client
+    long sayWeight;
+    long listWeight;
+    long kickWeight;
+    long size; // Bytes of text in each SAY:
+    long handshakes; // Most clients connecting at once
+    char* auth;
+    struct addrinfo* address;
+    int epollFd;
+    int phase;
+    Session* sessions;
+    int* idle; // Sessions waiting to connect, a stack
+    int idleCount;
+    int* chatting; // Sessions in the chat, for picking one at random
+    int chatCount;
+    int connecting; // Sessions between connect and OK: for their name
+    char* padding;
+    long long lastDelivery; // When a MSG: last came in(microsecond)
+    unsigned long long joins; // Including clients joining again
+    unsigned long long firstJoins; // Joins during PHASE_JOIN
+    unsigned long long failures; // Connections that never made it in
+    unsigned long long lost; // Connections dropped by the server
+    unsigned long long kicked;
+    unsigned long long says;
+    unsigned long long lists;
+    unsigned long long kicks;
+    unsigned long long delivered; // MSG: received by every client
+    unsigned long long bytesIn;
+    Histogram joinTime;
+    Histogram fanOut; // SAY: sent until each MSG: received
+    Histogram listTime; // LIST: sent until its reply
+} Bench;
+
+/**
+ * Determines the current time of a monotonic clock.
+ * Returns the time in microseconds
+ */
+static long long now_usec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * USEC + now.tv_nsec / 1000;
+}
+
+/**
+ * Raises the open file limit as far as allowed, every client is a socket.
+ */
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/**
+ * Loads the run's settings from the environment, all optional:
+ *     -BENCH_CLIENTS -> simulated clients, 100 default
+ *     -BENCH_SECONDS -> how long load is applied once everyone joined, 10
+ *     default
+ *     -BENCH_RATE -> commands per second across every client, 1000 default
+ *     -BENCH_SAY, BENCH_LIST, BENCH_KICK -> relative weights of each
+ *     command, 95, 5 and 0 default
+ *     -BENCH_SIZE -> bytes of text in each SAY:, 64 default
+ *     -BENCH_HANDSHAKES -> most clients connecting at once, 128 default
+ * bench is the run to set up
+ * Exit with 1 if a setting is invalid
+ */
+static void bench_configure(Bench* bench) {
+    bench->clients = config_number(ENV_CLIENTS, 1, 100);
+    bench->seconds = config_number(ENV_SECONDS, 0, 10);
+    bench->rate = config_number(ENV_RATE, 0, 1000);
+    bench->sayWeight = config_number(ENV_SAY, 0, 95);
+    bench->listWeight = config_number(ENV_LIST, 0, 5);
+    bench->kickWeight = config_number(ENV_KICK, 0, 0);
+    bench->size = config_number(ENV_SIZE, 0, 64);
+    bench->handshakes = config_number(ENV_HANDSHAKES, 1, 128);
+    if (bench->sayWeight + bench->listWeight + bench->kickWeight == 0) {
+        fprintf(stderr, "Invalid %s: no commands to send\n", ENV_SAY);
+        exit(ARG_ERROR);
+    }
+}
+
+/**
+ * Takes a client out of the chat list.
+ * bench is the run
+ * session is the client, must be in the chat
+ */
+static void session_leave_chat(Bench* bench, Session* session) {
+    Session* last = &(bench->sessions[bench->chatting[--bench->chatCount]]);
+    bench->chatting[session->chatIndex] = last->index;
+    last->chatIndex = session->chatIndex;
+}
+
+/**
+ * Closes a client's connection and puts it back in line to connect again,
+ * so a kicked or dropped client rejoins while load is applied.
+ * bench is the run
+ * session is the client
+ */
+static void session_close(Bench* bench, Session* session) {
+    if (session->state == SESSION_CHAT) {
+        session_leave_chat(bench, session);
+    } else if (session->state != SESSION_IDLE) {
+        bench->connecting--;
+    }
+    if (session->fd >= 0) {
+        close(session->fd); // Also takes it out of the epoll set
+    }
+    line_free(&(session->in));
+    outq_clear(&(session->out));
+    session->fd = -1;
+    session->state = SESSION_IDLE;
+    session->kickPending = 0;
+    session->listAt = 0;
+    bench->idle[bench->idleCount++] = session->index;
+}
+
+/**
+ * Writes as much of what is waiting for the server as the socket takes, the
+ * rest goes out on EPOLLOUT.
+ * bench is the run
+ * session is the client
+ */
+static void session_flush(Bench* bench, Session* session) {
+    struct iovec iov[IOV_BATCH];
+    struct msghdr message;
+
+    while (session->out.count) {
+        memset(&message, 0, sizeof(struct msghdr));
+        message.msg_iov = iov;
+        message.msg_iovlen = outq_iov(&(session->out), iov, IOV_BATCH);
+        ssize_t written = sendmsg(session->fd, &message, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                bench->lost++;
+                session_close(bench, session);
+            }
+            return;
+        }
+        outq_advance(&(session->out), written);
+    }
+}
+
+/**
+ * Queues a frame to the server and writes it if the socket has room.
+ * bench is the run
+ * session is the client sending
+ * frame is the frame, the caller keeps its reference
+ */
+static void session_send_frame(Bench* bench, Session* session,
+        OutFrame* frame) {
+    outq_push(&(session->out), frame);
+    session_flush(bench, session);
+}
+
+/**
+ * Queues some data to the server, see session_send_frame.
+ * bench is the run
+ * session is the client sending
+ * data is the data, length is its size in bytes
+ */
+static void session_send(Bench* bench, Session* session, const char* data,
+        size_t length) {
+    OutFrame* frame = frame_create(data, length);
+    session_send_frame(bench, session, frame);
+    frame_release(frame);
+}
+
+/**
+ * Starts connecting the clients waiting their turn, keeping at most
+ * BENCH_HANDSHAKES of them joining at once.
+ * bench is the run
+ */
+static void bench_connect(Bench* bench) {
+    while (bench->idleCount && bench->connecting < bench->handshakes &&
+            bench->phase != PHASE_DRAIN) {
+        Session* session = &(bench->sessions[bench->idle[--bench->idleCount]]);
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0 || (connect(fd, bench->address->ai_addr,
+                bench->address->ai_addrlen) && errno != EINPROGRESS)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            bench->failures++;
+            bench->idle[bench->idleCount++] = session->index;
+            return; // Try again next time round
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = session;
+        epoll_ctl(bench->epollFd, EPOLL_CTL_ADD, fd, &event);
+        session->fd = fd;
+        session->state = SESSION_CONNECTING;
+        session->taken = 0;
+        session->connectAt = now_usec();
+        line_init(&(session->in), MAX_LINE);
+        outq_init(&(session->out), ~0u, ~(size_t)0, OUTQ_DISCONNECT);
+        bench->connecting++;
+    }
+}
+
+/**
+ * Handles a MSG: line, the text starts with when its SAY: was sent.
+ * bench is the run
+ * command is the parsed line
+ * now is the current time(microsecond)
+ */
+static void bench_delivered(Bench* bench, Command* command, long long now) {
+    size_t nameLength;
+    char* text = protocol_field(command, &nameLength);
+    long long sentAt = strtoll(text, NULL, 10);
+    bench->delivered++;
+    bench->lastDelivery = now;
+    if (sentAt > 0 && sentAt <= now) {
+        hist_record(&(bench->fanOut), now - sentAt);
+    }
+}
+
+/**
+ * Handles a line from the server, playing the client's side of the
+ * protocol(AUTH:, WHO:, NAME_TAKEN:, OK:) and timing replies.
+ * bench is the run
+ * session is the client the line came to
+ * line is the line, length is its size in bytes
+ * now is the current time(microsecond)
+ */
+static void session_line(Bench* bench, Session* session, char* line,
+        size_t length, long long now) {
+    char reply[64];
+    Command command;
+    OutFrame* frame;
+    switch (protocol_parse(line, length, &command)) {
+        case CMD_AUTH:
+            frame = frame_format("AUTH:%s\n", bench->auth);
+            session_send_frame(bench, session, frame);
+            frame_release(frame);
+            break;
+        case CMD_WHO:
+            session_send(bench, session, reply, snprintf(reply,
+                    sizeof(reply), "NAME:%s\n", session->name));
+            break;
+        case CMD_NAME_TAKEN: // Left over from an earlier run, try another
+            snprintf(session->name, sizeof(session->name), "bench%d_%d",
+                    session->index, ++session->taken);
+            break;
+        case CMD_OK:
+            if (session->state == SESSION_AUTH) {
+                session->state = SESSION_NAME;
+                break;
+            }
+            session->state = SESSION_CHAT;
+            session->chatIndex = bench->chatCount;
+            bench->chatting[bench->chatCount++] = session->index;
+            bench->connecting--;
+            bench->joins++;
+            hist_record(&(bench->joinTime), now - session->connectAt);
+            break;
+        case CMD_MSG:
+            bench_delivered(bench, &command, now);
+            break;
+        case CMD_LIST:
+            if (session->listAt) {
+                hist_record(&(bench->listTime), now - session->listAt);
+                session->listAt = 0;
+            }
+            break;
+        case CMD_KICK:
+            bench->kicked++;
+            session_close(bench, session);
+            break;
+        default: // ENTER:, LEAVE: and anything else
+            break;
+    }
+}
+
+/**
+ * Reads from a client's connection until its socket is drained(edge
+ * triggered), handling each line.
+ * bench is the run
+ * session is the client
+ */
+static void session_read(Bench* bench, Session* session) {
+    long long now = now_usec();
+    while (session->state != SESSION_IDLE) {
+        size_t length;
+        char* line;
+        while (session->state != SESSION_IDLE &&
+                (line = line_next(&(session->in), &length)) != NULL) {
+            session_line(bench, session, line, length, now);
+        }
+        if (session->state == SESSION_IDLE) {
+            return;
+        }
+        ssize_t got = line_fill(&(session->in), session->fd);
+        if (got > 0) {
+            bench->bytesIn += got;
+        } else if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else { // Server hung up on the client
+            if (session->state == SESSION_CHAT) {
+                bench->lost++;
+            } else {
+                bench->failures++;
+            }
+            session_close(bench, session);
+            return;
+        }
+    }
+}
+
+/**
+ * Handles an event on a client's connection.
+ * bench is the run
+ * session is the client
+ * events is what happened(EPOLLIN, EPOLLOUT, ...)
+ */
+static void session_event(Bench* bench, Session* session, uint32_t events) {
+    if (session->state == SESSION_CONNECTING) {
+        int error = 0;
+        socklen_t size = sizeof(int);
+        getsockopt(session->fd, SOL_SOCKET, SO_ERROR, &error, &size);
+        if (error) {
+            bench->failures++;
+            session_close(bench, session);
+            return;
+        }
+        session->state = SESSION_AUTH;
+    }
+    if (events & EPOLLOUT) {
+        session_flush(bench, session);
+    }
+    if (session->state != SESSION_IDLE &&
+            (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        session_read(bench, session);
+    }
+}
+
+/**
+ * Picks a client in the chat at random.
+ * bench is the run, at least one client must be in the chat
+ * Returns the client
+ */
+static Session* bench_pick(Bench* bench) {
+    return &(bench->sessions[bench->chatting[random() % bench->chatCount]]);
+}
+
+/**
+ * Sends one command from a random client, picked by the configured mix.
+ * SAY: carries the time it was sent, for the fan-out latency.
+ * bench is the run
+ * now is the current time(microsecond)
+ */
+static void bench_command(Bench* bench, long long now) {
+    if (!bench->chatCount) {
+        return;
+    }
+    Session* session = bench_pick(bench);
+    long pick = random() % (bench->sayWeight + bench->listWeight +
+            bench->kickWeight);
+
+    if (pick < bench->sayWeight) {
+        OutFrame* frame = frame_format("SAY:%lld %s\n", now, bench->padding);
+        session_send_frame(bench, session, frame);
+        frame_release(frame);
+        bench->says++;
+    } else if (pick < bench->sayWeight + bench->listWeight) {
+        if (!session->listAt) { // One at a time, so replies can be timed
+            session->listAt = now;
+            session_send(bench, session, "LIST:\n", strlen("LIST:\n"));
+            bench->lists++;
+        }
+    } else {
+        Session* victim = bench_pick(bench);
+        if (victim != session && !victim->kickPending) {
+            char kick[64];
+            victim->kickPending = 1;
+            session_send(bench, session, kick, snprintf(kick, sizeof(kick),
+                    "KICK:%s\n", victim->name));
+            bench->kicks++;
+        }
+    }
+}
+
+/**
+ * Runs the event loop through one phase of the run:
+ *     -PHASE_JOIN -> until every client is in the chat
+ *     -PHASE_LOAD -> sends BENCH_RATE commands a second for BENCH_SECONDS,
+ *     clients kicked or dropped join again
+ *     -PHASE_DRAIN -> until MSG: stop coming in
+ * bench is the run
+ * phase is the phase to run
+ * Returns how long the phase took(microsecond)
+ */
+static long long bench_phase(Bench* bench, int phase) {
+    struct epoll_event events[MAX_EVENTS];
+    long long start = now_usec(), now = start;
+    unsigned long long issued = 0;
+    bench->phase = phase;
+    bench->lastDelivery = start;
+
+    while (1) {
+        now = now_usec();
+        if (phase == PHASE_JOIN && (bench->chatCount == bench->clients ||
+                now - start > JOIN_TIMEOUT)) {
+            break;
+        } else if (phase == PHASE_LOAD &&
+                now - start >= bench->seconds * USEC) {
+            break;
+        } else if (phase == PHASE_DRAIN && (now - start > DRAIN_TIMEOUT ||
+                now - bench->lastDelivery > DRAIN_QUIET)) {
+            break;
+        }
+
+        bench_connect(bench);
+        if (phase == PHASE_LOAD) {
+            unsigned long long due = (now - start) * bench->rate / USEC;
+            for (; issued < due; issued++) {
+                bench_command(bench, now);
+            }
+        }
+        int ready = epoll_wait(bench->epollFd, events, MAX_EVENTS, 1);
+        for (int i = 0; i < ready; i++) {
+            session_event(bench, events[i].data.ptr, events[i].events);
+        }
+    }
+    return now - start;
+}
+
+/**
+ * Prints a histogram's percentiles on one line.
+ * label is what was measured
+ * hist is the histogram, in microseconds
+ */
+static void bench_print_latency(const char* label, const Histogram* hist) {
+    printf("%s(us): count %llu p50 %llu p99 %llu p999 %llu max %llu\n",
+            label, hist->count, hist_percentile(hist, 50),
+            hist_percentile(hist, 99), hist_percentile(hist, 99.9),
+            hist->max);
+}
+
+/**
+ * Prints the results of a run.
+ * bench is the run
+ * joinTime is how long it took everyone to join(microsecond)
+ * loadTime is how long load was applied(microsecond)
+ */
+static void bench_report(Bench* bench, long long joinTime,
+        long long loadTime) {
+    double joinSeconds = joinTime / (double)USEC;
+    double loadSeconds = loadTime > 0 ? loadTime / (double)USEC : 1;
+    printf("clients %ld joined %llu in %.3fs(%.0f joins/s) rejoined %llu "
+            "failed %llu\n", bench->clients, bench->firstJoins, joinSeconds,
+            joinSeconds > 0 ? bench->firstJoins / joinSeconds : 0,
+            bench->joins - bench->firstJoins, bench->failures);
+    printf("sent SAY %llu(%.0f/s) LIST %llu KICK %llu over %.3fs\n",
+            bench->says, bench->says / loadSeconds, bench->lists,
+            bench->kicks, loadSeconds);
+    printf("delivered MSG %llu(%.0f/s) bytes in %llu(%.0f/s)\n",
+            bench->delivered, bench->delivered / loadSeconds,
+            bench->bytesIn, bench->bytesIn / loadSeconds);
+    printf("kicked %llu lost %llu\n", bench->kicked, bench->lost);
+    bench_print_latency("join", &(bench->joinTime));
+    bench_print_latency("fan-out", &(bench->fanOut));
+    bench_print_latency("list", &(bench->listTime));
+}
+
+/**
+ * Load generator for the chat server. Simulates BENCH_CLIENTS clients from
+ * one thread with non-blocking sockets, each going through AUTH: and name
+ * negotiation, then sends a mix of SAY:, LIST: and KICK: and reports join
+ * rate, throughput and latency. The server's SAY: rate limit should be
+ * lifted(CHAT_SAY_RATE=0) for rates above 10 a second per client.
+ * Exit with 1 on a usage error, 2 if nobody could join.
+ */
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: bench authfile port\n");
+        exit(ARG_ERROR);
+    }
+    FILE* auth = fopen(argv[1], "r");
+    if (auth == NULL) {
+        fprintf(stderr, "Usage: bench authfile port\n");
+        exit(ARG_ERROR);
+    }
+
+    Bench bench;
+    memset(&bench, 0, sizeof(Bench));
+    bench_configure(&bench);
+    bench.auth = get_auth_line(auth);
+    fclose(auth);
+    bench.address = addr_set_up(argv[2], CLIENT_CALL);
+    bench.epollFd = epoll_create1(0);
+    bench.padding = malloc(bench.size + 1);
+    memset(bench.padding, 'x', bench.size);
+    bench.padding[bench.size] = '\0';
+    hist_init(&(bench.joinTime));
+    hist_init(&(bench.fanOut));
+    hist_init(&(bench.listTime));
+    raise_fd_limit();
+    srandom(1); // Same commands every run
+
+    bench.sessions = calloc(bench.clients, sizeof(Session));
+    bench.idle = malloc(bench.clients * sizeof(int));
+    bench.chatting = malloc(bench.clients * sizeof(int));
+    for (long i = bench.clients - 1; i >= 0; i--) {
+        Session* session = &(bench.sessions[i]);
+        session->fd = -1;
+        session->index = i;
+        snprintf(session->name, sizeof(session->name), "bench%ld", i);
+        bench.idle[bench.idleCount++] = i;
+    }
+
+    long long joinTime = bench_phase(&bench, PHASE_JOIN);
+    bench.firstJoins = bench.joins;
+    if (!bench.chatCount) {
+        fprintf(stderr, "Communications error\n");
+        exit(COM_ERROR);
+    }
+    long long loadTime = bench_phase(&bench, PHASE_LOAD);
+    bench_phase(&bench, PHASE_DRAIN);
+    bench_report(&bench, joinTime, loadTime);
+    return NORM_EXIT;
+}
@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chatlog.h"
+#include "metrics.h"
+#include "mpsc.h"
+
+/* Segments start with enough room for this many index strides */
+#define LOG_MIN_SEGMENT (4 * LOG_INDEX_EVERY)
+
+/* An event waiting for the writer thread */
+typedef struct LogEvent {
+    MpscNode node;
+    int type;
+    int64_t time;
+    size_t roomLength;
+    size_t nameLength;
+    size_t textLength;
+    char data[]; // Room's name, client's name then text, as in a record
+} LogEvent;
+
+/* The log being written. Everything but the queue and the wake up belongs
+ * to the writer thread. */
+typedef struct ChatLog {
+    char* dir;
+    size_t segmentSize; // Size new segments are made with
+    int sync; // Each batch is flushed to disk before the next is written
+    char* map; // Segment being written, NULL if it couldn't be opened
+    size_t mapSize;
+    int indexFd; // Its index
+    int indexDirty; // Index written to since the last commit
+    size_t offset; // Where the next record goes
+    size_t synced; // Records before this have been committed
+    size_t indexed; // Offset of the latest index entry, 0 if none yet
+    uint64_t nextSeq;
+    int64_t lastTime; // Of the latest record, times never go backwards
+    MpscQueue queue;
+    int wakeFd; // Written to when events are pushed, see chatlog_append
+    int wakePending; // A wake up is already on its way
+} ChatLog;
+
+/* Log events are appended to, NULL if CHAT_LOG is unset */
+static ChatLog* chatLog = NULL;
+
+/**
+ * Determines the time now, as recorded in the log.
+ * Returns the time(nanosecond, since the epoch)
+ */
+static int64_t log_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Works out the path of one of a log's files, named after the sequence
+ * number of the segment's first record so they sort in order.
+ * path is filled in, size is its size in bytes
+ * dir is the log's directory
+ * first is the sequence number of the segment's first record
+ * suffix is "log" for the segment, "idx" for its index
+ */
+static void log_path(char* path, size_t size, const char* dir,
+        uint64_t first, const char* suffix) {
+    snprintf(path, size, "%s/%020llu.%s", dir, (unsigned long long)first,
+            suffix);
+}
+
+/**
+ * Orders sequence numbers, for qsort.
+ * a and b are the sequence numbers to compare
+ * Returns less than, equal to or more than 0 as a is before, the same as or
+ * after b
+ */
+static int log_compare(const void* a, const void* b) {
+    uint64_t first = *(const uint64_t*)a;
+    uint64_t second = *(const uint64_t*)b;
+    return first < second ? -1 : first > second;
+}
+
+/**
+ * Lists the segments of a log.
+ * dir is the log's directory
+ * segments is set to the first sequence number of each segment, in order
+ * (to be freed)
+ * count is set to the number of segments
+ * Returns 0, -1 if the directory can't be read
+ */
+static int log_segments(const char* dir, uint64_t** segments,
+        size_t* count) {
+    DIR* listing = opendir(dir);
+    if (listing == NULL) {
+        return -1;
+    }
+    size_t size = 16;
+    uint64_t* found = malloc(size * sizeof(uint64_t));
+    *count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(listing)) != NULL) {
+        char* end;
+        unsigned long long first = strtoull(entry->d_name, &end, 10);
+        if (end == entry->d_name || strcmp(end, ".log")) {
+            continue; // An index or something else entirely
+        }
+        if (*count == size) {
+            size *= 2;
+            found = realloc(found, size * sizeof(uint64_t));
+        }
+        found[(*count)++] = first;
+    }
+    closedir(listing);
+    qsort(found, *count, sizeof(uint64_t), log_compare);
+    *segments = found;
+    return 0;
+}
+
+/**
+ * Opens the segment being written, making it if it doesn't exist yet. New
+ * segments have their space allocated up front, so a full disk fails here
+ * rather than as a fault while writing through the mapping.
+ * log is the log, with no segment open
+ * first is the sequence number of the segment's first record
+ * least is the fewest bytes a new segment may have
+ * Returns 0, -1 if the segment can't be opened
+ */
+static int log_segment_open(ChatLog* log, uint64_t first, size_t least) {
+    char path[PATH_MAX];
+    log_path(path, sizeof(path), log->dir, first, "log");
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat info;
+    size_t size = fstat(fd, &info) < 0 ? 0 : info.st_size;
+    int fresh = size < LOG_HEADER;
+    if (fresh) {
+        size = log->segmentSize > least ? log->segmentSize : least;
+        if (posix_fallocate(fd, 0, size)) {
+            close(fd);
+            return -1;
+        }
+    }
+    char* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the file open
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (fresh) {
+        memcpy(map, LOG_MAGIC, strlen(LOG_MAGIC));
+        memcpy(map + strlen(LOG_MAGIC), &first, sizeof(first));
+    } else if (memcmp(map, LOG_MAGIC, strlen(LOG_MAGIC))) {
+        munmap(map, size);
+        return -1;
+    }
+
+    log_path(path, sizeof(path), log->dir, first, "idx");
+    log->indexFd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+            0644);
+    if (log->indexFd < 0) {
+        munmap(map, size);
+        return -1;
+    }
+    log->map = map;
+    log->mapSize = size;
+    log->offset = LOG_HEADER;
+    log->synced = LOG_HEADER;
+    log->indexed = 0;
+    log->indexDirty = 0;
+    return 0;
+}
+
+/**
+ * Finds where writing left off in a segment opened again on start up, the
+ * first record with length 0 or one that runs past the segment.
+ * log is the log, its latest segment open
+ * first is the sequence number of the segment's first record
+ */
+static void log_segment_recover(ChatLog* log, uint64_t first) {
+    log->nextSeq = first;
+    while (log->offset + sizeof(LogRecord) <= log->mapSize) {
+        LogRecord* record = (LogRecord*)(log->map + log->offset);
+        if (record->length < sizeof(LogRecord) ||
+                record->length > log->mapSize - log->offset) {
+            break;
+        }
+        log->nextSeq = record->seq + 1;
+        log->lastTime = record->time;
+        log->offset += record->length;
+    }
+    log->synced = log->offset;
+
+    LogIndexEntry entry;
+    off_t end = lseek(log->indexFd, 0, SEEK_END);
+    if (end >= (off_t)sizeof(entry) && pread(log->indexFd, &entry,
+            sizeof(entry), end - end % sizeof(entry) - sizeof(entry)) ==
+            sizeof(entry)) {
+        log->indexed = entry.offset;
+    }
+}
+
+/**
+ * Commits the records written since the last commit, as one group. Unless
+ * CHAT_LOG_SYNC is 0 they are flushed to disk first, otherwise the kernel
+ * writes them back in its own time.
+ * log is the log
+ */
+static void log_commit(ChatLog* log) {
+    if (log->map == NULL || log->offset == log->synced) {
+        return;
+    }
+    if (log->sync) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = log->synced - log->synced % page;
+        msync(log->map + start, log->offset - start, MS_SYNC);
+        if (log->indexDirty) {
+            fdatasync(log->indexFd);
+        }
+    }
+    log->synced = log->offset;
+    log->indexDirty = 0;
+    metric_add(METRIC_LOG_COMMITS, 1);
+}
+
+/**
+ * Closes the segment being written, once it has been committed.
+ * log is the log
+ */
+static void log_segment_close(ChatLog* log) {
+    log_commit(log);
+    munmap(log->map, log->mapSize);
+    close(log->indexFd);
+    log->map = NULL;
+}
+
+/**
+ * Copies an event into the segment being written as the next record,
+ * moving on to a new segment once it is full. Readers take the record once
+ * its length is set, so that is stored last. An event that can't be
+ * written, the disk being full, is lost.
+ * log is the log
+ * event is the event
+ */
+static void log_write(ChatLog* log, LogEvent* event) {
+    size_t data = event->roomLength + event->nameLength + event->textLength;
+    size_t length = (sizeof(LogRecord) + data + 7) & ~(size_t)7;
+    if (log->map != NULL && log->offset + length > log->mapSize) {
+        log_segment_close(log);
+    }
+    if (log->map == NULL && log_segment_open(log, log->nextSeq,
+            LOG_HEADER + length) < 0) {
+        return;
+    }
+
+    LogRecord* record = (LogRecord*)(log->map + log->offset);
+    record->type = event->type;
+    record->roomLength = event->roomLength;
+    record->nameLength = event->nameLength;
+    record->textLength = event->textLength;
+    record->reserved = 0;
+    record->seq = log->nextSeq;
+    record->time = event->time > log->lastTime ? event->time : log->lastTime;
+    memcpy(record + 1, event->data, data); // Padding is still zeroes
+    __atomic_store_n(&(record->length), length, __ATOMIC_RELEASE);
+
+    if (log->indexed == 0 || log->offset - log->indexed >= LOG_INDEX_EVERY) {
+        LogIndexEntry entry = {record->seq, record->time, log->offset};
+        if (write(log->indexFd, &entry, sizeof(entry)) == sizeof(entry)) {
+            log->indexed = log->offset;
+            log->indexDirty = 1;
+        }
+    }
+    log->lastTime = record->time;
+    log->nextSeq++;
+    log->offset += length;
+    metric_add(METRIC_LOGGED, 1);
+}
+
+/**
+ * Thread routine writing the log. Takes every event waiting, writes them
+ * and commits them together, so while one commit waits on the disk the
+ * events arriving meanwhile gather into the next.
+ * arg is the log
+ * Returns nothing, runs for as long as the server does
+ */
+static void* log_writer(void* arg) {
+    ChatLog* log = arg;
+    for (;;) {
+        uint64_t wakes;
+        while (read(log->wakeFd, &wakes, sizeof(wakes)) < 0 &&
+                errno == EINTR) {
+        }
+        __atomic_store_n(&(log->wakePending), 0, __ATOMIC_SEQ_CST);
+        MpscNode* node;
+        while ((node = mpsc_pop(&(log->queue))) != NULL) {
+            log_write(log, (LogEvent*)node);
+            free(node);
+        }
+        log_commit(log);
+    }
+    return NULL;
+}
+
+/**
+ * Opens the chat log, carrying on from the end of its latest segment if it
+ * has one, and starts its writer thread.
+ * dir is the directory the log's files are kept in(see CHAT_LOG)
+ * segmentSize is the size of each segment in bytes(see CHAT_LOG_SEGMENT)
+ * sync is whether each batch of records is flushed to disk
+ * Returns 0, -1 if the log can't be opened
+ */
+int chatlog_start(const char* dir, size_t segmentSize, int sync) {
+    ChatLog* log = calloc(1, sizeof(ChatLog));
+    log->dir = strdup(dir);
+    log->segmentSize = segmentSize > LOG_MIN_SEGMENT ? segmentSize :
+            LOG_MIN_SEGMENT;
+    log->sync = sync;
+    mkdir(dir, 0755); // Fine if it already exists
+
+    uint64_t* segments;
+    size_t count;
+    if (log_segments(dir, &segments, &count) < 0) {
+        free(log->dir);
+        free(log);
+        return -1;
+    }
+    uint64_t first = count ? segments[count - 1] : 0;
+    free(segments);
+    if (log_segment_open(log, first, LOG_MIN_SEGMENT) < 0) {
+        free(log->dir);
+        free(log);
+        return -1;
+    }
+    log_segment_recover(log, first);
+
+    mpsc_init(&(log->queue));
+    log->wakeFd = eventfd(0, EFD_CLOEXEC);
+    pthread_t writer;
+    pthread_create(&writer, NULL, &log_writer, log);
+    pthread_detach(writer);
+    chatLog = log;
+    return 0;
+}
+
+/**
+ * Determines whether events are being logged.
+ * Returns 1 if they are, 0 if CHAT_LOG is unset
+ */
+int chatlog_enabled(void) {
+    return chatLog != NULL;
+}
+
+/**
+ * Queues an event for the log's writer thread. Only copies the event and
+ * wakes the writer if it isn't awake already, so it never waits on the
+ * disk. Safe to call from any thread, does nothing if the log is off.
+ * type is the event(LOG_*)
+ * room is the room's name, "" for the lobby
+ * name is the client's name
+ * text is the event's text, length is its size in bytes
+ */
+void chatlog_append(int type, const char* room, const char* name,
+        const char* text, size_t textLength) {
+    ChatLog* log = chatLog;
+    if (log == NULL) {
+        return;
+    }
+    size_t roomLength = strlen(room);
+    size_t nameLength = strlen(name);
+    LogEvent* event = malloc(sizeof(LogEvent) + roomLength + nameLength +
+            textLength);
+    event->type = type;
+    event->time = log_now();
+    event->roomLength = roomLength;
+    event->nameLength = nameLength;
+    event->textLength = textLength;
+    memcpy(event->data, room, roomLength);
+    memcpy(event->data + roomLength, name, nameLength);
+    memcpy(event->data + roomLength + nameLength, text, textLength);
+    mpsc_push(&(log->queue), &(event->node));
+    if (!__atomic_exchange_n(&(log->wakePending), 1, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        while (write(log->wakeFd, &one, sizeof(one)) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+/**
+ * Determines the name of a type of event, as LogRecord.type.
+ * type is the event(LOG_*)
+ * Returns the name, "?" if the type is unknown
+ */
+const char* chatlog_type_name(int type) {
+    switch (type) {
+        case LOG_MSG:
+            return "MSG";
+        case LOG_ENTER:
+            return "ENTER";
+        case LOG_LEAVE:
+            return "LEAVE";
+        case LOG_KICK:
+            return "KICK";
+        default:
+            return "?";
+    }
+}
+
+/**
+ * Maps one of a log's segments for reading, from its first record.
+ * reader is the reader
+ * segment is the segment's position in reader->segments
+ * Returns 0, -1 if it can't be mapped(nothing is mapped then)
+ */
+static int log_reader_map(LogReader* reader, size_t segment) {
+    if (reader->map != NULL) {
+        munmap(reader->map, reader->mapSize);
+        reader->map = NULL;
+    }
+    char path[PATH_MAX];
+    log_path(path, sizeof(path), reader->dir, reader->segments[segment],
+            "log");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_size < LOG_HEADER) {
+        close(fd);
+        return -1;
+    }
+    char* map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (memcmp(map, LOG_MAGIC, strlen(LOG_MAGIC))) {
+        munmap(map, info.st_size);
+        return -1;
+    }
+    reader->map = map;
+    reader->mapSize = info.st_size;
+    reader->current = segment;
+    reader->offset = LOG_HEADER;
+    return 0;
+}
+
+/**
+ * Reads the index of one of a log's segments.
+ * reader is the reader
+ * segment is the segment's position in reader->segments
+ * count is set to the number of entries
+ * Returns the entries(to be freed), NULL if there are none
+ */
+static LogIndexEntry* log_reader_index(LogReader* reader, size_t segment,
+        size_t* count) {
+    char path[PATH_MAX];
+    log_path(path, sizeof(path), reader->dir, reader->segments[segment],
+            "idx");
+    *count = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0 ||
+            info.st_size < (off_t)sizeof(LogIndexEntry)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    LogIndexEntry* entries = malloc(info.st_size);
+    ssize_t got = pread(fd, entries, info.st_size, 0);
+    close(fd);
+    if (got < (ssize_t)sizeof(LogIndexEntry)) {
+        free(entries);
+        return NULL;
+    }
+    *count = got / sizeof(LogIndexEntry);
+    return entries;
+}
+
+/**
+ * Opens a log for reading, from its first record.
+ * reader is the reader to set up
+ * dir is the log's directory
+ * Returns 0, -1 if the directory can't be read
+ */
+int log_reader_open(LogReader* reader, const char* dir) {
+    memset(reader, 0, sizeof(LogReader));
+    if (log_segments(dir, &(reader->segments), &(reader->count)) < 0) {
+        return -1;
+    }
+    reader->dir = strdup(dir);
+    if (reader->count) {
+        log_reader_map(reader, 0);
+    }
+    return 0;
+}
+
+/**
+ * Moves a reader to the first record numbered at least seq and no older
+ * than time. The indexes narrow it down to a stride of LOG_INDEX_EVERY
+ * bytes in one segment, only that stride is read through.
+ * reader is the reader
+ * seq is the lowest sequence number wanted, 0 for any
+ * time is the oldest time wanted(nanosecond, since the epoch), 0 for any
+ */
+void log_reader_seek(LogReader* reader, uint64_t seq, int64_t time) {
+    if (reader->count == 0) {
+        return;
+    }
+    // An entry is no further than the first record wanted if either of
+    // the two limits still lets it in
+    size_t segment = 0;
+    uint64_t offset = LOG_HEADER;
+    for (size_t i = reader->count; i-- > 0;) {
+        size_t count;
+        LogIndexEntry* entries = log_reader_index(reader, i, &count);
+        if (reader->segments[i] <= seq ||
+                (count && entries[0].time < time)) {
+            for (size_t j = 0; j < count; j++) {
+                if (entries[j].seq <= seq || entries[j].time < time) {
+                    offset = entries[j].offset;
+                }
+            }
+            segment = i;
+            free(entries);
+            break;
+        }
+        free(entries);
+    }
+
+    if (log_reader_map(reader, segment) < 0) {
+        return;
+    }
+    reader->offset = offset;
+    LogRecord* record;
+    while ((record = log_reader_next(reader)) != NULL) {
+        if (record->seq >= seq && record->time >= time) {
+            reader->offset = (char*)record - reader->map; // Read it next
+            break;
+        }
+    }
+}
+
+/**
+ * Reads the next record, moving on to the next segment at the end of one.
+ * Returns the record, only valid until the reader moves to another segment
+ * or is closed, NULL if there are no more(yet)
+ */
+LogRecord* log_reader_next(LogReader* reader) {
+    while (reader->map != NULL) {
+        if (reader->offset + sizeof(LogRecord) <= reader->mapSize) {
+            LogRecord* record = (LogRecord*)(reader->map + reader->offset);
+            uint32_t length = __atomic_load_n(&(record->length),
+                    __ATOMIC_ACQUIRE);
+            if (length >= sizeof(LogRecord) &&
+                    length <= reader->mapSize - reader->offset) {
+                reader->offset += length;
+                return record;
+            }
+        }
+        // Later segments are only made once this one is full
+        if (reader->current + 1 >= reader->count ||
+                log_reader_map(reader, reader->current + 1) < 0) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Closes a reader, its records can no longer be used.
+ * reader is the reader
+ */
+void log_reader_close(LogReader* reader) {
+    if (reader->map != NULL) {
+        munmap(reader->map, reader->mapSize);
+    }
+    free(reader->segments);
+    free(reader->dir);
+}
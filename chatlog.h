@@ -0,0 +1,70 @@
+#ifndef _CHATLOG_H
+#define _CHATLOG_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* Events the chat log records */
+#define LOG_MSG 1 // MSG: said, the text is what was said
+#define LOG_ENTER 2 // Client entered a room
+#define LOG_LEAVE 3 // Client left a room
+#define LOG_KICK 4 // Client kicked, the text is who kicked them
+
+/* Start of every segment, followed by the sequence number of its first
+ * record. Records start LOG_HEADER bytes in. */
+#define LOG_MAGIC "CHATLOG1"
+#define LOG_HEADER 64
+
+/* Records the index of a segment skips between entries, in bytes */
+#define LOG_INDEX_EVERY (64 * 1024)
+
+/* One event in a segment, followed by the room's name, the client's name
+ * and the text, none of them terminated, then padding to a multiple of 8.
+ * A record with length 0 marks the end of what has been written. */
+typedef struct LogRecord {
+    uint32_t length; // Of the whole record with its padding
+    uint32_t type; // LOG_*
+    uint32_t roomLength;
+    uint32_t nameLength;
+    uint32_t textLength;
+    uint32_t reserved; // 0
+    uint64_t seq; // Numbers every record ever written, from 0
+    int64_t time; // When the event happened(nanosecond, since the epoch)
+} LogRecord;
+
+/* One entry of a segment's index(its .idx file), made for the segment's
+ * first record and then every LOG_INDEX_EVERY bytes of records */
+typedef struct LogIndexEntry {
+    uint64_t seq;
+    int64_t time;
+    uint64_t offset; // Of the record in its segment
+} LogIndexEntry;
+
+/* Reads a chat log from start to end, following it into new segments */
+typedef struct LogReader {
+    char* dir;
+    uint64_t* segments; // First sequence number of each segment, in order
+    size_t count; // Number of segments
+    size_t current; // Segment being read
+    char* map; // Mapping of it, NULL if none
+    size_t mapSize;
+    size_t offset; // Of the next record in it
+} LogReader;
+
+int chatlog_start(const char* dir, size_t segmentSize, int sync);
+
+int chatlog_enabled(void);
+
+void chatlog_append(int type, const char* room, const char* name,
+        const char* text, size_t textLength);
+
+const char* chatlog_type_name(int type);
+
+int log_reader_open(LogReader* reader, const char* dir);
+
+void log_reader_seek(LogReader* reader, uint64_t seq, int64_t time);
+
+LogRecord* log_reader_next(LogReader* reader);
+
+void log_reader_close(LogReader* reader);
+
+#endif
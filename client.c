@@ -1,16 +1,79 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <sys/socket.h>
-#include <pthread.h>
 #include <math.h>
 #include "commonfunction.h"
+#include "linereader.h"
+#include "protocol.h"
+#include "config.h"
 
-#define DELAY 100000 
 #define NAME_DONE 1
 
+/* Longest line taken from the server, LIST: of a big chat is long */
+#define MAX_LINE (16 * 1024 * 1024)
+
+/* Set to 0 to stay on the text protocol when the server offers BIN: */
+#define ENV_BINARY "CHAT_BINARY"
+
+/* Set to a file of timed actions to run the sessions it names headless,
+ * see script_run */
+#define ENV_SCRIPT "CHAT_SCRIPT"
+
+/* Positions of stdin and the socket in the poll set */
+#define POLL_SERVER 0
+#define POLL_INPUT 1
+
+/* Returned by the session handlers while a session carries on, otherwise
+ * they return the status it ended with */
+#define SESSION_OPEN -1
+
+/* Digits a name can gain through NAME_TAKEN: */
+#define NAME_DIGITS 12
+
+/* Microseconds in a second */
+#define USEC 1000000LL
+
+/* A line a scripted session types, once it is due */
+typedef struct Action {
+    long long at; // When it is due(microsecond, from the start of the run)
+    char* line; // What is typed, as on stdin, empty for nothing
+} Action;
+
+/* Everything the client's loop works with. The socket is non-blocking,
+ * output to the server is buffered and written as the socket allows. */
+typedef struct ClientLoop {
+    Client* info;
+    LineReader reader; // From the server
+    LineReader input; // From stdin
+    char* out; // Waiting to be sent to the server
+    size_t outLength;
+    size_t outSent; // Of those, already sent
+    size_t outCapacity;
+    int authSent; // AUTH: answered, the reply tells if it was accepted
+    int inputDone; // stdin is closed, the connection is being wound down
+    int leaving; // LEAVE: sent, the server closing is expected
+    int shutDown; // Connection shut down for writing
+    int nameCounter; // Starts at -1 -> 0 ->... when NAME_TAKEN:
+    char* baseName;
+    char* label; // Session's name in the script, NULL when interactive
+    Action* actions; // Script's actions for the session, in order
+    size_t actionCount;
+    size_t nextAction; // First action not yet taken
+    int ended; // Connection closed, only for scripted sessions
+} ClientLoop;
+
+/* When the run started, output of scripted sessions is timed from it */
+static long long runStart = 0;
+
 /**
  * Returns the name of client with the case where duplicate exists
  * name is the name of the client i.e Fred
@@ -25,7 +88,7 @@ char* get_name(char* name, int nameCounter) {
     actualName[0] = '\0'; // Note: null terminator to remove garbage value
     strcat(actualName, name);
     // Converting int -> string
-    char* number = malloc(nLength * sizeof(char));
+    char* number = malloc((nLength + 1) * sizeof(char));
     sprintf(number, "%d", nameCounter);
     if (nameCounter > -1) { // Note: nameCounter > -1 if NAME_TAKEN is sent
         strcat(actualName, number);
@@ -35,134 +98,593 @@ char* get_name(char* name, int nameCounter) {
 }
 
 /**
- * Handles client deallocation process after connection is terminated by 
- * server.
- * read is for reading from server
- * write is for writing to server
- * details contains socket connection with server and name of client i.e Fred
- *
- */
-void free_client(FILE* read, FILE* write, Client* details) {
-    fclose(read);
-    fclose(write);
-    free(details);
-}
-
-/**
- * Actively reads commands coming through from the server side and process
- * each command(AUTH:, NAME:, ENTER:, LEAVE:, MSG:, KICK:).If invaid command,
- * do nothing.
- * details contains socket connection with server and name of client i.e Fred
- * Exit with 3 if kicked by server.
- * Exit with 2 if loses connection with server.
- */
-void* from_server(void* details) {
-    Client* info = (Client*)details;
-    int contact2 = dup(info->contact);
-    FILE* read = fdopen(info->contact, "r"), *write = fdopen(contact2, "w");
-    char* line, *sayName;
-    char* baseName = info->name;
-    int nameCounter = -1;// Starts at -1 -> 0 ->... when NAME_TAKEN:
-    pthread_mutex_lock(&(info->lock));
-
-    while ((line = read_line(read)) != NULL) {
-        char* saveRequest; // To store everything after ':'
-        char* request = strtok_r(line, ":", &saveRequest);
-        if (!strcmp(request, "AUTH")) {  
-            fprintf(write, "AUTH:%s\n",info->auth);
-            fflush(write);
-            line = read_line(read); // Handles authentication failure
-            if (line == NULL) {
-                fprintf(stderr, "Authentication error\n");
-                free_client(read, write, details);
-                exit(AUTH_ERROR);
+ * Determines the current time of a monotonic clock.
+ * Returns the time(microsecond)
+ */
+long long client_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * USEC + now.tv_nsec / 1000;
+}
+
+/**
+ * Prints output for the user. Output of a scripted session starts with
+ * the time since the start of the run and the session's name, so when each
+ * line came in can be analysed afterwards.
+ * loop is the client's loop
+ * format is the printf format, followed by its arguments
+ */
+void client_print(ClientLoop* loop, const char* format, ...) {
+    if (loop->label != NULL) {
+        long long elapsed = client_now() - runStart;
+        printf("%lld.%06lld %s ", elapsed / USEC, elapsed % USEC,
+                loop->label);
+    }
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+/**
+ * Sets up a client's loop for a connection to the server.
+ * name is the name to ask for i.e Fred(copied)
+ * auth is the authentication code
+ * contact is the socket connection with the server, made non-blocking
+ * Returns the new loop
+ */
+ClientLoop* client_open(const char* name, char* auth, int contact) {
+    ClientLoop* loop = calloc(1, sizeof(ClientLoop));
+    char* actualName = malloc(strlen(name) + NAME_DIGITS);
+    strcpy(actualName, name); // Room for what NAME_TAKEN: adds
+    loop->info = client_create(actualName, auth, contact, NULL, CLIENT_CALL);
+    loop->info->maxLine = MAX_LINE;
+    loop->info->binary = 0;
+    loop->baseName = strdup(name);
+    loop->nameCounter = -1;
+    line_init(&(loop->reader), MAX_LINE);
+    line_init(&(loop->input), MAX_LINE);
+    if (contact >= 0) {
+        fcntl(contact, F_SETFL, fcntl(contact, F_GETFL) | O_NONBLOCK);
+    }
+    return loop;
+}
+
+/**
+ * Handles client deallocation process once its connection is over.
+ * loop is the client's loop, holding its socket connection with the
+ * server and its name i.e Fred
+ */
+void free_client(ClientLoop* loop) {
+    line_free(&(loop->reader));
+    line_free(&(loop->input));
+    free(loop->out);
+    loop->out = NULL;
+    close(loop->info->contact);
+    free(loop->info->name);
+    client_free(loop->info);
+    loop->info = NULL;
+    free(loop->baseName);
+    loop->baseName = NULL;
+    for (size_t i = 0; i < loop->actionCount; i++) {
+        free(loop->actions[i].line);
+    }
+    free(loop->actions);
+    loop->actions = NULL;
+    loop->actionCount = 0;
+}
+
+/**
+ * Ends a session once its connection is over. The interactive client
+ * exits, with a message on stderr unless it is a normal exit. A scripted
+ * session prints how it ended and the rest carry on.
+ * loop is the client's loop
+ * status is how it ended, the exit status of the interactive client
+ */
+void client_end(ClientLoop* loop, int status) {
+    const char* message = status == AUTH_ERROR ? "Authentication error" :
+            status == KICKED_EXIT ? "Kicked" :
+            status == COM_ERROR ? "Communications error" : NULL;
+    if (loop->label == NULL) {
+        fflush(stdout);
+        if (message != NULL) {
+            fprintf(stderr, "%s\n", message);
+        }
+        char* auth = loop->info->auth; // Only scripted sessions share it
+        free_client(loop);
+        free(auth);
+        free(loop);
+        exit(status);
+    }
+    client_print(loop, "(%s)\n", message != NULL ? message : "Disconnected");
+    free_client(loop);
+    loop->ended = 1;
+}
+
+/**
+ * Adds data to what is waiting to be sent to the server. Nothing is
+ * written here, see client_flush.
+ * loop is the client's loop
+ * data is the data, length is its size in bytes
+ */
+void client_queue(ClientLoop* loop, const char* data, size_t length) {
+    if (loop->outSent == loop->outLength) { // All sent, start over
+        loop->outSent = 0;
+        loop->outLength = 0;
+    }
+    if (loop->outLength + length > loop->outCapacity) {
+        size_t capacity = loop->outCapacity ? loop->outCapacity : 4096;
+        while (capacity < loop->outLength + length) {
+            capacity *= 2;
+        }
+        loop->out = realloc(loop->out, capacity);
+        loop->outCapacity = capacity;
+    }
+    memcpy(loop->out + loop->outLength, data, length);
+    loop->outLength += length;
+}
+
+/**
+ * Writes as much of what is waiting for the server as the socket takes
+ * without blocking, the rest is written once poll says it can be. Once
+ * input is over and everything has been sent, the connection is shut down
+ * for writing.
+ * loop is the client's loop
+ * Returns SESSION_OPEN, COM_ERROR if the connection failed
+ */
+int client_flush(ClientLoop* loop) {
+    while (loop->outSent < loop->outLength) {
+        ssize_t sent = send(loop->info->contact, loop->out + loop->outSent,
+                loop->outLength - loop->outSent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return SESSION_OPEN;
+        } else if (sent < 0) {
+            return COM_ERROR;
+        }
+        loop->outSent += sent;
+    }
+    if (loop->inputDone && !loop->shutDown) {
+        shutdown(loop->info->contact, SHUT_WR);
+        loop->shutDown = 1;
+    }
+    return SESSION_OPEN;
+}
+
+/**
+ * Sends a command to the server, as a binary frame once binary framing has
+ * been agreed on.
+ * loop is the client's loop
+ * prefix goes before arg i.e "SAY:", empty if arg is a whole command
+ * arg is the rest of the command
+ */
+void send_command(ClientLoop* loop, const char* prefix, const char* arg) {
+    size_t length = strlen(prefix) + strlen(arg) + 1;
+    char* text = malloc(length + 1);
+    sprintf(text, "%s%s\n", prefix, arg);
+    if (!loop->info->binary) {
+        client_queue(loop, text, length);
+        free(text);
+        return;
+    }
+    size_t size = protocol_binary(NULL, text, length);
+    if (size) { // Anything that isn't a command is left out
+        char* frame = malloc(size);
+        protocol_binary(frame, text, length);
+        client_queue(loop, frame, size);
+        free(frame);
+    }
+    free(text);
+}
+
+/**
+ * Processes a command coming through from the server side(AUTH:, NAME:,
+ * ENTER:, LEAVE:, MSG:, KICK:, ...). If invalid command, do nothing.
+ * loop is the client's loop
+ * line is the command, length is its size in bytes
+ * Returns SESSION_OPEN, KICKED_EXIT if kicked by server
+ */
+int from_server(ClientLoop* loop, char* line, size_t length) {
+    Client* info = loop->info;
+    Command command;
+    char* text, *clientName;
+    size_t nameLength;
+    if (loop->authSent == 1) { // Reply to AUTH:, connection closes if wrong
+        loop->authSent = 2;
+        return SESSION_OPEN;
+    }
+    switch (protocol_decode(line, length, loop->reader.split != NULL,
+            &command)) {
+        case CMD_AUTH:
+            client_queue(loop, "AUTH:", strlen("AUTH:"));
+            client_queue(loop, info->auth, strlen(info->auth));
+            client_queue(loop, "\n", 1);
+            loop->authSent = 1;
+            break;
+        case CMD_OK:
+            (info->nameFlag)++; // NAME_DONE -> name negotiation is done
+            break;
+        case CMD_WHO:
+            send_command(loop, "NAME:", info->name);
+            break;
+        case CMD_BIN:
+            if (info->binary) { // Server's ack, frames from here on
+                loop->reader.split = protocol_split;
+            } else if (config_number(ENV_BINARY, 0, 1)) { // Offer
+                client_queue(loop, "BIN:\n", strlen("BIN:\n"));
+                info->binary = 1;
             }
-        } else if (!strcmp(request, "OK")) {
-            (info->nameFlag)++; // 2 -> implies name negotiation is done
-            pthread_mutex_unlock(&(info->lock));
-        } else if (!strcmp(request, "WHO")) {
-            fprintf(write, "NAME:%s\n", info->name);  
-        } else if (!strcmp(request, "NAME_TAKEN")) {
-            nameCounter++;
-            char* clientName = get_name(baseName, nameCounter);
+            break;
+        case CMD_NAME_TAKEN:
+            loop->nameCounter++;
+            clientName = get_name(loop->baseName, loop->nameCounter);
             strcpy(info->name, clientName);
             free(clientName);
-        } else if (!strcmp(request, "ENTER")) {
-            printf("(%s has entered the chat)\n", saveRequest);
-        } else if (!strcmp(request, "LEAVE")) {
-            printf("(%s has left the chat)\n", saveRequest);
-        } else if (!strcmp(request, "MSG")) {
-            sayName = strtok_r(NULL, ":", &saveRequest);
-            printf("%s: %s\n", sayName, saveRequest);
-        } else if (!strcmp(request, "KICK")) {
-            fprintf(stderr, "Kicked\n");
-            exit(KICKED_EXIT);
-        } else if (!strcmp(request, "LIST")) {
-            printf("(current chatters: %s)\n", saveRequest);
+            break;
+        case CMD_ENTER:
+            client_print(loop, "(%s has entered the chat)\n", command.arg);
+            break;
+        case CMD_LEAVE:
+            client_print(loop, "(%s has left the chat)\n", command.arg);
+            break;
+        case CMD_MSG:
+            text = protocol_field(&command, &nameLength);
+            client_print(loop, "%.*s: %s\n", (int)nameLength, command.arg,
+                    text);
+            break;
+        case CMD_KICK:
+            return KICKED_EXIT;
+        case CMD_LIST:
+            client_print(loop, "(current chatters: %s)\n", command.arg);
+            break;
+        default: // Anything else is ignored
+            break;
+    }
+    return SESSION_OPEN;
+}
+
+/**
+ * Sends a line typed by the user to the server. If the line begins with
+ * '*', send it whole(not including *) i.e *KICK: -> KICK:. Else, send it
+ * as a "SAY:" command. i.e Hello -> "SAY:Hello".
+ * loop is the client's loop
+ * line is the line, length is its size in bytes
+ */
+void to_server(ClientLoop* loop, char* line, size_t length) {
+    if (line[0] == '*') {
+        Command command;
+        line++; // Remove '*' before sending to server
+        if (protocol_parse(line, length - 1, &command) == CMD_LEAVE) {
+            loop->leaving = 1;
         }
-        fflush(write);
+        send_command(loop, "", line);
+    } else {
+        send_command(loop, "SAY:", line);
     }
-    usleep(DELAY); // When client loses connection with server
-    fprintf(stderr, "Communications error\n");
-    free_client(read, write, details);
-    exit(COM_ERROR);
 }
 
 /**
- * Actively reads client commands and send them to server. If command 
- * begins with '*', send them whole(not including*) i.e *KICK: -> KICK:.Else,
- * send to server as a "SAY:" command. i.e Hello -> "SAY:Hello".
- * Exit with 0 if loses connection with server.
+ * Reads everything the server has sent so far and handles each command.
+ * loop is the client's loop
+ * Returns SESSION_OPEN while the connection is open, otherwise how it
+ * ended: AUTH_ERROR if the server closed it in reply to AUTH:, NORM_EXIT
+ * if it did so after input was over or LEAVE: was sent, COM_ERROR if it
+ * did so otherwise, KICKED_EXIT if kicked by server
  */
-void* to_server(void* details) {
-    Client* info = (Client*)details;
-    FILE* write = fdopen(info->contact, "w");
-    char* commandLine;
-    usleep(DELAY);
+int read_server(ClientLoop* loop) {
+    char* line;
+    size_t length;
+    for (;;) {
+        while ((line = line_next(&(loop->reader), &length)) != NULL) {
+            int status = from_server(loop, line, length);
+            if (status != SESSION_OPEN) {
+                return status;
+            }
+        }
+        ssize_t got = line_fill(&(loop->reader), loop->info->contact);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return SESSION_OPEN;
+        } else if (got > 0) {
+            continue;
+        }
+        if (loop->authSent == 1) {
+            return AUTH_ERROR;
+        }
+        return loop->inputDone || loop->leaving ? NORM_EXIT : COM_ERROR;
+    }
+}
+
+/**
+ * Reads what is ready on stdin and sends each complete line. At end of
+ * file, a last line with no newline is still sent and the connection is
+ * shut down for writing once everything has been sent, so the server
+ * replies to what was sent and then closes it.
+ * loop is the client's loop
+ */
+void read_input(ClientLoop* loop) {
+    char* line;
+    size_t length;
+    ssize_t got = line_fill(&(loop->input), STDIN_FILENO);
+    if (got < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+    while ((line = line_next(&(loop->input), &length)) != NULL) {
+        to_server(loop, line, length);
+    }
+    if (got > 0) {
+        return;
+    }
+    LineReader* input = &(loop->input);
+    if (got == 0 && input->start < input->length && !input->tooLong) {
+        line_append(input, "\n", 1); // Unterminated last line
+        line = line_next(input, &length);
+        to_server(loop, line, length);
+    }
+    loop->inputDone = 1;
+}
+
+/**
+ * Runs the client: waits on the socket and, once the name has been agreed
+ * on, stdin, and handles whatever is ready. The handshake goes as fast as
+ * the server replies.
+ * loop is the client's loop, connected
+ * Exit with 0 once stdin is closed and the server has closed the
+ * connection, see read_server for the rest.
+ */
+void client_run(ClientLoop* loop) {
+    struct pollfd fds[2];
+    for (;;) {
+        int status = client_flush(loop);
+        if (status != SESSION_OPEN) {
+            client_end(loop, status);
+        }
+        fds[POLL_SERVER].fd = loop->info->contact;
+        fds[POLL_SERVER].events = POLLIN |
+                (loop->outSent < loop->outLength ? POLLOUT : 0);
+        fds[POLL_INPUT].fd = STDIN_FILENO;
+        fds[POLL_INPUT].events = POLLIN;
+        // Lines typed before the name is agreed on wait in stdin
+        int count = loop->info->nameFlag >= NAME_DONE && !loop->inputDone ?
+                2 : 1;
+        fflush(stdout);
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            client_end(loop, COM_ERROR);
+        }
+        if (fds[POLL_SERVER].revents & (POLLIN | POLLHUP | POLLERR)) {
+            status = read_server(loop);
+            if (status != SESSION_OPEN) {
+                client_end(loop, status);
+            }
+        }
+        if (count > POLL_INPUT && fds[POLL_INPUT].revents) {
+            read_input(loop);
+        }
+    }
+}
+
+/**
+ * Connects to the server.
+ * port is the server's port
+ * Returns the socket connection, -1 if it can't be made
+ */
+int client_connect(char* port) {
+    struct addrinfo* addressInfo = addr_set_up(port, CLIENT_CALL);
+    int connection = socket(AF_INET, SOCK_STREAM, 0);
+    int failed = connect(connection, addressInfo->ai_addr,
+            sizeof(struct sockaddr));
+    freeaddrinfo(addressInfo);
+    if (failed) {
+        close(connection);
+        return -1;
+    }
+    return connection;
+}
+
+/**
+ * Adds an action to a scripted session, after those due no later.
+ * loop is the session
+ * at is when it is due(microsecond, from the start of the run)
+ * line is what is typed(copied)
+ */
+void script_add(ClientLoop* loop, long long at, const char* line) {
+    loop->actions = realloc(loop->actions,
+            (loop->actionCount + 1) * sizeof(Action));
+    size_t i = loop->actionCount++;
+    for (; i > 0 && loop->actions[i - 1].at > at; i--) {
+        loop->actions[i] = loop->actions[i - 1];
+    }
+    loop->actions[i].at = at;
+    loop->actions[i].line = strdup(line);
+}
+
+/**
+ * Reads a script of timed actions, one per line as
+ *     ms session [line]
+ * where ms is when the action is due in milliseconds from the start of the
+ * run, session names the session taking it and line is typed as if on
+ * stdin(text to SAY:, or *LIST:, *KICK:name, *LEAVE:, ...). With no line
+ * the session types nothing, it just stays until then. Empty lines and
+ * lines starting with # are skipped. A session is opened for every name
+ * in the script.
+ * script is the script
+ * prefix goes before the name each session asks for
+ * auth is the authentication code
+ * count is set to the number of sessions
+ * end is set to when the last action is due
+ * Returns the sessions, not connected yet
+ * Exit with 1 if a line of the script is invalid
+ */
+ClientLoop** script_read(FILE* script, const char* prefix, char* auth,
+        size_t* count, long long* end) {
+    ClientLoop** sessions = NULL;
+    char* line;
+    *count = 0;
+    *end = 0;
+    while ((line = read_line(script)) != NULL) {
+        char* label;
+        char* rest;
+        long ms = strtol(line, &label, 10);
+        while (isspace((unsigned char)*label)) {
+            label++;
+        }
+        if (line[0] == '\0' || line[0] == '#') {
+            free(line);
+            continue;
+        } else if (label == line || ms < 0 || *label == '\0') {
+            fprintf(stderr, "Invalid %s: %s\n", ENV_SCRIPT, line);
+            exit(ARG_ERROR);
+        }
+        for (rest = label; *rest != '\0' && !isspace((unsigned char)*rest);
+                rest++) {
+        }
+        if (*rest != '\0') {
+            *rest++ = '\0'; // Only the one space after the name is dropped
+        }
 
-    while ((commandLine = read_line(stdin)) != NULL && (info->nameFlag)) {
-        if (commandLine[0] == '*') {
-            commandLine++; // Remove '*' before sending to server
-            fprintf(write, "%s\n", commandLine);      
-            fflush(write);
-        } else {
-            fprintf(write, "SAY:%s\n", commandLine);
-            fflush(write);
+        ClientLoop* loop = NULL;
+        for (size_t i = 0; i < *count && loop == NULL; i++) {
+            if (!strcmp(sessions[i]->label, label)) {
+                loop = sessions[i];
+            }
+        }
+        if (loop == NULL) {
+            char* name = malloc(strlen(prefix) + strlen(label) + 1);
+            sprintf(name, "%s%s", prefix, label);
+            loop = client_open(name, auth, -1);
+            loop->label = strdup(label);
+            free(name);
+            sessions = realloc(sessions, (*count + 1) * sizeof(ClientLoop*));
+            sessions[(*count)++] = loop;
         }
+        script_add(loop, ms * 1000LL, rest);
+        if (ms * 1000LL > *end) {
+            *end = ms * 1000LL;
+        }
+        free(line);
     }
+    return sessions;
+}
 
-    usleep(DELAY);
-    fclose(write);
-    free(details);
-    exit(NORM_EXIT);
+/**
+ * Runs scripted sessions, all from the one thread. Each session goes
+ * through the handshake like the interactive client, then takes its
+ * actions as they fall due. Once the last action of the whole script is
+ * due every session winds down like the interactive client at the end of
+ * stdin. Everything received is printed, timed, see client_print.
+ * sessions are the sessions, connected
+ * count is the number of sessions
+ * end is when the last action of the script is due
+ */
+void script_run(ClientLoop** sessions, size_t count, long long end) {
+    struct pollfd* fds = malloc(count * sizeof(struct pollfd));
+    ClientLoop** polled = malloc(count * sizeof(ClientLoop*));
+    for (;;) {
+        long long now = client_now() - runStart;
+        long long wait = now < end ? end - now : -1;
+        size_t open = 0;
+        for (size_t i = 0; i < count; i++) {
+            ClientLoop* loop = sessions[i];
+            if (loop->ended) {
+                continue;
+            }
+            int ready = loop->info->nameFlag >= NAME_DONE;
+            while (ready && loop->nextAction < loop->actionCount &&
+                    loop->actions[loop->nextAction].at <= now) {
+                char* line = loop->actions[loop->nextAction++].line;
+                if (line[0] != '\0') {
+                    to_server(loop, line, strlen(line));
+                }
+            }
+            if (ready && loop->nextAction < loop->actionCount) {
+                long long due = loop->actions[loop->nextAction].at - now;
+                wait = wait < 0 || due < wait ? due : wait;
+            } else if (now >= end && loop->nextAction == loop->actionCount) {
+                loop->inputDone = 1;
+            }
+            int status = client_flush(loop);
+            if (status != SESSION_OPEN) {
+                client_end(loop, status);
+                continue;
+            }
+            fds[open].fd = loop->info->contact;
+            fds[open].events = POLLIN |
+                    (loop->outSent < loop->outLength ? POLLOUT : 0);
+            polled[open++] = loop;
+        }
+        if (open == 0) {
+            break;
+        }
+        fflush(stdout);
+        if (poll(fds, open, wait < 0 ? -1 : (int)((wait + 999) / 1000)) <
+                0 && errno != EINTR) {
+            break;
+        }
+        for (size_t i = 0; i < open; i++) {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                int status = read_server(polled[i]);
+                if (status != SESSION_OPEN) {
+                    client_end(polled[i], status);
+                }
+            }
+        }
+    }
+    fflush(stdout);
+    free(fds);
+    free(polled);
 }
 
 int main(int argc, char* argv[]) {
-    usage_error(argc, argv[2], CLIENT_CALL); 
+    usage_error(argc, argv[2], CLIENT_CALL);
     char* port = argv[3];
-    struct addrinfo* addressInfo = addr_set_up(port, 1);
-    
-    int connection = socket(AF_INET, SOCK_STREAM, 0);
-    if ((connect(connection, addressInfo->ai_addr,
-            sizeof(struct sockaddr)))) {
+    FILE* auth = fopen(argv[2], "r");
+    char* authLine = get_auth_line(auth);
+    char* scriptFile = getenv(ENV_SCRIPT);
+    runStart = client_now();
+
+    if (scriptFile != NULL) { // Headless, name prefixes the sessions' names
+        FILE* script = fopen(scriptFile, "r");
+        if (script == NULL) {
+            fprintf(stderr, "Invalid %s: %s\n", ENV_SCRIPT, scriptFile);
+            free(authLine);
+            return ARG_ERROR;
+        }
+        size_t count;
+        long long end;
+        ClientLoop** sessions = script_read(script, argv[1], authLine,
+                &count, &end);
+        fclose(script);
+        for (size_t i = 0; i < count; i++) {
+            int connection = client_connect(port);
+            sessions[i]->info->contact = connection;
+            if (connection < 0) {
+                client_end(sessions[i], COM_ERROR);
+            } else {
+                fcntl(connection, F_SETFL,
+                        fcntl(connection, F_GETFL) | O_NONBLOCK);
+            }
+        }
+        script_run(sessions, count, end);
+        for (size_t i = 0; i < count; i++) {
+            free(sessions[i]->label);
+            free(sessions[i]);
+        }
+        free(sessions);
+        free(authLine);
+        return NORM_EXIT;
+    }
+
+    int connection = client_connect(port);
+    if (connection < 0) {
         fprintf(stderr, "Communications error\n");
+        free(authLine);
         return COM_ERROR;
     }
-    
-    FILE* auth = fopen(argv[2], "r");
-    char* authLine = get_auth_line(auth);
-    pthread_mutex_t lock;
-    pthread_mutex_init(&lock, NULL);
-    Client* details = client_create(argv[1], authLine, connection, NULL, 1);
-    details->lock = lock;
-    
-    pthread_t toServerId;
-    pthread_t fromServerId;
-    pthread_create(&toServerId, 0, to_server, details);
-    pthread_create(&fromServerId, 0, from_server, details);
-    pthread_join(toServerId, NULL);
-    pthread_join(fromServerId, NULL);
-
-    pthread_mutex_destroy(&lock);
+    client_run(client_open(argv[1], authLine, connection));
     return NORM_EXIT;
 }
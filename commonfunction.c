@@ -5,12 +5,16 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include "commonfunction.h"
+#include "pool.h"
 
 /* Number of possible client and server arguments */
 #define MAX_CLIENT_ARG 4
 #define SERVER_ARG_1 2
 #define SERVER_ARG_2 3
 
+/* Client structures, one per connection */
+static Pool clientPool = POOL_INIT(sizeof(Client));
+
 /**
  * Check usage errors for both client and server. Can either be called from
  * server or client side. However, both same error behaviours.
@@ -39,34 +43,20 @@ void usage_error(int argc, char* authfile, int type) {
 
 /**
  * Dynamically reads a stream per line and store it with enough memory. 
- * stream is the stream to read from i.e stdin.
- * Returns the whole line gotten from stream.
+ * Sockets and stdin go through a LineReader instead, this is for files.
+ * stream is the stream to read from i.e an auth file.
+ * Returns the whole line gotten from stream(newline removed).
  */
 char* read_line(FILE* stream) {
-    // actualSize->physical size, fullSize->what to reallocate to
-    int actualSize = 0, fullSize = 1;
-    char* line, c;
-    line = malloc(sizeof(char));
-
-    while (1) {
-        c = fgetc(stream);
-        if (c == EOF && actualSize == 0) {
-            free(line);
-            return NULL;
-        }
-
-        if (actualSize == fullSize - 1) { // Note: -1 -> safe memory management
-            fullSize *= 2; // If caught up, double memory
-            line = realloc(line, fullSize * sizeof(char));
-        }
-
-        if (c == EOF || c == '\n') {
-            // Reallocate to actualSize -> remove memory waste
-            line = realloc(line, (actualSize + 1) * sizeof(char));
-            line[actualSize] = '\0';
-            break;
-        }
-        line[actualSize++] = c; // Storing c into a string
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length = getline(&line, &capacity, stream); // Buffered by stdio
+    if (length < 0) {
+        free(line);
+        return NULL;
+    }
+    if (length && line[length - 1] == '\n') {
+        line[length - 1] = '\0';
     }
     return line;
 }
@@ -74,18 +64,23 @@ char* read_line(FILE* stream) {
 /**
  * Determines the authentication code which is on a single line. 
  * auth is a text file containing the authentication code.
- * Returns this authentication code, or "noauth" if the file is empty.
+ * Returns this authentication code(to be freed), or "noauth" if the file is
+ * empty.
  * (Note: "noauth" -> no authentication(any clients can join)).
  */
 char* get_auth_line(FILE* auth) {
-    char* authLine = "noauth";// Empty file implies no authentication
+    char* authLine = NULL;
     char* line;
     while ((line = read_line(auth)) != NULL) {
         if (line[0] != '\0') { // Ignores empty line
+            free(authLine);
             authLine = line;
+        } else {
+            free(line);
         }
     }
-    return authLine;
+    // Empty file implies no authentication
+    return authLine != NULL ? authLine : strdup("noauth");
 }
 
 /**
@@ -125,28 +120,37 @@ struct addrinfo* addr_set_up(char* port, int type) {
 /**
  * Creates a fake client structure with its relevant detail. Can either be 
  * called from client or server side leading to different behaviours.
- * Server -> adds everything else + firstClient
+ * Server -> adds everything else + roster
  * Client -> adds everything else + name
  * name is the name of client, auth is the authentication code, contact is the
- * socket connection, firstClient is the root client.
+ * socket connection, roster is the clients in the chat.
  * type signifies whether server is calling or client.
  *     1 -> client calling
  *     else -> server calling
  * returns the newly created client
  */
 Client* client_create(char* name, char* auth, int contact,
-        ClientInfo** firstClient, int type) {
-    Client* details = malloc(sizeof(Client)); // Allocating space before add
+        struct Roster* roster, int type) {
+    // Allocating space before add, from a pool as clients come and go
+    Client* details = pool_get(&clientPool);
     
     if (type == CLIENT_CALL) { // -> Client calling function
         details->name = name;
         details->nameFlag = 0; // Track if name negotiation is finished
     } else { // -> Server calling function
-        details->firstClient = malloc(sizeof(ClientInfo*));
-        details->firstClient = firstClient;
+        details->roster = roster;
     }
 
     details->auth = auth;
     details->contact = contact;
     return details;
 }
+
+/**
+ * Frees a client structure made by client_create. What it points to is
+ * left alone.
+ * details is the client
+ */
+void client_free(Client* details) {
+    pool_put(&clientPool, details);
+}
@@ -15,35 +15,37 @@
 #define KICKED_EXIT 3
 #define AUTH_ERROR 4
 
+/* What the stats threads need, the counts themselves are in metrics.c */
 typedef struct Stat {
-    int authC;
-    int nameC;
-    int sayC;
-    int kickC;
-    int listC;
-    int leaveC;
     sigset_t* signalSet;
-    struct ClientInfo** firstClient;
+    struct Roster* roster;
+    int metricsFd; // Listening socket for metrics scrapes, -1 if off
 } Stat;
 
 typedef struct Client {
     char* name;
     char* auth;
     int contact;
-    struct ClientInfo** firstClient;
-    struct Stat** statistics;
+    struct Roster* roster;
     int nameFlag;
-    pthread_mutex_t lock;
+    size_t maxLine; // Longest line accepted from the other side
+    int binary; // Client side: commands are sent as binary frames
+    pthread_mutex_t* lock;
 } Client;
 
 typedef struct ClientInfo {
     char* name;
     int contact;
-    FILE* write;
-    int say;
+    int say; // Per client stats, only written by the client's own thread
     int kick;
     int list;
-    struct ClientInfo* next;
+    struct Connection* conn; // Connection the client is sent to through
+    struct Room* room; // Room the client is in, NULL once out of the chat
+    struct ClientInfo* roomEntry; // Client's entry in its room's roster
+    unsigned long long hash; // Of the name, set by the roster
+    int levels; // Skip list levels the client is linked into
+    struct ClientInfo** skip; // Links above next, levels - 1 of them
+    struct ClientInfo* next; // Next client in name order
 } ClientInfo;
 
 void usage_error(int argc, char* authfile, int type);
@@ -55,6 +57,8 @@ char* get_auth_line(FILE* auth);
 struct addrinfo* addr_set_up(char* port, int type);
 
 Client* client_create(char* name, char* auth, int contact,
-        ClientInfo** firstClient, int type);
+        struct Roster* roster, int type);
+
+void client_free(Client* details);
 
 #endif
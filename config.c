@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "commonfunction.h"
+#include "config.h"
+#include "linereader.h"
+#include "logger.h"
+#include "outqueue.h"
+
+/* Default limits of a client's outbound queue */
+#define OUTQ_FRAMES 4096
+#define OUTQ_BYTES (1024 * 1024)
+
+/* Default SAY: limit of a client, same pace as the old fixed 100ms delay */
+#define SAY_RATE 10
+#define SAY_BURST 1
+
+/* Default size of a chat log segment */
+#define LOG_SEGMENT (64 * 1024 * 1024)
+
+/* Highest TCP port */
+#define PORT_MAX 65535
+
+/**
+ * Reports a configuration value that cannot be understood and exits.
+ * variable is the environment variable holding the value.
+ * value is the rejected value.
+ * Exit with 1 as this is a usage error.
+ */
+static void config_error(const char* variable, const char* value) {
+    fprintf(stderr, "Invalid %s: %s\n", variable, value);
+    exit(ARG_ERROR);
+}
+
+/**
+ * Reads a whole number setting from the environment.
+ * variable is the environment variable to read
+ * min is the smallest value accepted
+ * fallback is the value used if the variable is unset
+ * Returns the setting's value
+ * Exit with 1 if the value is not a number or is below min
+ */
+long config_number(const char* variable, long min, long fallback) {
+    char* value = getenv(variable);
+    char* end;
+    if (value == NULL) {
+        return fallback;
+    }
+    long number = strtol(value, &end, 10);
+    if (value[0] == '\0' || *end != '\0' || number < min) {
+        config_error(variable, value);
+    }
+    return number;
+}
+
+/**
+ * Loads the server's start-up configuration from the environment. Every
+ * setting is optional, anything unset keeps its default.
+ *     -CHAT_IO -> "threads" (default), "epoll" or "uring"(epoll if
+ *     io_uring is unavailable)
+ *     -CHAT_REACTORS -> number of event loops for epoll and uring, one per
+ *     core default
+ *     -CHAT_OUTQ_POLICY -> "disconnect" (default), "drop-oldest" or
+ *     "coalesce", what to do with a client too slow to keep up
+ *     -CHAT_OUTQ_FRAMES, CHAT_OUTQ_BYTES -> size of a client's outbound queue
+ *     -CHAT_SAY_RATE, CHAT_SAY_BURST -> SAY: per second and burst allowed
+ *     for each client, 10 and 1 default, rate 0 means unlimited
+ *     -CHAT_SAY_GLOBAL_RATE, CHAT_SAY_GLOBAL_BURST -> the same for all
+ *     clients together, unlimited default, burst defaults to a second's worth
+ *     -CHAT_SAY_POLICY -> "pace" (default) holds an early SAY: back until it
+ *     is allowed, "reject" drops it
+ *     -CHAT_MAX_LINE -> longest line a client may send, longer disconnects
+ *     -CHAT_METRICS_PORT -> localhost port serving metrics for Prometheus,
+ *     not served default
+ *     -CHAT_TRACE -> most recent timed stages kept and output on SIGUSR1
+ *     along with the latency of each stage, none kept default
+ *     -CHAT_FLUSH_USEC -> how long output to a client recently written to
+ *     is held back to be coalesced, 0 default
+ *     -CHAT_HISTORY, CHAT_HISTORY_REPLAY -> MSG: each room keeps for
+ *     replay, none default, and how many of them a client entering a room
+ *     is sent, all of them default
+ *     -CHAT_LOG -> directory MSG:, ENTER:, LEAVE: and KICK: events are
+ *     logged to, not logged default
+ *     -CHAT_LOG_SEGMENT -> size of each of the log's files in bytes, 64MiB
+ *     default
+ *     -CHAT_LOG_SYNC -> 1 (default) flushes each batch of logged events to
+ *     disk before the next, 0 leaves that to the kernel
+ *     -CHAT_OUTPUT_LEVEL -> "debug" (default) prints every event on stdout,
+ *     "info" leaves out messages, "warn" only prints clients dropped for
+ *     being too slow, "off" prints nothing
+ *     -CHAT_OUTPUT_FORMAT -> "text" (default), "kv" or "json", how events
+ *     are printed
+ * config is the structure to fill in.
+ * Exit with 1 if a setting is present but invalid.
+ */
+void config_load(Config* config) {
+    char* value;
+    config->ioMode = IO_THREADS;
+
+    if ((value = getenv(ENV_IO)) != NULL) {
+        if (!strcmp(value, "threads")) {
+            config->ioMode = IO_THREADS;
+        } else if (!strcmp(value, "epoll")) {
+            config->ioMode = IO_EPOLL;
+        } else if (!strcmp(value, "uring")) {
+            config->ioMode = IO_URING;
+        } else {
+            config_error(ENV_IO, value);
+        }
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    config->reactors = config_number(ENV_REACTORS, 1, cores > 0 ? cores : 1);
+
+    config->outqPolicy = OUTQ_DISCONNECT;
+    if ((value = getenv(ENV_OUTQ_POLICY)) != NULL) {
+        if (!strcmp(value, "disconnect")) {
+            config->outqPolicy = OUTQ_DISCONNECT;
+        } else if (!strcmp(value, "drop-oldest")) {
+            config->outqPolicy = OUTQ_DROP_OLDEST;
+        } else if (!strcmp(value, "coalesce")) {
+            config->outqPolicy = OUTQ_COALESCE;
+        } else {
+            config_error(ENV_OUTQ_POLICY, value);
+        }
+    }
+    config->outqFrames = config_number(ENV_OUTQ_FRAMES, 1, OUTQ_FRAMES);
+    config->outqBytes = config_number(ENV_OUTQ_BYTES, 1, OUTQ_BYTES);
+
+    config->sayRate = config_number(ENV_SAY_RATE, 0, SAY_RATE);
+    config->sayBurst = config_number(ENV_SAY_BURST, 1, SAY_BURST);
+    config->sayGlobalRate = config_number(ENV_SAY_GLOBAL_RATE, 0, 0);
+    config->sayGlobalBurst = config_number(ENV_SAY_GLOBAL_BURST, 1,
+            config->sayGlobalRate > 0 ? config->sayGlobalRate : 1);
+    config->sayPolicy = SAY_PACE;
+    if ((value = getenv(ENV_SAY_POLICY)) != NULL) {
+        if (!strcmp(value, "pace")) {
+            config->sayPolicy = SAY_PACE;
+        } else if (!strcmp(value, "reject")) {
+            config->sayPolicy = SAY_REJECT;
+        } else {
+            config_error(ENV_SAY_POLICY, value);
+        }
+    }
+    config->maxLine = config_number(ENV_MAX_LINE, 1, LINE_MAX_DEFAULT);
+    config->metricsPort = config_number(ENV_METRICS_PORT, 0, 0);
+    if (config->metricsPort > PORT_MAX) {
+        config_error(ENV_METRICS_PORT, getenv(ENV_METRICS_PORT));
+    }
+    config->traceEvents = config_number(ENV_TRACE, 0, 0);
+    config->flushUsec = config_number(ENV_FLUSH_USEC, 0, 0);
+    config->history = config_number(ENV_HISTORY, 0, 0);
+    config->historyReplay = config_number(ENV_HISTORY_REPLAY, 0,
+            config->history);
+    config->logDir = getenv(ENV_LOG);
+    if (config->logDir != NULL && config->logDir[0] == '\0') {
+        config->logDir = NULL;
+    }
+    config->logSegment = config_number(ENV_LOG_SEGMENT, 1, LOG_SEGMENT);
+    config->logSync = config_number(ENV_LOG_SYNC, 0, 1);
+    if (config->logSync > 1) {
+        config_error(ENV_LOG_SYNC, getenv(ENV_LOG_SYNC));
+    }
+
+    config->outputLevel = LEVEL_DEBUG;
+    if ((value = getenv(ENV_OUTPUT_LEVEL)) != NULL) {
+        if (!strcmp(value, "debug")) {
+            config->outputLevel = LEVEL_DEBUG;
+        } else if (!strcmp(value, "info")) {
+            config->outputLevel = LEVEL_INFO;
+        } else if (!strcmp(value, "warn")) {
+            config->outputLevel = LEVEL_WARN;
+        } else if (!strcmp(value, "off")) {
+            config->outputLevel = LEVEL_OFF;
+        } else {
+            config_error(ENV_OUTPUT_LEVEL, value);
+        }
+    }
+    config->outputFormat = FORMAT_TEXT;
+    if ((value = getenv(ENV_OUTPUT_FORMAT)) != NULL) {
+        if (!strcmp(value, "text")) {
+            config->outputFormat = FORMAT_TEXT;
+        } else if (!strcmp(value, "kv")) {
+            config->outputFormat = FORMAT_KV;
+        } else if (!strcmp(value, "json")) {
+            config->outputFormat = FORMAT_JSON;
+        } else {
+            config_error(ENV_OUTPUT_FORMAT, value);
+        }
+    }
+}
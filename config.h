@@ -0,0 +1,65 @@
+#ifndef _CONFIG_H
+#define _CONFIG_H
+#include <stddef.h>
+
+/* I/O models the server can be started with */
+#define IO_THREADS 1
+#define IO_EPOLL 2
+#define IO_URING 3
+
+/* What happens to a SAY: sent faster than the rate limit allows */
+#define SAY_PACE 1
+#define SAY_REJECT 2
+
+/* Environment variables read by config_load */
+#define ENV_IO "CHAT_IO"
+#define ENV_REACTORS "CHAT_REACTORS"
+#define ENV_OUTQ_POLICY "CHAT_OUTQ_POLICY"
+#define ENV_OUTQ_FRAMES "CHAT_OUTQ_FRAMES"
+#define ENV_OUTQ_BYTES "CHAT_OUTQ_BYTES"
+#define ENV_SAY_RATE "CHAT_SAY_RATE"
+#define ENV_SAY_BURST "CHAT_SAY_BURST"
+#define ENV_SAY_GLOBAL_RATE "CHAT_SAY_GLOBAL_RATE"
+#define ENV_SAY_GLOBAL_BURST "CHAT_SAY_GLOBAL_BURST"
+#define ENV_SAY_POLICY "CHAT_SAY_POLICY"
+#define ENV_MAX_LINE "CHAT_MAX_LINE"
+#define ENV_METRICS_PORT "CHAT_METRICS_PORT"
+#define ENV_TRACE "CHAT_TRACE"
+#define ENV_FLUSH_USEC "CHAT_FLUSH_USEC"
+#define ENV_HISTORY "CHAT_HISTORY"
+#define ENV_HISTORY_REPLAY "CHAT_HISTORY_REPLAY"
+#define ENV_LOG "CHAT_LOG"
+#define ENV_LOG_SEGMENT "CHAT_LOG_SEGMENT"
+#define ENV_LOG_SYNC "CHAT_LOG_SYNC"
+#define ENV_OUTPUT_LEVEL "CHAT_OUTPUT_LEVEL"
+#define ENV_OUTPUT_FORMAT "CHAT_OUTPUT_FORMAT"
+
+typedef struct Config {
+    int ioMode;
+    int reactors; // Number of event loops in reactor mode
+    int outqPolicy; // What to do with a client whose queue is full
+    unsigned int outqFrames; // Most frames queued for one client
+    size_t outqBytes; // Most bytes queued for one client
+    long sayRate; // SAY: per second allowed for each client, 0 unlimited
+    long sayBurst; // SAY: a client may send at once after being quiet
+    long sayGlobalRate; // SAY: per second allowed server wide, 0 unlimited
+    long sayGlobalBurst;
+    int sayPolicy; // What to do with a SAY: over the limit
+    size_t maxLine; // Longest line accepted from a client
+    long metricsPort; // Port metrics are served on, 0 if not served
+    long traceEvents; // Timed stages kept for SIGUSR1, 0 for none
+    long flushUsec; // Output held back to be coalesced(microsecond), 0 none
+    size_t history; // MSG: frames each room keeps, 0 none
+    size_t historyReplay; // Of those, sent to a client entering a room
+    char* logDir; // Directory events are logged to, NULL if not logged
+    size_t logSegment; // Size of each of the log's files
+    int logSync; // Each batch of logged events is flushed to disk
+    int outputLevel; // Lowest level of event printed(LEVEL_*)
+    int outputFormat; // How events are printed(FORMAT_*)
+} Config;
+
+long config_number(const char* variable, long min, long fallback);
+
+void config_load(Config* config);
+
+#endif
@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "epoch.h"
+
+/* Retired items collected before trying to free some */
+#define RECLAIM_EVERY 64
+
+/* A thread that reads shared data through epoch_enter */
+typedef struct EpochThread {
+    unsigned long epoch; // Epoch it entered in, 0 when outside
+    int depth; // Nested epoch_enter calls
+    int inUse; // Record belongs to a live thread
+    struct EpochThread* next;
+} EpochThread;
+
+/* Something unlinked from shared data, freed once no reader can see it */
+typedef struct Retired {
+    void* item;
+    void (*release)(void*);
+    unsigned long epoch; // Global epoch when it was retired
+    struct Retired* next;
+} Retired;
+
+/* Advances once every reader has caught up with it, never 0 */
+static unsigned long globalEpoch = 1;
+
+/* Every thread record ever made, records are reused but never freed */
+static EpochThread* threads = NULL;
+
+/* Items waiting to be freed, oldest last */
+static Retired* retired = NULL;
+static unsigned int retiredCount = 0;
+static pthread_mutex_t retiredLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Record of the calling thread, NULL until it first enters */
+static __thread EpochThread* self = NULL;
+
+/* Hands a thread's record back when it exits */
+static pthread_key_t exitKey;
+static pthread_once_t exitOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Marks the record of an exiting thread free for reuse.
+ * record is the exiting thread's record
+ */
+static void epoch_thread_exit(void* record) {
+    EpochThread* thread = record;
+    __atomic_store_n(&(thread->epoch), 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&(thread->inUse), 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Creates the key used to catch thread exits.
+ */
+static void epoch_key_create(void) {
+    pthread_key_create(&exitKey, epoch_thread_exit);
+}
+
+/**
+ * Claims a record for the calling thread, reusing one left by an exited
+ * thread if there is one.
+ * Returns the calling thread's record
+ */
+static EpochThread* epoch_thread(void) {
+    if (self != NULL) {
+        return self;
+    }
+    pthread_once(&exitOnce, epoch_key_create);
+    for (EpochThread* curr = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+            curr != NULL; curr = curr->next) {
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&(curr->inUse), &unused, 1, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            self = curr;
+            break;
+        }
+    }
+    if (self == NULL) {
+        self = calloc(1, sizeof(EpochThread));
+        self->inUse = 1;
+        self->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&threads, &(self->next), self, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    self->depth = 0;
+    pthread_setspecific(exitKey, self);
+    return self;
+}
+
+/**
+ * Starts reading shared data. Nothing retired from here on is freed until
+ * the matching epoch_exit. Never blocks, calls may be nested.
+ */
+void epoch_enter(void) {
+    EpochThread* thread = epoch_thread();
+    if (thread->depth++) {
+        return;
+    }
+    // Published before anything shared is read
+    __atomic_store_n(&(thread->epoch), __atomic_load_n(&globalEpoch,
+            __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Stops reading shared data, pointers read since epoch_enter must not be
+ * used afterwards.
+ */
+void epoch_exit(void) {
+    EpochThread* thread = self;
+    if (--(thread->depth)) {
+        return;
+    }
+    __atomic_store_n(&(thread->epoch), 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Moves the global epoch on if every thread reading shared data has seen
+ * the current one.
+ * Returns the global epoch afterwards
+ */
+static unsigned long epoch_advance(void) {
+    unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    for (EpochThread* curr = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+            curr != NULL; curr = curr->next) {
+        unsigned long seen = __atomic_load_n(&(curr->epoch),
+                __ATOMIC_SEQ_CST);
+        if (seen && seen != epoch) { // Still reading in an older epoch
+            return epoch;
+        }
+    }
+    __atomic_compare_exchange_n(&globalEpoch, &epoch, epoch + 1, 0,
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Frees every retired item that no reader can still see, those retired at
+ * least two epochs ago.
+ * (Note: called with retiredLock held)
+ */
+static void epoch_reclaim(void) {
+    unsigned long epoch = epoch_advance();
+    Retired** link = &retired;
+    while (*link != NULL && (*link)->epoch + 2 > epoch) {
+        link = &((*link)->next);
+    }
+    Retired* old = *link; // Everything from here on is old enough
+    *link = NULL;
+    while (old != NULL) {
+        Retired* next = old->next;
+        old->release(old->item);
+        free(old);
+        retiredCount--;
+        old = next;
+    }
+}
+
+/**
+ * Frees an item once no reader can still see it. The item must already be
+ * unreachable for readers entering from now on.
+ * item is the item
+ * release is the function freeing it
+ */
+void epoch_retire(void* item, void (*release)(void*)) {
+    Retired* entry = malloc(sizeof(Retired));
+    entry->item = item;
+    entry->release = release;
+    entry->epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&retiredLock);
+    entry->next = retired;
+    retired = entry;
+    if (++retiredCount % RECLAIM_EVERY == 0) {
+        epoch_reclaim();
+    }
+    pthread_mutex_unlock(&retiredLock);
+}
@@ -0,0 +1,10 @@
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+void epoch_enter(void);
+
+void epoch_exit(void);
+
+void epoch_retire(void* item, void (*release)(void*));
+
+#endif
@@ -0,0 +1,111 @@
+#include <string.h>
+#include "histogram.h"
+
+/**
+ * Sets up an empty histogram.
+ * hist is the histogram
+ */
+void hist_init(Histogram* hist) {
+    memset(hist, 0, sizeof(Histogram));
+}
+
+/**
+ * Determines the bucket a value is counted in. Values below 2 * HIST_SUB get
+ * a bucket each, above that every power of two is split in HIST_SUB.
+ * value is the value
+ * Returns the bucket's index
+ */
+static int hist_bucket(unsigned long long value) {
+    if (value < 2 * HIST_SUB) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)(value >> shift) - HIST_SUB;
+}
+
+/**
+ * Determines the largest value counted in a bucket.
+ * bucket is the bucket's index
+ * Returns the value
+ */
+static unsigned long long hist_value(int bucket) {
+    if (bucket < 2 * HIST_SUB) {
+        return bucket;
+    }
+    int shift = bucket / HIST_SUB - 1;
+    unsigned long long base = HIST_SUB + bucket % HIST_SUB;
+    return ((base + 1) << shift) - 1;
+}
+
+/**
+ * Counts a value.
+ * hist is the histogram
+ * value is the value
+ */
+void hist_record(Histogram* hist, unsigned long long value) {
+    hist->buckets[hist_bucket(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+/**
+ * Counts a value in a histogram other threads may be counting in at the
+ * same time. Each field is updated atomically, without ordering, so a
+ * reader may see count and buckets a value or two apart.
+ * hist is the histogram
+ * value is the value
+ */
+void hist_record_shared(Histogram* hist, unsigned long long value) {
+    __atomic_add_fetch(&(hist->buckets[hist_bucket(value)]), 1,
+            __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(hist->count), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(hist->sum), value, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&(hist->max), __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&(hist->max), &max,
+            value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Adds every value counted by one histogram to another. The histogram added
+ * may still be counted in by other threads(see hist_record_shared).
+ * into is the histogram added to
+ * from is the histogram added
+ */
+void hist_merge(Histogram* into, const Histogram* from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->buckets[i] += __atomic_load_n(&(from->buckets[i]),
+                __ATOMIC_RELAXED);
+    }
+    into->count += __atomic_load_n(&(from->count), __ATOMIC_RELAXED);
+    into->sum += __atomic_load_n(&(from->sum), __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&(from->max), __ATOMIC_RELAXED);
+    if (max > into->max) {
+        into->max = max;
+    }
+}
+
+/**
+ * Determines the value a percentage of the counted values are at or below.
+ * hist is the histogram
+ * percentile is the percentage(i.e 99.9)
+ * Returns the value, to within a bucket's width, 0 if nothing was counted
+ */
+unsigned long long hist_percentile(const Histogram* hist, double percentile) {
+    unsigned long long wanted = hist->count * (percentile / 100.0);
+    unsigned long long seen = 0;
+    if (wanted >= hist->count) {
+        return hist->max;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > wanted) {
+            unsigned long long value = hist_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
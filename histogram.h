@@ -0,0 +1,28 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+/* Sub-buckets per power of two, values are kept to within 1/32(~3%) */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Log-linear(HDR style) histogram of non-negative values, any value from 0
+ * up fits in a fixed table and recording is a few instructions */
+typedef struct Histogram {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long buckets[HIST_BUCKETS];
+} Histogram;
+
+void hist_init(Histogram* hist);
+
+void hist_record(Histogram* hist, unsigned long long value);
+
+void hist_record_shared(Histogram* hist, unsigned long long value);
+
+void hist_merge(Histogram* into, const Histogram* from);
+
+unsigned long long hist_percentile(const Histogram* hist, double percentile);
+
+#endif
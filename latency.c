@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "histogram.h"
+#include "latency.h"
+
+/* Copies of every stage's histogram, threads are spread across them so few
+ * ever record into the same one */
+#define LAT_STRIPES 8
+
+/* Nanoseconds in a second */
+#define NSEC 1000000000LL
+
+/* A timed stage, as kept in the trace */
+typedef struct TraceEvent {
+    unsigned long seq; // Position in the trace plus 1, 0 while being written
+    long long at; // When the stage ended(nanosecond, monotonic clock)
+    long long took; // How long it took(nanosecond)
+    int stage;
+    int thread; // Number of the thread that recorded it, from 1
+} TraceEvent;
+
+/* How each stage is named when written out, in order of LAT_* */
+static const char* stageNames[LAT_STAGES] = {"parse", "lock", "sanitize",
+        "write", "fanout"};
+
+/* Percentiles written out for every stage */
+static const double percentiles[] = {50, 90, 99, 99.9};
+
+static Histogram stripes[LAT_STRIPES][LAT_STAGES];
+
+/* Threads that have recorded anything so far */
+static int threadCount = 0;
+
+/* Number of the calling thread, 0 until it first records */
+static __thread int self = 0;
+
+/* Ring of the most recent stages timed, NULL if not kept */
+static TraceEvent* trace = NULL;
+static unsigned long traceMask; // Events in the ring minus 1
+static unsigned long traceNext = 0; // Events ever added to the ring
+
+/**
+ * Sets up the trace, a ring of the most recently timed stages that
+ * latency_dump writes out. Histograms are always kept, this is only needed
+ * for the trace and must be called before any stage is timed.
+ * traceEvents is the number of events kept, rounded up to a power of two,
+ * 0 to keep no trace
+ */
+void latency_init(long traceEvents) {
+    if (traceEvents <= 0) {
+        return;
+    }
+    unsigned long size = 1;
+    while (size < (unsigned long)traceEvents) {
+        size <<= 1;
+    }
+    trace = calloc(size, sizeof(TraceEvent));
+    traceMask = size - 1;
+}
+
+/**
+ * Determines the current time of a monotonic clock, cheap enough to call
+ * around every stage.
+ * Returns the time in nanoseconds
+ */
+long long latency_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC + now.tv_nsec;
+}
+
+/**
+ * Adds a timed stage to the trace. Writers never wait for each other or
+ * for a dump, an event is marked as being written while it is filled in so
+ * a dump skips it rather than print it half done.
+ * stage is the stage(LAT_*)
+ * at is when it ended
+ * took is how long it took
+ */
+static void latency_trace(int stage, long long at, long long took) {
+    unsigned long seq = __atomic_fetch_add(&traceNext, 1, __ATOMIC_RELAXED);
+    TraceEvent* event = &(trace[seq & traceMask]);
+    __atomic_store_n(&(event->seq), 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&(event->at), at, __ATOMIC_RELAXED);
+    __atomic_store_n(&(event->took), took, __ATOMIC_RELAXED);
+    __atomic_store_n(&(event->stage), stage, __ATOMIC_RELAXED);
+    __atomic_store_n(&(event->thread), self, __ATOMIC_RELAXED);
+    __atomic_store_n(&(event->seq), seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Records how long a stage took in its histogram, and in the trace if one
+ * is kept. Safe to call from any thread.
+ * stage is the stage(LAT_*)
+ * start is when the stage started(see latency_now)
+ * Returns the current time, so the next stage can start from it
+ */
+long long latency_record(int stage, long long start) {
+    long long now = latency_now();
+    long long took = now > start ? now - start : 0;
+    if (!self) {
+        self = __atomic_add_fetch(&threadCount, 1, __ATOMIC_RELAXED);
+    }
+    hist_record_shared(&(stripes[self % LAT_STRIPES][stage]), took);
+    if (trace != NULL) {
+        latency_trace(stage, now, took);
+    }
+    return now;
+}
+
+/**
+ * Takes a lock, recording how long it was waited for(LAT_LOCK).
+ * lock is the lock
+ */
+void latency_lock(pthread_mutex_t* lock) {
+    long long start = latency_now();
+    pthread_mutex_lock(lock);
+    latency_record(LAT_LOCK, start);
+}
+
+/**
+ * Gathers every stripe of a stage into one histogram.
+ * stage is the stage(LAT_*)
+ * hist is where to gather it
+ */
+static void latency_gather(int stage, Histogram* hist) {
+    hist_init(hist);
+    for (int i = 0; i < LAT_STRIPES; i++) {
+        hist_merge(hist, &(stripes[i][stage]));
+    }
+}
+
+/**
+ * Writes every stage's latency in the Prometheus text format, as a summary
+ * in seconds.
+ * out is where to write it
+ */
+void latency_write(FILE* out) {
+    Histogram* hist = malloc(sizeof(Histogram));
+    fprintf(out, "# HELP chat_stage_latency_seconds Time spent in each stage "
+            "of handling a line.\n"
+            "# TYPE chat_stage_latency_seconds summary\n");
+    for (int stage = 0; stage < LAT_STAGES; stage++) {
+        latency_gather(stage, hist);
+        for (size_t i = 0; i < sizeof(percentiles) / sizeof(double); i++) {
+            fprintf(out, "chat_stage_latency_seconds{stage=\"%s\","
+                    "quantile=\"%g\"} %.9f\n", stageNames[stage],
+                    percentiles[i] / 100,
+                    hist_percentile(hist, percentiles[i]) / (double)NSEC);
+        }
+        fprintf(out, "chat_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+                "chat_stage_latency_seconds_count{stage=\"%s\"} %llu\n",
+                stageNames[stage], hist->sum / (double)NSEC,
+                stageNames[stage], hist->count);
+    }
+    free(hist);
+}
+
+/**
+ * Writes a summary line per stage(nanosecond):
+ *     latency:stage:count:n:p50:n:p90:n:p99:n:p99.9:n:max:n
+ * followed by the trace, oldest first, if one is kept:
+ *     trace:at:thread:stage:took
+ * Stages timed while dumping may or may not be included.
+ * out is where to write it
+ */
+void latency_dump(FILE* out) {
+    Histogram* hist = malloc(sizeof(Histogram));
+    for (int stage = 0; stage < LAT_STAGES; stage++) {
+        latency_gather(stage, hist);
+        fprintf(out, "latency:%s:count:%llu", stageNames[stage], hist->count);
+        for (size_t i = 0; i < sizeof(percentiles) / sizeof(double); i++) {
+            fprintf(out, ":p%g:%llu", percentiles[i],
+                    hist_percentile(hist, percentiles[i]));
+        }
+        fprintf(out, ":max:%llu\n", hist->max);
+    }
+    free(hist);
+    if (trace == NULL) {
+        return;
+    }
+
+    unsigned long last = __atomic_load_n(&traceNext, __ATOMIC_ACQUIRE);
+    unsigned long first = last > traceMask ? last - traceMask - 1 : 0;
+    for (unsigned long seq = first; seq < last; seq++) {
+        TraceEvent* event = &(trace[seq & traceMask]);
+        if (__atomic_load_n(&(event->seq), __ATOMIC_ACQUIRE) != seq + 1) {
+            continue; // Being written, or already written over
+        }
+        long long at = __atomic_load_n(&(event->at), __ATOMIC_RELAXED);
+        long long took = __atomic_load_n(&(event->took), __ATOMIC_RELAXED);
+        int stage = __atomic_load_n(&(event->stage), __ATOMIC_RELAXED);
+        int thread = __atomic_load_n(&(event->thread), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(event->seq), __ATOMIC_RELAXED) != seq + 1) {
+            continue; // Written over while being read
+        }
+        fprintf(out, "trace:%lld:%d:%s:%lld\n", at, thread, stageNames[stage],
+                took);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef _LATENCY_H
+#define _LATENCY_H
+#include <stdio.h>
+#include <pthread.h>
+
+/* Stages of handling a line that are timed */
+#define LAT_PARSE 0 // Parsing a line into a command
+#define LAT_LOCK 1 // Waiting for the roster lock
+#define LAT_SANITIZE 2 // Sanitizing SAY: text into its MSG: frame
+#define LAT_WRITE 3 // One write of a client's queued frames to its socket
+#define LAT_FANOUT 4 // SAY: handled until the last recipient has its MSG:
+#define LAT_STAGES 5
+
+void latency_init(long traceEvents);
+
+long long latency_now(void);
+
+long long latency_record(int stage, long long start);
+
+void latency_lock(pthread_mutex_t* lock);
+
+void latency_write(FILE* out);
+
+void latency_dump(FILE* out);
+
+#endif
@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "linereader.h"
+
+/* Least free space a read is made with, also the starting buffer size */
+#define READ_CHUNK 4096
+
+/**
+ * Sets up a reader with an empty buffer. Nothing is allocated until the
+ * first read.
+ * reader is the reader to set up
+ * maxLine is the longest line accepted(newline excluded)
+ */
+void line_init(LineReader* reader, size_t maxLine) {
+    memset(reader, 0, sizeof(LineReader));
+    reader->maxLine = maxLine;
+}
+
+/**
+ * Frees a reader's buffer, lines handed out become invalid.
+ * reader is the reader
+ */
+void line_free(LineReader* reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+    reader->capacity = 0;
+    reader->start = 0;
+    reader->length = 0;
+}
+
+/**
+ * Makes room at the end of the buffer. Lines already handed out are dropped
+ * from the buffer first, it only grows if that isn't enough.
+ * reader is the reader
+ * needed is the least free space wanted in bytes
+ */
+static void line_room(LineReader* reader, size_t needed) {
+    if (reader->start == reader->length) { // Nothing pending, start over
+        reader->start = 0;
+        reader->length = 0;
+    }
+    if (reader->capacity - reader->length < needed && reader->start) {
+        memmove(reader->buffer, reader->buffer + reader->start,
+                reader->length - reader->start);
+        reader->length -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->capacity - reader->length < needed) {
+        size_t capacity = reader->capacity ? reader->capacity * 2 :
+                READ_CHUNK;
+        while (capacity - reader->length < needed) {
+            capacity *= 2;
+        }
+        reader->capacity = capacity;
+        reader->buffer = realloc(reader->buffer, reader->capacity);
+    }
+}
+
+/**
+ * Reads once from a descriptor into the buffer. Lines already handed out
+ * are dropped from the buffer first to make room.
+ * reader is the reader
+ * fd is the descriptor, may be blocking or not
+ * Returns what read returned, -1 with errno EMSGSIZE once a line has been
+ * too long
+ */
+ssize_t line_fill(LineReader* reader, int fd) {
+    if (reader->tooLong) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    line_room(reader, READ_CHUNK);
+
+    ssize_t got = read(fd, reader->buffer + reader->length,
+            reader->capacity - reader->length);
+    if (got > 0) {
+        reader->length += got;
+    }
+    return got;
+}
+
+/**
+ * Adds data that was received some other way(i.e into an io_uring buffer)
+ * to the buffer, as if it had been read. Nothing is added once a line has
+ * been too long.
+ * reader is the reader
+ * data is the data, length is its size in bytes
+ */
+void line_append(LineReader* reader, const char* data, size_t length) {
+    if (reader->tooLong) {
+        return;
+    }
+    line_room(reader, length + 1); // Room after it for a terminator
+    memcpy(reader->buffer + reader->length, data, length);
+    reader->length += length;
+}
+
+/**
+ * Determines the next complete line in the buffer without handing it out,
+ * so it can be left for later. Only bytes not looked at before are
+ * scanned, records are found from their header without scanning.
+ * reader is the reader
+ * length is set to the line's length(newline excluded)
+ * Returns the start of the line(not terminated), NULL if no complete line
+ * is buffered or the line is too long
+ */
+char* line_peek(LineReader* reader, size_t* length) {
+    if (reader->start == reader->length) {
+        return NULL;
+    }
+    if (reader->split != NULL && !reader->tooLong) { // Header says how long
+        size_t available = reader->length - reader->start;
+        size_t record = reader->split(reader->buffer + reader->start,
+                available);
+        reader->tooLong = record > reader->maxLine + 1 ||
+                (record == 0 && available > reader->maxLine);
+        if (record == 0 || record > available || reader->tooLong) {
+            return NULL;
+        }
+        reader->scanned = record - 1; // Its last byte stands for a newline
+        reader->found = 1;
+    }
+    if (!reader->found && !reader->tooLong) {
+        char* from = reader->buffer + reader->start + reader->scanned;
+        char* newline = memchr(from, '\n',
+                reader->length - reader->start - reader->scanned);
+        if (newline == NULL) {
+            reader->scanned = reader->length - reader->start;
+            reader->tooLong = reader->scanned > reader->maxLine;
+            return NULL;
+        }
+        reader->scanned = newline - (reader->buffer + reader->start);
+        reader->found = 1;
+        reader->tooLong = reader->scanned > reader->maxLine;
+    }
+    if (!reader->found || reader->tooLong) {
+        return NULL;
+    }
+    *length = reader->scanned;
+    return reader->buffer + reader->start;
+}
+
+/**
+ * Hands out the next complete line in the buffer. The newline is replaced
+ * by a terminator in place, nothing is copied.
+ * reader is the reader
+ * length is set to the line's length(newline excluded)
+ * Returns the line, valid until the reader is next used, NULL if no
+ * complete line is buffered or the line is too long
+ */
+char* line_next(LineReader* reader, size_t* length) {
+    char* line = line_peek(reader, length);
+    if (line != NULL) {
+        line[*length] = '\0';
+        reader->start += *length + 1;
+        reader->scanned = 0;
+        reader->found = 0;
+    }
+    return line;
+}
+
+/**
+ * Reads the next line from a blocking descriptor. A last line with no
+ * newline is still handed out at end of file.
+ * reader is the reader
+ * fd is the descriptor
+ * length is set to the line's length(newline excluded)
+ * Returns the line, valid until the reader is next used, NULL at end of
+ * file, on error or if the line is too long
+ */
+char* line_read(LineReader* reader, int fd, size_t* length) {
+    char* line;
+    while ((line = line_next(reader, length)) == NULL) {
+        if (reader->tooLong) {
+            return NULL;
+        }
+        ssize_t got = line_fill(reader, fd);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            if (got < 0 || reader->start == reader->length ||
+                    reader->split != NULL) { // Cut short records are lost
+                return NULL;
+            }
+            // Unterminated last line, the buffer always has room after it
+            line = reader->buffer + reader->start;
+            *length = reader->length - reader->start;
+            line[*length] = '\0';
+            reader->start = reader->length;
+            reader->scanned = 0;
+            return line;
+        }
+    }
+    return line;
+}
@@ -0,0 +1,41 @@
+#ifndef _LINEREADER_H
+#define _LINEREADER_H
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Longest line accepted when nothing else is configured, newline excluded */
+#define LINE_MAX_DEFAULT 65536
+
+/* Splits what is read from a descriptor into lines. Lines are handed out as
+ * views into the buffer, valid until the reader is next used. With split
+ * set, records that say how long they are(ending in a 0 byte) are handed
+ * out instead, the same way. */
+typedef struct LineReader {
+    char* buffer;
+    size_t capacity;
+    size_t start; // First byte not handed out yet
+    size_t length; // Bytes in the buffer, from 0
+    size_t scanned; // Bytes from start known not to be a newline
+    int found; // Byte at start + scanned is a newline
+    int tooLong; // A line longer than maxLine came in, nothing more is read
+    size_t maxLine;
+    // Length of the record at data including its last byte, 0 if more is
+    // needed to tell, huge if invalid. NULL to split at newlines.
+    size_t (*split)(const char* data, size_t length);
+} LineReader;
+
+void line_init(LineReader* reader, size_t maxLine);
+
+void line_free(LineReader* reader);
+
+ssize_t line_fill(LineReader* reader, int fd);
+
+void line_append(LineReader* reader, const char* data, size_t length);
+
+char* line_peek(LineReader* reader, size_t* length);
+
+char* line_next(LineReader* reader, size_t* length);
+
+char* line_read(LineReader* reader, int fd, size_t* length);
+
+#endif
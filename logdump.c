@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chatlog.h"
+#include "commonfunction.h"
+
+/**
+ * Prints a usage error and exits.
+ * Exit with 1 as this is a usage error
+ */
+static void logdump_usage(void) {
+    fprintf(stderr, "Usage: logdump dir [seq|@time]\n");
+    exit(ARG_ERROR);
+}
+
+/**
+ * Prints the records of a chat log(see CHAT_LOG), one per line as
+ * seq:time:TYPE:room:name:text, the time in seconds since the epoch. Starts
+ * from a sequence number or, prefixed with @, a time in seconds since the
+ * epoch, if one is given. Only reads the log, so it may be run while the
+ * server is writing it.
+ * Exit with 1 if the arguments are wrong or the log can't be read
+ */
+int main(int argc, char* argv[]) {
+    if (argc != 2 && argc != 3) {
+        logdump_usage();
+    }
+    unsigned long long seq = 0;
+    long long time = 0;
+    if (argc == 3) {
+        char* from = argv[2][0] == '@' ? argv[2] + 1 : argv[2];
+        char* end;
+        unsigned long long value = strtoull(from, &end, 10);
+        if (end == from || *end != '\0') {
+            logdump_usage();
+        }
+        if (from != argv[2]) {
+            time = value * 1000000000;
+        } else {
+            seq = value;
+        }
+    }
+
+    LogReader reader;
+    if (log_reader_open(&reader, argv[1]) < 0) {
+        logdump_usage();
+    }
+    log_reader_seek(&reader, seq, time);
+    LogRecord* record;
+    while ((record = log_reader_next(&reader)) != NULL) {
+        char* data = (char*)(record + 1);
+        printf("%llu:%lld.%09lld:%s:%.*s:%.*s:%.*s\n",
+                (unsigned long long)record->seq,
+                (long long)record->time / 1000000000,
+                (long long)record->time % 1000000000,
+                chatlog_type_name(record->type), (int)record->roomLength,
+                data, (int)record->nameLength, data + record->roomLength,
+                (int)record->textLength,
+                data + record->roomLength + record->nameLength);
+    }
+    log_reader_close(&reader);
+    return NORM_EXIT;
+}
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "logger.h"
+#include "metrics.h"
+#include "mpsc.h"
+
+/* An event waiting for the output thread */
+typedef struct LogLine {
+    MpscNode node;
+    int event;
+    struct timespec time; // When it happened
+    size_t roomLength; // 0 and no room if the event has none
+    int hasRoom;
+    size_t nameLength;
+    size_t textLength;
+    char data[]; // Room's name, client's name then text
+} LogLine;
+
+/* Output being built by the output thread, written out once per batch */
+typedef struct LogBuffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+} LogBuffer;
+
+/* Events of a lower level are left out */
+static int outputLevel = LEVEL_DEBUG;
+static int outputFormat = FORMAT_TEXT;
+
+/* Queue of lines and how the output thread is woken, see logger_write */
+static MpscQueue queue;
+static int wakeFd = -1; // -1 until the output thread is started
+static int wakePending = 0;
+static int waiting = 0; // Lines queued and not yet taken
+
+/* Names of the events and levels as output, in order of EVENT_* and
+ * LEVEL_* */
+static const char* const eventNames[] = {NULL, "say", "enter", "leave",
+        "kick", "slow"};
+static const char* const levelNames[] = {NULL, "debug", "info", "warn"};
+
+/**
+ * Determines the level of an event.
+ * event is the event(EVENT_*)
+ * Returns the level(LEVEL_*)
+ */
+static int logger_level(int event) {
+    switch (event) {
+        case EVENT_SAY:
+            return LEVEL_DEBUG;
+        case EVENT_SLOW:
+            return LEVEL_WARN;
+        default:
+            return LEVEL_INFO;
+    }
+}
+
+/**
+ * Makes room for more bytes at the end of an output buffer.
+ * buffer is the buffer
+ * more is the number of bytes about to be added
+ * Returns where they go
+ */
+static char* logger_reserve(LogBuffer* buffer, size_t more) {
+    if (buffer->length + more > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->length + more) {
+            capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+    return buffer->data + buffer->length;
+}
+
+/**
+ * Adds bytes to an output buffer as they are.
+ * buffer is the buffer
+ * data is the bytes, length is their number
+ */
+static void logger_add(LogBuffer* buffer, const char* data, size_t length) {
+    memcpy(logger_reserve(buffer, length), data, length);
+    buffer->length += length;
+}
+
+/**
+ * Adds a string to an output buffer as it is.
+ * buffer is the buffer
+ * string is the string, terminated
+ */
+static void logger_add_string(LogBuffer* buffer, const char* string) {
+    logger_add(buffer, string, strlen(string));
+}
+
+/**
+ * Adds a value to an output buffer as a quoted string. Quotes and
+ * backslashes are escaped with a backslash, control characters as \xNN, or
+ * \u00NN for JSON, so every event stays on one line.
+ * buffer is the buffer
+ * value is the value, length is its size in bytes
+ * json is whether JSON escapes are used
+ */
+static void logger_add_quoted(LogBuffer* buffer, const char* value,
+        size_t length, int json) {
+    char* out = logger_reserve(buffer, length * 6 + 2); // Worst case
+    *out++ = '"';
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = value[i];
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = c;
+        } else if (c < ' ' || c == 0x7f) {
+            out += sprintf(out, json ? "\\u%04x" : "\\x%02x", c);
+        } else {
+            *out++ = c;
+        }
+    }
+    *out++ = '"';
+    buffer->length = out - buffer->data;
+}
+
+/**
+ * Adds one field of a structured line, a key and its quoted value.
+ * buffer is the buffer
+ * key is the field's name
+ * value is the field's value, length is its size in bytes
+ */
+static void logger_add_field(LogBuffer* buffer, const char* key,
+        const char* value, size_t length) {
+    int json = outputFormat == FORMAT_JSON;
+    logger_add_string(buffer, json ? ",\"" : " ");
+    logger_add_string(buffer, key);
+    logger_add_string(buffer, json ? "\":" : "=");
+    logger_add_quoted(buffer, value, length, json);
+}
+
+/**
+ * Adds an event to an output buffer as a line in the output format. Text
+ * lines are the same the server has always printed, a kick being output as
+ * the client leaving.
+ * buffer is the buffer
+ * line is the event
+ */
+static void logger_format(LogBuffer* buffer, LogLine* line) {
+    const char* room = line->data;
+    const char* name = room + line->roomLength;
+    const char* text = name + line->nameLength;
+    if (outputFormat == FORMAT_TEXT) {
+        if (line->event == EVENT_SAY) {
+            logger_add(buffer, name, line->nameLength);
+            logger_add_string(buffer, ": ");
+            logger_add(buffer, text, line->textLength);
+            logger_add_string(buffer, "\n");
+            return;
+        }
+        logger_add_string(buffer, "(");
+        logger_add(buffer, name, line->nameLength);
+        logger_add_string(buffer, line->event == EVENT_ENTER ?
+                " has entered the chat)\n" : line->event == EVENT_SLOW ?
+                " is too slow and has been disconnected)\n" :
+                " has left the chat)\n");
+        return;
+    }
+
+    // Structured, time down to the microsecond in UTC
+    struct tm date;
+    char stamp[sizeof("YYYY-MM-DDTHH:MM:SS.uuuuuuZ") + 16];
+    gmtime_r(&(line->time.tv_sec), &date);
+    size_t length = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S",
+            &date);
+    snprintf(stamp + length, sizeof(stamp) - length, ".%06ldZ",
+            line->time.tv_nsec / 1000);
+    int json = outputFormat == FORMAT_JSON;
+    const char* level = levelNames[logger_level(line->event)];
+    logger_add_string(buffer, json ? "{\"time\":\"" : "time=");
+    logger_add_string(buffer, stamp);
+    logger_add_string(buffer, json ? "\",\"level\":\"" : " level=");
+    logger_add_string(buffer, level);
+    logger_add_string(buffer, json ? "\",\"event\":\"" : " event=");
+    logger_add_string(buffer, eventNames[line->event]);
+    logger_add_string(buffer, json ? "\"" : "");
+    if (line->hasRoom) {
+        logger_add_field(buffer, "room", room, line->roomLength);
+    }
+    logger_add_field(buffer, "name", name, line->nameLength);
+    if (line->event == EVENT_SAY) {
+        logger_add_field(buffer, "text", text, line->textLength);
+    } else if (line->event == EVENT_KICK) {
+        logger_add_field(buffer, "by", text, line->textLength);
+    }
+    logger_add_string(buffer, json ? "}\n" : "\n");
+}
+
+/**
+ * Writes all of an output buffer to stdout. Output that can't be written,
+ * stdout being closed, is lost.
+ * buffer is the buffer, emptied
+ */
+static void logger_output(LogBuffer* buffer) {
+    size_t done = 0;
+    while (done < buffer->length) {
+        ssize_t wrote = write(STDOUT_FILENO, buffer->data + done,
+                buffer->length - done);
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        } else if (wrote <= 0) {
+            break;
+        }
+        done += wrote;
+    }
+    buffer->length = 0;
+}
+
+/**
+ * Thread routine writing output. Takes every line waiting and writes them
+ * with a single write, so while stdout is slow lines pile up into bigger
+ * writes rather than holding anyone up.
+ * arg is unused
+ * Returns nothing, runs for as long as the server does
+ */
+static void* logger_thread(void* arg) {
+    LogBuffer buffer = {NULL, 0, 0};
+    for (;;) {
+        uint64_t wakes;
+        while (read(wakeFd, &wakes, sizeof(wakes)) < 0 && errno == EINTR) {
+        }
+        __atomic_store_n(&wakePending, 0, __ATOMIC_SEQ_CST);
+        MpscNode* node;
+        int taken = 0;
+        while ((node = mpsc_pop(&queue)) != NULL) {
+            logger_format(&buffer, (LogLine*)node);
+            free(node);
+            taken++;
+        }
+        __atomic_sub_fetch(&waiting, taken, __ATOMIC_RELAXED);
+        logger_output(&buffer);
+    }
+    return NULL;
+}
+
+/**
+ * Starts the output thread, events are written by it from now on. Until
+ * then they are written straight away by whoever has them.
+ * level is the lowest level output(see CHAT_OUTPUT_LEVEL)
+ * format is how lines are written(see CHAT_OUTPUT_FORMAT)
+ */
+void logger_start(int level, int format) {
+    outputLevel = level;
+    outputFormat = format;
+    mpsc_init(&queue);
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    pthread_t thread;
+    pthread_create(&thread, NULL, &logger_thread, NULL);
+    pthread_detach(thread);
+}
+
+/**
+ * Outputs an event, if its level is output. Only copies it for the output
+ * thread and wakes that if it isn't awake already, so a slow stdout never
+ * holds up the caller, even one holding the roster lock. Safe to call from
+ * any thread. Events past LOGGER_BACKLOG waiting lines are thrown away.
+ * event is the event(EVENT_*)
+ * room is the name of the room it happened in, NULL to leave it out
+ * name is the client's name
+ * text is the event's text, length is its size in bytes
+ */
+void logger_write(int event, const char* room, const char* name,
+        const char* text, size_t length) {
+    if (logger_level(event) < outputLevel) {
+        return;
+    }
+    int threaded = wakeFd >= 0; // Otherwise no output thread(yet)
+    if (threaded && __atomic_add_fetch(&waiting, 1, __ATOMIC_RELAXED) >
+            LOGGER_BACKLOG) {
+        __atomic_sub_fetch(&waiting, 1, __ATOMIC_RELAXED);
+        metric_add(METRIC_OUTPUT_DROPPED, 1);
+        return;
+    }
+    size_t roomLength = room != NULL ? strlen(room) : 0;
+    size_t nameLength = strlen(name);
+    LogLine* line = malloc(sizeof(LogLine) + roomLength + nameLength +
+            length);
+    line->event = event;
+    clock_gettime(CLOCK_REALTIME, &(line->time));
+    line->hasRoom = room != NULL;
+    line->roomLength = roomLength;
+    line->nameLength = nameLength;
+    line->textLength = length;
+    char* data = line->data;
+    if (room != NULL) {
+        memcpy(data, room, roomLength);
+    }
+    memcpy(data + roomLength, name, nameLength);
+    if (length) {
+        memcpy(data + roomLength + nameLength, text, length);
+    }
+
+    if (!threaded) {
+        LogBuffer buffer = {NULL, 0, 0};
+        logger_format(&buffer, line);
+        logger_output(&buffer);
+        free(buffer.data);
+        free(line);
+        return;
+    }
+    mpsc_push(&queue, &(line->node));
+    if (!__atomic_exchange_n(&wakePending, 1, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        while (write(wakeFd, &one, sizeof(one)) < 0 && errno == EINTR) {
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _LOGGER_H
+#define _LOGGER_H
+#include <stddef.h>
+
+/* Levels of output, each event has one. Events below the level the server
+ * is started with are left out, see CHAT_OUTPUT_LEVEL. */
+#define LEVEL_DEBUG 1 // Every message said
+#define LEVEL_INFO 2 // Clients entering, leaving and being kicked
+#define LEVEL_WARN 3 // Clients dropped for being too slow
+#define LEVEL_OFF 4 // Nothing is output
+
+/* How output lines are written, see CHAT_OUTPUT_FORMAT */
+#define FORMAT_TEXT 1 // name: text, (name has entered the chat), ...
+#define FORMAT_KV 2 // time=... level=... event=... key="value" ...
+#define FORMAT_JSON 3 // One JSON object per line
+
+/* Events output */
+#define EVENT_SAY 1 // Text is what was said
+#define EVENT_ENTER 2
+#define EVENT_LEAVE 3
+#define EVENT_KICK 4 // Text is who kicked them
+#define EVENT_SLOW 5 // Outbound queue filled up
+
+/* Lines waiting for the output thread before more are thrown away, so a
+ * stuck stdout can't use up the server's memory */
+#define LOGGER_BACKLOG 65536
+
+void logger_start(int level, int format);
+
+void logger_write(int event, const char* room, const char* name,
+        const char* text, size_t length);
+
+#endif
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "metrics.h"
+
+/* One thread's share of every metric. Only its thread writes it, so no
+ * update is ever contended, and it has cache lines to itself so updates
+ * never bounce a line another thread is writing. */
+typedef struct MetricShard {
+    long long values[METRIC_COUNT];
+    int inUse; // Shard belongs to a live thread
+    struct MetricShard* next;
+} __attribute__((aligned(CACHE_LINE))) MetricShard;
+
+/* Every shard ever made. Shards are reused but never freed, an exited
+ * thread's counts still make up the totals. */
+static MetricShard* shards = NULL;
+
+/* Shard of the calling thread, NULL until it first counts something */
+static __thread MetricShard* self = NULL;
+
+/* Hands a thread's shard back when it exits */
+static pthread_key_t exitKey;
+static pthread_once_t exitOnce = PTHREAD_ONCE_INIT;
+
+/* How each metric is exposed, in order of METRIC_* */
+static const struct {
+    const char* name;
+    const char* type;
+    const char* help;
+    const char* label; // NULL if none
+} exposed[METRIC_COUNT] = {
+    {"chat_commands_total", "counter", "Commands received from clients.",
+            "command=\"AUTH\""},
+    {"chat_commands_total", "counter", NULL, "command=\"NAME\""},
+    {"chat_commands_total", "counter", NULL, "command=\"SAY\""},
+    {"chat_commands_total", "counter", NULL, "command=\"KICK\""},
+    {"chat_commands_total", "counter", NULL, "command=\"LIST\""},
+    {"chat_commands_total", "counter", NULL, "command=\"LEAVE\""},
+    {"chat_commands_total", "counter", NULL, "command=\"JOIN\""},
+    {"chat_commands_total", "counter", NULL, "command=\"PART\""},
+    {"chat_commands_total", "counter", NULL, "command=\"HISTORY\""},
+    {"chat_connections_accepted_total", "counter",
+            "Connections accepted.", NULL},
+    {"chat_frames_sent_total", "counter",
+            "Messages queued to clients, one per recipient.", NULL},
+    {"chat_frames_dropped_total", "counter",
+            "Messages thrown away for clients too slow to keep up.", NULL},
+    {"chat_bytes_received_total", "counter",
+            "Bytes received from clients.", NULL},
+    {"chat_bytes_sent_total", "counter", "Bytes written to clients.", NULL},
+    {"chat_write_calls_total", "counter",
+            "Writes made to clients, sendmsg calls or io_uring sends.", NULL},
+    {"chat_history_replayed_total", "counter",
+            "Kept messages replayed to clients.", NULL},
+    {"chat_log_records_total", "counter",
+            "Events written to the chat log.", NULL},
+    {"chat_log_commits_total", "counter",
+            "Batches of chat log events committed together.", NULL},
+    {"chat_output_dropped_total", "counter",
+            "Output lines thrown away while stdout was too slow.", NULL},
+    {"chat_accept_failures_total", "counter",
+            "Accepts that failed as the server ran out of descriptors.",
+            NULL},
+    {"chat_connections", "gauge", "Clients connected.", NULL},
+    {"chat_queued_frames", "gauge",
+            "Messages waiting in outbound queues.", NULL},
+    {"chat_queued_bytes", "gauge", "Bytes waiting in outbound queues.",
+            NULL},
+    {"chat_rooms", "gauge", "Rooms in use, the lobby included.", NULL},
+};
+
+/**
+ * Marks the shard of an exiting thread free for reuse.
+ * shard is the exiting thread's shard
+ */
+static void metric_thread_exit(void* shard) {
+    __atomic_store_n(&(((MetricShard*)shard)->inUse), 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Creates the key used to catch thread exits.
+ */
+static void metric_key_create(void) {
+    pthread_key_create(&exitKey, metric_thread_exit);
+}
+
+/**
+ * Claims a shard for the calling thread, reusing one left by an exited
+ * thread if there is one.
+ * Returns the calling thread's shard
+ */
+static MetricShard* metric_shard(void) {
+    pthread_once(&exitOnce, metric_key_create);
+    for (MetricShard* curr = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+            curr != NULL; curr = curr->next) {
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&(curr->inUse), &unused, 1, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            self = curr;
+            break;
+        }
+    }
+    if (self == NULL) {
+        void* memory;
+        if (posix_memalign(&memory, CACHE_LINE, sizeof(MetricShard))) {
+            abort(); // Nowhere to count, nothing sensible left to do
+        }
+        self = memory;
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            self->values[i] = 0;
+        }
+        self->inUse = 1;
+        self->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&shards, &(self->next), self, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(exitKey, self);
+    return self;
+}
+
+/**
+ * Adds to a metric. Only the calling thread's shard is written, with no
+ * atomic read-modify-write, so this costs about as much as a plain
+ * increment. Safe to call from any thread.
+ * metric is the metric(METRIC_*)
+ * delta is the amount to add, negative to lower a gauge
+ */
+void metric_add(int metric, long long delta) {
+    MetricShard* shard = self != NULL ? self : metric_shard();
+    long long value = __atomic_load_n(&(shard->values[metric]),
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&(shard->values[metric]), value + delta,
+            __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds one to a counter that only one thread ever writes, such as a
+ * client's own SAY: count, so other threads can read it while it changes.
+ * counter is the counter
+ */
+void metric_bump(int* counter) {
+    int value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    __atomic_store_n(counter, value + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Determines a metric's current value by adding up every thread's shard.
+ * Updates made while reading may or may not be included.
+ * metric is the metric(METRIC_*)
+ * Returns the value
+ */
+long long metric_read(int metric) {
+    long long total = 0;
+    for (MetricShard* curr = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+            curr != NULL; curr = curr->next) {
+        total += __atomic_load_n(&(curr->values[metric]), __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+/**
+ * Writes every metric in the Prometheus text format.
+ * out is where to write them
+ * clients is the number of clients in the chat
+ */
+void metrics_write(FILE* out, size_t clients) {
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        if (exposed[i].help != NULL) {
+            fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", exposed[i].name,
+                    exposed[i].help, exposed[i].name, exposed[i].type);
+        }
+        if (exposed[i].label != NULL) {
+            fprintf(out, "%s{%s} %lld\n", exposed[i].name, exposed[i].label,
+                    metric_read(i));
+        } else {
+            fprintf(out, "%s %lld\n", exposed[i].name, metric_read(i));
+        }
+    }
+    fprintf(out, "# HELP chat_clients Clients in the chat.\n"
+            "# TYPE chat_clients gauge\nchat_clients %zu\n", clients);
+}
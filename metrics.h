@@ -0,0 +1,45 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+#include <stdio.h>
+#include <stddef.h>
+
+/* Size of a cache line, shards are kept on lines of their own */
+#define CACHE_LINE 64
+
+/* Counters, only ever go up */
+#define METRIC_AUTH 0 // AUTH: received
+#define METRIC_NAME 1 // NAME: received
+#define METRIC_SAY 2
+#define METRIC_KICK 3
+#define METRIC_LIST 4
+#define METRIC_LEAVE 5
+#define METRIC_JOIN 6
+#define METRIC_PART 7
+#define METRIC_HISTORY 8
+#define METRIC_ACCEPTED 9 // Connections accepted
+#define METRIC_FRAMES_OUT 10 // Frames queued to clients(MSG:, LIST:, ...)
+#define METRIC_DROPPED 11 // Frames thrown away for slow clients
+#define METRIC_BYTES_IN 12
+#define METRIC_BYTES_OUT 13
+#define METRIC_WRITES 14 // sendmsg calls or io_uring sends to clients
+#define METRIC_REPLAYED 15 // Kept MSG: frames replayed to clients
+#define METRIC_LOGGED 16 // Records written to the chat log
+#define METRIC_LOG_COMMITS 17 // Batches of them committed together
+#define METRIC_OUTPUT_DROPPED 18 // Output lines thrown away, see logger.h
+#define METRIC_ACCEPT_FAILED 19 // Accepts failed for want of descriptors
+/* Gauges, moved up and down by deltas */
+#define METRIC_CONNECTIONS 20 // Clients connected, joined or not
+#define METRIC_QUEUED_FRAMES 21 // Frames waiting in outbound queues
+#define METRIC_QUEUED_BYTES 22 // Bytes waiting in outbound queues
+#define METRIC_ROOMS 23 // Rooms in use, the lobby included
+#define METRIC_COUNT 24
+
+void metric_add(int metric, long long delta);
+
+void metric_bump(int* counter);
+
+long long metric_read(int metric);
+
+void metrics_write(FILE* out, size_t clients);
+
+#endif
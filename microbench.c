@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "commonfunction.h"
+#include "config.h"
+#include "epoch.h"
+#include "reactor.h"
+#include "room.h"
+#include "roster.h"
+#include "server.h"
+
+/* Environment variables read by main */
+#define ENV_TIME "MICROBENCH_TIME"
+#define ENV_FILTER "MICROBENCH_FILTER"
+
+/* Nanoseconds in a millisecond and a second */
+#define NSEC_MS 1000000LL
+#define NSEC 1000000000LL
+
+/* Lines in the stream read_line is measured on, read round and round */
+#define STREAM_LINES 64
+
+/* glibc's allocator, which the counting versions below hand on to */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+extern void __libc_free(void* pointer);
+
+/* Allocations made by the measuring thread, other threads aren't counted */
+static __thread int counting;
+static __thread unsigned long long allocations;
+static __thread unsigned long long allocated;
+
+/**
+ * Counts an allocation if the calling thread is being measured.
+ * size is the number of bytes asked for
+ */
+static void count_allocation(size_t size) {
+    if (counting) {
+        allocations++;
+        allocated += size;
+    }
+}
+
+void* malloc(size_t size) {
+    count_allocation(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    count_allocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+    count_allocation(size);
+    return __libc_realloc(pointer, size);
+}
+
+void free(void* pointer) {
+    __libc_free(pointer);
+}
+
+/* State a benchmark runs against, set up once per size */
+typedef struct Fixture {
+    long size;
+    char* text; // size bytes, a few of them non-printable
+    FILE* stream;
+    char* streamData;
+    Roster roster;
+    pthread_mutex_t lock;
+    Room* room; // Every client of the roster is in it
+    Connection requester; // Never written, frames are dropped as they come
+    ClientInfo* requesterInfo;
+} Fixture;
+
+/* A benchmark, run at every size in sizes */
+typedef struct Case {
+    const char* name;
+    const char* unit; // What size means
+    const long* sizes; // 0 terminated
+    void (*setup)(Fixture* fixture);
+    void (*run)(Fixture* fixture);
+} Case;
+
+/**
+ * Determines the current time of a monotonic clock.
+ * Returns the time in nanoseconds
+ */
+static long long now_nsec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC + now.tv_nsec;
+}
+
+/**
+ * Makes size bytes of chat text, one byte in 64 non-printable.
+ * size is the number of bytes
+ * Returns the terminated text
+ */
+static char* make_text(long size) {
+    char* text = malloc(size + 1);
+    for (long i = 0; i < size; i++) {
+        text[i] = i % 64 == 63 ? '\t' : 'a' + i % 26;
+    }
+    text[size] = '\0';
+    return text;
+}
+
+/**
+ * Makes a stream of STREAM_LINES lines of fixture->size bytes each.
+ * fixture is the fixture
+ */
+static void setup_stream(Fixture* fixture) {
+    long length = (fixture->size + 1) * STREAM_LINES;
+    fixture->streamData = malloc(length);
+    for (int i = 0; i < STREAM_LINES; i++) {
+        char* line = fixture->streamData + i * (fixture->size + 1);
+        memcpy(line, fixture->text, fixture->size);
+        line[fixture->size] = '\n';
+    }
+    fixture->stream = fmemopen(fixture->streamData, length, "r");
+}
+
+/**
+ * Makes a stream holding a single line, as an auth file does.
+ * fixture is the fixture
+ */
+static void setup_auth(Fixture* fixture) {
+    fixture->streamData = malloc(fixture->size + 1);
+    memcpy(fixture->streamData, fixture->text, fixture->size);
+    fixture->streamData[fixture->size] = '\n';
+    fixture->stream = fmemopen(fixture->streamData, fixture->size + 1, "r");
+}
+
+/**
+ * Fills the roster, and a room, with fixture->size clients and sets up a
+ * requester for LIST:. The requester's queue holds one frame and drops the
+ * oldest, so nothing builds up and nothing is written.
+ * fixture is the fixture
+ */
+static void setup_roster(Fixture* fixture) {
+    char name[32];
+    pthread_mutex_init(&(fixture->lock), NULL);
+    roster_init(&(fixture->roster), &(fixture->lock));
+    fixture->room = room_open("microbench");
+    for (long i = 0; i < fixture->size; i++) {
+        snprintf(name, sizeof(name), "client%ld", i);
+        room_add(fixture->room, add_client_info(&(fixture->roster), name,
+                -1));
+    }
+    memset(&(fixture->requester), 0, sizeof(Connection));
+    fixture->requester.dirty = 1; // Keeps it off any reactor's list
+    outq_init(&(fixture->requester.out), 1, 1, OUTQ_DROP_OLDEST);
+    fixture->requesterInfo = roster_first(&(fixture->roster));
+    if (fixture->requesterInfo != NULL) {
+        fixture->requesterInfo->conn = &(fixture->requester);
+    }
+}
+
+/**
+ * Frees what the fixture was set up with.
+ * fixture is the fixture
+ */
+static void teardown(Fixture* fixture) {
+    if (fixture->stream != NULL) {
+        fclose(fixture->stream);
+        free(fixture->streamData);
+    }
+    if (fixture->roster.slots != NULL) {
+        ClientInfo* client;
+        while ((client = roster_first(&(fixture->roster))) != NULL) {
+            room_drop(client); // The last one drops the room
+            roster_remove(&(fixture->roster), client);
+            free_client_info(client);
+        }
+        free(fixture->roster.slots);
+        outq_clear(&(fixture->requester.out));
+    }
+    free(fixture->text);
+}
+
+static void run_read_line(Fixture* fixture) {
+    char* line = read_line(fixture->stream);
+    if (line == NULL) { // Round again
+        rewind(fixture->stream);
+        line = read_line(fixture->stream);
+    }
+    free(line);
+}
+
+static void run_get_auth_line(Fixture* fixture) {
+    rewind(fixture->stream);
+    free(get_auth_line(fixture->stream));
+}
+
+static void run_convert_non_printables(Fixture* fixture) {
+    free(convert_non_printables(fixture->text));
+}
+
+static void run_add_client_info(Fixture* fixture) {
+    ClientInfo* client = add_client_info(&(fixture->roster), "newcomer", -1);
+    room_add(fixture->room, client);
+    room_drop(client);
+    roster_remove(&(fixture->roster), client);
+    free_client_info(client);
+}
+
+static void run_list_name(Fixture* fixture) {
+    list_name(fixture->requesterInfo);
+}
+
+static void run_list_name_changed(Fixture* fixture) {
+    run_add_client_info(fixture); // Every LIST: sees a new room roster
+    list_name(fixture->requesterInfo);
+}
+
+static void run_broadcast(Fixture* fixture) {
+    broadcast(room_lobby(), "client", fixture->text, MSG_TYPE);
+}
+
+static const long lineSizes[] = {16, 256, 4096, 65536, 0};
+static const long rosterSizes[] = {10, 1000, 100000, 0};
+
+static const Case cases[] = {
+    {"read_line", "bytes", lineSizes, setup_stream, run_read_line},
+    {"get_auth_line", "bytes", lineSizes, setup_auth, run_get_auth_line},
+    {"convert_non_printables", "bytes", lineSizes, NULL,
+            run_convert_non_printables},
+    {"add_client_info", "clients", rosterSizes, setup_roster,
+            run_add_client_info},
+    {"list_name", "clients", rosterSizes, setup_roster, run_list_name},
+    {"list_name_changed", "clients", rosterSizes, setup_roster,
+            run_list_name_changed},
+    {"broadcast", "bytes", lineSizes, NULL, run_broadcast},
+};
+
+/**
+ * Runs a benchmark at one size and prints a line of results. The number of
+ * runs doubles until a batch takes at least the target time, the last batch
+ * is the one reported.
+ * bench is the benchmark
+ * size is the size to run it at
+ * target is the least time a batch is run for(nanosecond)
+ */
+static void run_case(const Case* bench, long size, long long target) {
+    Fixture fixture;
+    memset(&fixture, 0, sizeof(Fixture));
+    fixture.size = size;
+    fixture.text = make_text(size);
+    if (bench->setup != NULL) {
+        bench->setup(&fixture);
+    }
+    bench->run(&fixture); // Warm up
+
+    long long runs = 1, elapsed;
+    unsigned long long allocs, bytes;
+    while (1) {
+        allocations = 0;
+        allocated = 0;
+        counting = 1;
+        long long start = now_nsec();
+        for (long long i = 0; i < runs; i++) {
+            bench->run(&fixture);
+        }
+        elapsed = now_nsec() - start;
+        counting = 0;
+        allocs = allocations;
+        bytes = allocated;
+        if (elapsed >= target) {
+            break;
+        }
+        runs *= 2;
+    }
+    printf("%s,%s,%ld,%lld,%.1f,%.2f,%.1f\n", bench->name, bench->unit, size,
+            runs, elapsed / (double)runs, allocs / (double)runs,
+            bytes / (double)runs);
+    fflush(stdout);
+    teardown(&fixture);
+}
+
+/**
+ * Measures the server's hot helpers in isolation across input sizes, one
+ * CSV line per benchmark and size:
+ *     name,unit,size,runs,ns_per_op,allocs_per_op,bytes_per_op
+ * Settings are read from the environment, both optional:
+ *     -MICROBENCH_TIME -> least time each measurement runs(millisecond),
+ *     200 default
+ *     -MICROBENCH_FILTER -> only run benchmarks whose name contains this
+ * Broadcasts go to the lobby of a writer reactor with nobody in the chat,
+ * so only the sending side is measured.
+ */
+int main(void) {
+    long long target = config_number(ENV_TIME, 1, 200) * NSEC_MS;
+    char* filter = getenv(ENV_FILTER);
+
+    pthread_mutex_t lock;
+    pthread_mutex_init(&lock, NULL);
+    Roster roster;
+    roster_init(&roster, &lock);
+    Config config;
+    config_load(&config);
+    reactor_start_writer(&config, &roster, &lock);
+
+    printf("name,unit,size,runs,ns_per_op,allocs_per_op,bytes_per_op\n");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(Case); i++) {
+        if (filter != NULL && strstr(cases[i].name, filter) == NULL) {
+            continue;
+        }
+        for (const long* size = cases[i].sizes; *size; size++) {
+            run_case(&(cases[i]), *size, target);
+        }
+    }
+    return NORM_EXIT;
+}
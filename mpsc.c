@@ -0,0 +1,63 @@
+#include <stddef.h>
+#include "mpsc.h"
+
+/**
+ * Sets up an empty queue.
+ * queue is the queue to set up
+ */
+void mpsc_init(MpscQueue* queue) {
+    queue->stub.next = NULL;
+    queue->head = &(queue->stub);
+    queue->tail = &(queue->stub);
+}
+
+/**
+ * Adds a node to the back of a queue. Safe to call from any thread, never
+ * blocks and never fails.
+ * queue is the queue to add to
+ * node is the node to add
+ */
+void mpsc_push(MpscQueue* queue, MpscNode* node) {
+    __atomic_store_n(&(node->next), NULL, __ATOMIC_RELAXED);
+    MpscNode* prev = __atomic_exchange_n(&(queue->head), node,
+            __ATOMIC_ACQ_REL);
+    // Queue is briefly cut here until the link below lands
+    __atomic_store_n(&(prev->next), node, __ATOMIC_RELEASE);
+}
+
+/**
+ * Takes the node at the front of a queue. Only the consuming thread may
+ * call this.
+ * queue is the queue to take from
+ * Returns the node, or NULL if the queue is empty or a producer is half way
+ * through a push(the consumer must be woken again by that producer)
+ */
+MpscNode* mpsc_pop(MpscQueue* queue) {
+    MpscNode* tail = queue->tail;
+    MpscNode* next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+
+    if (tail == &(queue->stub)) { // Skip over the stub
+        if (next == NULL) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&(next->next), __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&(queue->head), __ATOMIC_ACQUIRE)) {
+        return NULL; // A push is in progress
+    }
+
+    // tail is the last node, put the stub behind it so it can be taken
+    mpsc_push(queue, &(queue->stub));
+    next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
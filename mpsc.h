@@ -0,0 +1,22 @@
+#ifndef _MPSC_H
+#define _MPSC_H
+
+/* Link embedded in anything that travels through a queue */
+typedef struct MpscNode {
+    struct MpscNode* next;
+} MpscNode;
+
+/* Unbounded lock-free queue, any thread may push, only one may pop */
+typedef struct MpscQueue {
+    MpscNode* head; // Last pushed node, producers swap themselves in here
+    MpscNode* tail; // Next node to pop, only touched by the consumer
+    MpscNode stub;
+} MpscQueue;
+
+void mpsc_init(MpscQueue* queue);
+
+void mpsc_push(MpscQueue* queue, MpscNode* node);
+
+MpscNode* mpsc_pop(MpscQueue* queue);
+
+#endif
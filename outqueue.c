@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "latency.h"
+#include "outqueue.h"
+#include "pool.h"
+
+/* Slots a queue starts with, most clients never need more */
+#define START_SLOTS 8
+
+/* Frames up to this size in all are pooled, which covers nearly every chat
+ * message, larger ones are allocated on their own */
+#define FRAME_POOLED 256
+
+/* Small frames, one or more per message sent */
+static Pool framePool = POOL_INIT(FRAME_POOLED);
+
+/**
+ * Allocates a frame with room for capacity bytes, for the caller to fill in
+ * before sharing it. The caller holds the only reference.
+ * capacity is the number of data bytes the frame can hold
+ * Returns the new, empty frame
+ */
+OutFrame* frame_alloc(size_t capacity) {
+    OutFrame* frame = sizeof(OutFrame) + capacity <= FRAME_POOLED ?
+            pool_get(&framePool) : malloc(sizeof(OutFrame) + capacity);
+    frame->refs = 1;
+    frame->length = 0;
+    frame->capacity = capacity;
+    frame->born = 0;
+    frame->binary = NULL;
+    frame->nameLength = 0;
+    return frame;
+}
+
+/**
+ * Creates a frame holding a copy of some data.
+ * data is the data, length is its size in bytes
+ * Returns the frame, the caller holds the only reference
+ */
+OutFrame* frame_create(const char* data, size_t length) {
+    OutFrame* frame = frame_alloc(length);
+    memcpy(frame->data, data, length);
+    frame->length = length;
+    return frame;
+}
+
+/**
+ * Creates a frame by formatting straight into it, printf style. This is how
+ * a frame for many recipients is encoded once.
+ * format is the printf format, followed by its arguments
+ * Returns the frame, the caller holds the only reference
+ */
+OutFrame* frame_format(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    // Room for the terminator vsnprintf always writes
+    OutFrame* frame = frame_alloc(length + 1);
+    va_start(args, format);
+    vsnprintf(frame->data, length + 1, format, args);
+    va_end(args);
+    frame->length = length;
+    return frame;
+}
+
+/**
+ * Takes another reference on a frame. Safe to call from any thread.
+ * frame is the frame
+ */
+void frame_hold(OutFrame* frame) {
+    __atomic_add_fetch(&(frame->refs), 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drops a reference on a frame, freeing it if it was the last one. Safe to
+ * call from any thread. The last reference goes once every recipient has
+ * been sent the frame(or dropped it), which ends a timed frame's fan-out.
+ * frame is the frame
+ */
+void frame_release(OutFrame* frame) {
+    if (!__atomic_sub_fetch(&(frame->refs), 1, __ATOMIC_ACQ_REL)) {
+        if (frame->binary != NULL) { // Outlives this one, and times fan-out
+            frame_release(frame->binary);
+        } else if (frame->born) {
+            latency_record(LAT_FANOUT, frame->born);
+        }
+        if (sizeof(OutFrame) + frame->capacity <= FRAME_POOLED) {
+            pool_put(&framePool, frame);
+        } else {
+            free(frame);
+        }
+    }
+}
+
+/**
+ * Gives a frame a twin holding the same commands in the other framing, for
+ * clients that asked for it. The frame keeps the twin alive and the twin
+ * takes over timing the fan-out. Safe to call from any thread, if the frame
+ * got a twin in the meantime that one is kept.
+ * frame is the frame
+ * twin is the twin, the frame takes over the caller's reference
+ * Returns the twin the frame ended up with
+ */
+OutFrame* frame_twin(OutFrame* frame, OutFrame* twin) {
+    OutFrame* existing = NULL;
+    twin->born = frame->born;
+    if (!__atomic_compare_exchange_n(&(frame->binary), &existing, twin, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        twin->born = 0;
+        frame_release(twin);
+        return existing;
+    }
+    return twin;
+}
+
+/**
+ * Sets up an empty queue. No memory is allocated until the first push.
+ * queue is the queue to set up
+ * maxFrames is the most frames that may wait at once
+ * maxBytes is the most bytes that may wait at once(a single frame larger
+ * than this is still accepted by an empty queue)
+ * policy is what to do when full(OUTQ_DISCONNECT, OUTQ_DROP_OLDEST,
+ * OUTQ_COALESCE)
+ */
+void outq_init(OutQueue* queue, unsigned int maxFrames, size_t maxBytes,
+        int policy) {
+    memset(queue, 0, sizeof(OutQueue));
+    queue->maxFrames = maxFrames;
+    queue->maxBytes = maxBytes;
+    queue->policy = policy;
+}
+
+/**
+ * Determines the slot holding the n-th frame from the front.
+ * queue is the queue
+ * n is the position from the front
+ * Returns the slot's index
+ */
+static unsigned int outq_slot(OutQueue* queue, unsigned int n) {
+    return (queue->head + n) % queue->size;
+}
+
+/**
+ * Makes room for one more frame, doubling the slots(up to maxFrames) and
+ * unwrapping the ring into the new array.
+ * queue is the queue to grow
+ */
+static void outq_grow(OutQueue* queue) {
+    if (queue->count < queue->size) {
+        return;
+    }
+    unsigned int newSize = queue->size ? queue->size * 2 : START_SLOTS;
+    if (newSize > queue->maxFrames) {
+        newSize = queue->maxFrames;
+    }
+    OutFrame** frames = malloc(newSize * sizeof(OutFrame*));
+    for (unsigned int i = 0; i < queue->count; i++) {
+        frames[i] = queue->frames[outq_slot(queue, i)];
+    }
+    free(queue->frames);
+    queue->frames = frames;
+    queue->size = newSize;
+    queue->head = 0;
+}
+
+/**
+ * Throws away the oldest frame that hasn't started being written. A frame
+ * being written can't go without corrupting the stream, nor can frames an
+ * asynchronous write is still sending, so the one behind them is taken
+ * instead.
+ * queue is the queue to drop from
+ * Returns 1 if a frame was dropped, 0 if there was none to drop
+ */
+static int outq_drop_oldest(OutQueue* queue) {
+    unsigned int victim = queue->inFlight ? queue->inFlight :
+            (queue->sent ? 1 : 0);
+    if (queue->count <= victim) {
+        return 0;
+    }
+    unsigned int slot = outq_slot(queue, victim);
+    queue->bytes -= queue->frames[slot]->length;
+    frame_release(queue->frames[slot]);
+    for (unsigned int i = victim; i > 0; i--) { // Shift those ahead of it
+        queue->frames[outq_slot(queue, i)] =
+                queue->frames[outq_slot(queue, i - 1)];
+    }
+    queue->head = (queue->head + 1) % queue->size;
+    queue->count--;
+    queue->dropped++;
+    return 1;
+}
+
+/**
+ * Appends a frame's data to the newest frame instead of taking another slot.
+ * The newest frame is only written to if this queue holds the only
+ * reference, otherwise it is replaced by a private copy first.
+ * queue is the queue, it must not be empty
+ * frame is the frame to append
+ */
+static void outq_coalesce(OutQueue* queue, OutFrame* frame) {
+    unsigned int slot = outq_slot(queue, queue->count - 1);
+    OutFrame* tail = queue->frames[slot];
+    size_t needed = tail->length + frame->length;
+    if (__atomic_load_n(&(tail->refs), __ATOMIC_ACQUIRE) > 1 ||
+            needed > tail->capacity) {
+        size_t capacity = tail->capacity ? tail->capacity * 2 : needed;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        OutFrame* copy = frame_alloc(capacity);
+        memcpy(copy->data, tail->data, tail->length);
+        copy->length = tail->length;
+        frame_release(tail);
+        tail = copy;
+        queue->frames[slot] = tail;
+    }
+    memcpy(tail->data + tail->length, frame->data, frame->length);
+    tail->length += frame->length;
+    queue->bytes += frame->length;
+}
+
+/**
+ * Queues a frame, taking a reference on it rather than copying it. When the
+ * queue is full the queue's policy decides what happens:
+ *     -OUTQ_DISCONNECT -> nothing is queued, the client should be dropped
+ *     -OUTQ_DROP_OLDEST -> oldest waiting frames are thrown away for it
+ *     -OUTQ_COALESCE -> merged into the newest frame while the byte limit
+ *     allows, then as OUTQ_DROP_OLDEST
+ * queue is the queue to push to
+ * frame is the frame
+ * Returns OUTQ_QUEUED, OUTQ_DROPPED if frames(possibly this one) were thrown
+ * away, or OUTQ_FULL if the client has to be disconnected
+ */
+int outq_push(OutQueue* queue, OutFrame* frame) {
+    size_t length = frame->length;
+    int result = OUTQ_QUEUED;
+    int frameFull = queue->count >= queue->maxFrames;
+    int byteFull = queue->count && queue->bytes + length > queue->maxBytes;
+
+    if (frameFull || byteFull) {
+        if (queue->policy == OUTQ_DISCONNECT) {
+            return OUTQ_FULL;
+        }
+        if (queue->policy == OUTQ_COALESCE && !byteFull &&
+                queue->count > queue->inFlight) { // Newest isn't being sent
+            outq_coalesce(queue, frame);
+            return OUTQ_QUEUED;
+        }
+        while ((queue->count >= queue->maxFrames || (queue->count &&
+                queue->bytes + length > queue->maxBytes)) &&
+                outq_drop_oldest(queue)) {
+        }
+        if (queue->count >= queue->maxFrames || (queue->count &&
+                queue->bytes + length > queue->maxBytes)) {
+            queue->dropped++; // Only the frame being written is left
+            return OUTQ_DROPPED;
+        }
+        result = OUTQ_DROPPED;
+    }
+
+    outq_grow(queue);
+    frame_hold(frame);
+    queue->frames[outq_slot(queue, queue->count)] = frame;
+    queue->count++;
+    queue->bytes += length;
+    return result;
+}
+
+/**
+ * Describes the data waiting at the front of the queue, so several frames
+ * can go out in one writev/sendmsg call.
+ * queue is the queue
+ * iov is filled in with one entry per frame, starting with the unwritten
+ * part of the frame being written
+ * max is the most entries to fill in
+ * Returns the number of entries filled in, 0 if the queue is empty
+ */
+int outq_iov(OutQueue* queue, struct iovec* iov, int max) {
+    int count = 0;
+    for (; count < max && count < queue->count; count++) {
+        OutFrame* frame = queue->frames[outq_slot(queue, count)];
+        size_t skip = count ? 0 : queue->sent;
+        iov[count].iov_base = frame->data + skip;
+        iov[count].iov_len = frame->length - skip;
+    }
+    return count;
+}
+
+/**
+ * Records bytes as written, freeing every frame that is complete.
+ * queue is the queue
+ * written is the number of bytes written from the front
+ */
+void outq_advance(OutQueue* queue, size_t written) {
+    queue->bytes -= written;
+    written += queue->sent;
+    while (queue->count && written >= queue->frames[queue->head]->length) {
+        written -= queue->frames[queue->head]->length;
+        frame_release(queue->frames[queue->head]);
+        queue->head = (queue->head + 1) % queue->size;
+        queue->count--;
+    }
+    queue->sent = written;
+}
+
+/**
+ * Frees everything a queue holds, leaving it empty.
+ * queue is the queue
+ */
+void outq_clear(OutQueue* queue) {
+    while (queue->count) {
+        frame_release(queue->frames[queue->head]);
+        queue->head = (queue->head + 1) % queue->size;
+        queue->count--;
+    }
+    free(queue->frames);
+    queue->frames = NULL;
+    queue->size = 0;
+    queue->head = 0;
+    queue->bytes = 0;
+    queue->sent = 0;
+    queue->inFlight = 0;
+}
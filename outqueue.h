@@ -0,0 +1,66 @@
+#ifndef _OUTQUEUE_H
+#define _OUTQUEUE_H
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* What happens when a client's outbound queue is full */
+#define OUTQ_DISCONNECT 1
+#define OUTQ_DROP_OLDEST 2
+#define OUTQ_COALESCE 3
+
+/* Results of outq_push */
+#define OUTQ_QUEUED 0
+#define OUTQ_DROPPED 1
+#define OUTQ_FULL 2
+
+/* Encoded protocol data, shared by every queue it is pushed to. Immutable
+ * once shared, freed when the last reference is released. */
+typedef struct OutFrame {
+    int refs;
+    size_t length;
+    size_t capacity;
+    long long born; // When fan-out started(see latency_now), 0 if untimed
+    struct OutFrame* binary; // Same commands as binary frames, see frame_twin
+    size_t nameLength; // Of a MSG:'s sender, 0 for other commands
+    char data[];
+} OutFrame;
+
+/* Bounded ring of frames waiting to be written to one client */
+typedef struct OutQueue {
+    OutFrame** frames;
+    unsigned int head; // Index of the frame being written
+    unsigned int count;
+    unsigned int size; // Slots allocated, grows up to maxFrames
+    unsigned int maxFrames;
+    size_t bytes; // Bytes queued and not yet written
+    size_t maxBytes;
+    size_t sent; // Bytes of the head frame already written
+    unsigned int inFlight; // Front frames an asynchronous write still uses
+    int policy;
+    unsigned long dropped; // Frames thrown away by OUTQ_DROP_OLDEST
+} OutQueue;
+
+OutFrame* frame_alloc(size_t capacity);
+
+OutFrame* frame_create(const char* data, size_t length);
+
+OutFrame* frame_format(const char* format, ...);
+
+void frame_hold(OutFrame* frame);
+
+void frame_release(OutFrame* frame);
+
+OutFrame* frame_twin(OutFrame* frame, OutFrame* twin);
+
+void outq_init(OutQueue* queue, unsigned int maxFrames, size_t maxBytes,
+        int policy);
+
+int outq_push(OutQueue* queue, OutFrame* frame);
+
+int outq_iov(OutQueue* queue, struct iovec* iov, int max);
+
+void outq_advance(OutQueue* queue, size_t written);
+
+void outq_clear(OutQueue* queue);
+
+#endif
@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "pool.h"
+
+/* Free objects are linked through their first word, a full batch's first
+ * object also links to the next batch through its second word */
+#define NEXT(object) (((void**)(object))[0])
+#define NEXT_BATCH(object) (((void**)(object))[1])
+
+/* A thread's own free objects of one pool, taken and handed back without a
+ * lock. Objects move to and from the pool a batch at a time. */
+typedef struct PoolCache {
+    void* free; // Objects ready for pool_get
+    size_t count; // Number of them, at most POOL_BATCH
+    void* full; // A full batch handed back, NULL if none
+} PoolCache;
+
+/* Caches of the calling thread, by pool, unused unless it keeps caches */
+static __thread PoolCache caches[POOL_CACHES];
+static __thread int caching = 0;
+
+/* Pools given caches so far */
+static int cachedPools = 0;
+
+/**
+ * Carves a new slab into objects and adds them to the pool as full batches
+ * of POOL_BATCH objects.
+ * (Note: called with the pool's lock held)
+ * pool is the pool to grow
+ */
+static void pool_grow(Pool* pool) {
+    size_t count = POOL_SLAB / pool->size / POOL_BATCH * POOL_BATCH;
+    if (count == 0) {
+        count = POOL_BATCH;
+    }
+    char* slab = malloc(count * pool->size);
+    for (size_t i = 0; i < count; i += POOL_BATCH) {
+        char* batch = slab + i * pool->size;
+        for (size_t j = 0; j < POOL_BATCH; j++) {
+            NEXT(batch + j * pool->size) = j + 1 < POOL_BATCH ?
+                    batch + (j + 1) * pool->size : NULL;
+        }
+        NEXT_BATCH(batch) = pool->batches;
+        pool->batches = batch;
+    }
+}
+
+/**
+ * Takes up to a batch of free objects from a pool, carving a new slab if
+ * none are free.
+ * (Note: called with the pool's lock held)
+ * pool is the pool
+ * count is set to the number of objects taken
+ * Returns the objects, linked through their first word
+ */
+static void* pool_take(Pool* pool, size_t* count) {
+    void* objects = pool->free;
+    if (pool->batches == NULL && objects != NULL) { // Only loose ones left
+        void* last = objects;
+        for (*count = 1; *count < POOL_BATCH && NEXT(last) != NULL;
+                (*count)++) {
+            last = NEXT(last);
+        }
+        pool->free = NEXT(last);
+        NEXT(last) = NULL;
+        return objects;
+    }
+    if (pool->batches == NULL) {
+        pool_grow(pool);
+    }
+    objects = pool->batches;
+    pool->batches = NEXT_BATCH(objects);
+    *count = POOL_BATCH;
+    return objects;
+}
+
+/**
+ * Determines the calling thread's cache of a pool, giving the pool its
+ * place among the caches the first time it is cached.
+ * pool is the pool
+ * Returns the cache, NULL if the thread keeps none or all places are taken
+ */
+static PoolCache* pool_cache(Pool* pool) {
+    if (!caching) {
+        return NULL;
+    }
+    int id = __atomic_load_n(&(pool->id), __ATOMIC_ACQUIRE);
+    if (!id) {
+        pthread_mutex_lock(&(pool->lock));
+        if (!pool->id) {
+            id = __atomic_add_fetch(&cachedPools, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&(pool->id), id <= POOL_CACHES ? id : -1,
+                    __ATOMIC_RELEASE);
+        }
+        id = pool->id;
+        pthread_mutex_unlock(&(pool->lock));
+    }
+    return id > 0 ? &(caches[id - 1]) : NULL;
+}
+
+/**
+ * Lets the calling thread keep a cache of free objects of every pool, so
+ * its pool_get and pool_put take no lock but once per POOL_BATCH objects.
+ * Meant for the threads doing most of the allocating that run as long as
+ * the server does, the reactors: a cache holds up to two batches of every
+ * pool and they are never handed back.
+ */
+void pool_thread_cache(void) {
+    caching = 1;
+}
+
+/**
+ * Takes an object from a pool, carving a new slab if none are free. The
+ * object's contents are left as they were. Safe to call from any thread.
+ * pool is the pool
+ * Returns the object
+ */
+void* pool_get(Pool* pool) {
+    PoolCache* cache = pool_cache(pool);
+    void* object;
+    if (cache == NULL) {
+        pthread_mutex_lock(&(pool->lock));
+        if (pool->free == NULL) { // Loose objects are a batch again
+            size_t count;
+            pool->free = pool_take(pool, &count);
+        }
+        object = pool->free;
+        pool->free = NEXT(object);
+        pthread_mutex_unlock(&(pool->lock));
+        return object;
+    }
+
+    if (cache->free == NULL && cache->full != NULL) {
+        cache->free = cache->full;
+        cache->count = POOL_BATCH;
+        cache->full = NULL;
+    } else if (cache->free == NULL) {
+        pthread_mutex_lock(&(pool->lock));
+        cache->free = pool_take(pool, &(cache->count));
+        pthread_mutex_unlock(&(pool->lock));
+    }
+    object = cache->free;
+    cache->free = NEXT(object);
+    cache->count--;
+    return object;
+}
+
+/**
+ * Hands an object back to its pool for reuse. Safe to call from any thread,
+ * the object may have been taken by another.
+ * pool is the pool the object was taken from
+ * object is the object
+ */
+void pool_put(Pool* pool, void* object) {
+    PoolCache* cache = pool_cache(pool);
+    if (cache == NULL) {
+        pthread_mutex_lock(&(pool->lock));
+        NEXT(object) = pool->free;
+        pool->free = object;
+        pthread_mutex_unlock(&(pool->lock));
+        return;
+    }
+
+    if (cache->count == POOL_BATCH) { // Full, the older full batch goes back
+        if (cache->full != NULL) {
+            pthread_mutex_lock(&(pool->lock));
+            NEXT_BATCH(cache->full) = pool->batches;
+            pool->batches = cache->full;
+            pthread_mutex_unlock(&(pool->lock));
+        }
+        cache->full = cache->free;
+        cache->free = NULL;
+        cache->count = 0;
+    }
+    NEXT(object) = cache->free;
+    cache->free = object;
+    cache->count++;
+}
@@ -0,0 +1,44 @@
+#ifndef _POOL_H
+#define _POOL_H
+#include <stddef.h>
+#include <pthread.h>
+
+/* Objects are kept at this alignment, enough for any type */
+#define POOL_ALIGN 16
+
+/* Bytes carved into objects at a time */
+#define POOL_SLAB 65536
+
+/* Objects moved between a thread's cache and its pool at a time */
+#define POOL_BATCH 32
+
+/* Most pools threads keep caches of, objects of any others always come
+ * straight from their pool */
+#define POOL_CACHES 16
+
+/* Sets up a pool of objects of a fixed size at compile time, i.e
+ *     static Pool mailPool = POOL_INIT(sizeof(Mail)); */
+#define POOL_INIT(objectSize) {((objectSize) + POOL_ALIGN - 1) & \
+        ~(size_t)(POOL_ALIGN - 1), NULL, NULL, 0, \
+        PTHREAD_MUTEX_INITIALIZER}
+
+/* Fixed size objects carved out of slabs. Objects handed back are kept for
+ * the next pool_get rather than freed, so objects that come and go all day
+ * never churn or fragment the heap, the pool only grows to the most that
+ * were ever in use at once. Threads that keep caches(see pool_thread_cache)
+ * only take the pool's lock once per POOL_BATCH objects. */
+typedef struct Pool {
+    size_t size; // Bytes per object, a multiple of POOL_ALIGN
+    void* batches; // Full batches of free objects, see pool_grow
+    void* free; // Other objects not in use, linked through their first bytes
+    int id; // Index of the pool's caches plus 1, 0 until first cached
+    pthread_mutex_t lock;
+} Pool;
+
+void pool_thread_cache(void);
+
+void* pool_get(Pool* pool);
+
+void pool_put(Pool* pool, void* object);
+
+#endif
@@ -0,0 +1,323 @@
+#include <string.h>
+#include "protocol.h"
+
+/* Key a verb is looked up by, its first letter and length packed together */
+#define PACK(first, length) (((length) << 8) | (unsigned char)(first))
+
+/* Longest verb, anything longer can't be a command */
+#define VERB_MAX 255
+
+/* Largest value a varint may hold, payloads are never longer */
+#define VARINT_LIMIT 0xFFFFFFFFUL
+
+/* Verb of each opcode, to confirm a lookup */
+#define COMMAND_VERB(op, verb, first, length, wire) \
+        [op] = {verb, sizeof(verb) - 1},
+static const struct {
+    const char* verb;
+    size_t length;
+} verbs[CMD_COUNT] = {
+    [CMD_UNKNOWN] = {"", 0},
+    PROTOCOL_COMMANDS(COMMAND_VERB)
+};
+#undef COMMAND_VERB
+
+/* Wire code of each opcode, 0 for none */
+#define COMMAND_WIRE(op, verb, first, length, wire) [op] = wire,
+static const unsigned char wires[CMD_COUNT] = {
+    PROTOCOL_COMMANDS(COMMAND_WIRE)
+};
+#undef COMMAND_WIRE
+
+/**
+ * Finds the command a verb names. The switch is generated from
+ * PROTOCOL_COMMANDS, so the compiler turns it into a jump table and rejects
+ * two commands with the same key; one memcmp then confirms the match.
+ * verb is the verb, not terminated
+ * length is its length in bytes
+ * Returns the command's opcode, CMD_UNKNOWN if it isn't one
+ */
+static int protocol_lookup(const char* verb, size_t length) {
+    int op = CMD_UNKNOWN;
+    if (length == 0 || length > VERB_MAX) {
+        return CMD_UNKNOWN;
+    }
+
+#define COMMAND_CASE(opcode, text, first, size, wire) \
+        case PACK(first, size): op = opcode; break;
+    switch (PACK(verb[0], length)) {
+        PROTOCOL_COMMANDS(COMMAND_CASE)
+        default: return CMD_UNKNOWN;
+    }
+#undef COMMAND_CASE
+
+    if (verbs[op].length != length || memcmp(verb, verbs[op].verb, length)) {
+        return CMD_UNKNOWN;
+    }
+    return op;
+}
+
+/**
+ * Splits a line into its command and argument(i.e SAY:hello -> CMD_SAY,
+ * "hello"). Unlike strtok_r the line is left untouched, so it can still be
+ * used whole. A line without ':' is a command with an empty argument.
+ * line is the line, newline excluded
+ * length is its length in bytes
+ * command is filled in with the result, arg is terminated if line is
+ * Returns the command's opcode, CMD_UNKNOWN if the line isn't a command
+ */
+int protocol_parse(char* line, size_t length, Command* command) {
+    char* colon = memchr(line, ':', length);
+    if (colon == NULL) {
+        command->verbLength = length;
+        command->arg = line + length;
+        command->argLength = 0;
+    } else {
+        command->verbLength = colon - line;
+        command->arg = colon + 1;
+        command->argLength = length - command->verbLength - 1;
+    }
+    command->fieldLength = PROTOCOL_BAD;
+    command->op = protocol_lookup(line, command->verbLength);
+    return command->op;
+}
+
+/**
+ * Reads a varint.
+ * data is where it starts
+ * length is the number of bytes available
+ * value is set to its value
+ * Returns the number of bytes it takes up, 0 if more are needed, or
+ * PROTOCOL_BAD if it is longer than PROTOCOL_VARINT_MAX or too large
+ */
+static size_t varint_read(const char* data, size_t length,
+        unsigned long long* value) {
+    *value = 0;
+    for (size_t i = 0; i < PROTOCOL_VARINT_MAX; i++) {
+        if (i == length) {
+            return 0;
+        }
+        unsigned char byte = data[i];
+        *value |= (unsigned long long)(byte & 0x7F) << (7 * i);
+        if (!(byte & 0x80)) {
+            return *value > VARINT_LIMIT ? PROTOCOL_BAD : i + 1;
+        }
+    }
+    return PROTOCOL_BAD;
+}
+
+/**
+ * Writes a varint.
+ * out is where to write it, NULL to only measure it
+ * value is the value, at most 32 bits
+ * Returns the number of bytes it takes up
+ */
+size_t protocol_varint(char* out, size_t value) {
+    size_t count = 0;
+    do {
+        unsigned char byte = value & 0x7F;
+        value >>= 7;
+        if (out != NULL) {
+            out[count] = value ? byte | 0x80 : byte;
+        }
+        count++;
+    } while (value);
+    return count;
+}
+
+/**
+ * Writes the header of a binary frame, the caller follows it with the
+ * payload and a 0 byte.
+ * out is where to write it, at least PROTOCOL_HEADER_MAX bytes, NULL to
+ * only measure it
+ * op is the command's opcode
+ * payloadLength is the payload's length in bytes
+ * Returns the number of bytes it takes up
+ */
+size_t protocol_header(char* out, int op, size_t payloadLength) {
+    if (out != NULL) {
+        out[0] = wires[op];
+    }
+    return 1 + protocol_varint(out != NULL ? out + 1 : NULL, payloadLength);
+}
+
+/**
+ * Determines how long the binary frame at the start of some data is, only
+ * the header is looked at. This is how a LineReader finds binary frames.
+ * data is the data
+ * length is the number of bytes available
+ * Returns the frame's length including its 0 byte(which may not all be
+ * available yet), 0 if more is needed to tell, or PROTOCOL_BAD if the
+ * header is invalid
+ */
+size_t protocol_split(const char* data, size_t length) {
+    unsigned long long payload;
+    if (length == 0) {
+        return 0;
+    }
+    size_t used = varint_read(data + 1, length - 1, &payload);
+    if (used == 0 || used == PROTOCOL_BAD) {
+        return used;
+    }
+    return 1 + used + payload + 1;
+}
+
+/**
+ * Splits a binary frame into its command and argument. Constant time,
+ * nothing is scanned or copied.
+ * frame is the frame, which protocol_split has found whole
+ * length is its length in bytes, 0 byte excluded
+ * command is filled in with the result, arg is terminated
+ * Returns the command's opcode, CMD_UNKNOWN if the frame isn't a command
+ */
+int protocol_parse_frame(char* frame, size_t length, Command* command) {
+    unsigned long long payload, field;
+    size_t used = varint_read(frame + 1, length - 1, &payload);
+    command->verbLength = 0;
+    command->arg = frame + length;
+    command->argLength = 0;
+    command->fieldLength = PROTOCOL_BAD;
+    command->op = CMD_UNKNOWN;
+    if (used == 0 || used == PROTOCOL_BAD || 1 + used + payload != length) {
+        return CMD_UNKNOWN;
+    }
+    command->arg = frame + 1 + used;
+    command->argLength = payload;
+
+#define COMMAND_WIRE_CASE(opcode, text, first, size, wire) \
+        case wire: command->op = opcode; break;
+    switch ((unsigned char)frame[0]) {
+        PROTOCOL_COMMANDS(COMMAND_WIRE_CASE)
+        default: return CMD_UNKNOWN;
+    }
+#undef COMMAND_WIRE_CASE
+
+    if (command->op == CMD_MSG) { // Name's length, then the name and text
+        used = varint_read(command->arg, command->argLength, &field);
+        if (used == 0 || used == PROTOCOL_BAD ||
+                field > command->argLength - used) {
+            command->op = CMD_UNKNOWN;
+            return CMD_UNKNOWN;
+        }
+        command->arg += used;
+        command->argLength -= used;
+        command->fieldLength = field;
+    }
+    return command->op;
+}
+
+/**
+ * Splits a line or binary frame into its command and argument.
+ * data is the line or frame
+ * length is its length in bytes, newline or 0 byte excluded
+ * binary is whether data is a binary frame
+ * command is filled in with the result
+ * Returns the command's opcode, CMD_UNKNOWN if it isn't a command
+ */
+int protocol_decode(char* data, size_t length, int binary,
+        Command* command) {
+    if (binary) {
+        return protocol_parse_frame(data, length, command);
+    }
+    return protocol_parse(data, length, command);
+}
+
+/**
+ * Determines the verb of a command(i.e CMD_SAY -> "SAY").
+ * op is the command's opcode
+ * Returns the verb, empty for CMD_UNKNOWN
+ */
+const char* protocol_verb(int op) {
+    return verbs[op].verb;
+}
+
+/**
+ * Converts text protocol lines to binary frames, one frame per command.
+ * Lines that aren't commands are left out.
+ * out is where to write the frames, NULL to only measure them
+ * text is the lines, each ending with a newline
+ * length is their length in bytes
+ * Returns the number of bytes the frames take up
+ */
+size_t protocol_binary(char* out, const char* text, size_t length) {
+    size_t written = 0;
+    const char* end = text + length;
+    while (text < end) {
+        const char* newline = memchr(text, '\n', end - text);
+        size_t lineLength = (newline != NULL ? newline : end) - text;
+        Command command;
+        protocol_parse((char*)text, lineLength, &command);
+        text += lineLength + 1;
+        if (command.op == CMD_UNKNOWN) {
+            continue;
+        }
+
+        // MSG's payload is the name's length, the name, then the text
+        size_t fieldLength = 0, prefix = 0;
+        const char* payloadText = command.arg;
+        size_t textLength = command.argLength;
+        if (command.op == CMD_MSG) {
+            payloadText = protocol_field(&command, &fieldLength);
+            prefix = protocol_varint(NULL, fieldLength);
+            textLength = command.arg + command.argLength - payloadText;
+        }
+        size_t payload = prefix + fieldLength + textLength;
+        size_t header = protocol_header(out != NULL ? out + written : NULL,
+                command.op, payload);
+        if (out != NULL) {
+            char* at = out + written + header;
+            if (prefix) {
+                protocol_varint(at, fieldLength);
+                memcpy(at + prefix, command.arg, fieldLength);
+            }
+            memcpy(at + prefix + fieldLength, payloadText, textLength);
+            at[payload] = '\0';
+        }
+        written += header + payload + 1;
+    }
+    return written;
+}
+
+/**
+ * Writes the binary frame of a MSG. Unlike the text line it says how long
+ * the name is, so binary clients can tell a ':' in the name from the text.
+ * out is where to write it, NULL to only measure it
+ * name is the sender's name, nameLength is its length in bytes
+ * text is the message, length is its length in bytes
+ * Returns the number of bytes the frame takes up
+ */
+size_t protocol_msg(char* out, const char* name, size_t nameLength,
+        const char* text, size_t length) {
+    size_t prefix = protocol_varint(NULL, nameLength);
+    size_t payload = prefix + nameLength + length;
+    size_t header = protocol_header(out, CMD_MSG, payload);
+    if (out != NULL) {
+        char* at = out + header;
+        protocol_varint(at, nameLength);
+        memcpy(at + prefix, name, nameLength);
+        memcpy(at + prefix + nameLength, text, length);
+        at[payload] = '\0';
+    }
+    return header + payload + 1;
+}
+
+/**
+ * Splits the argument of a command carrying two fields at its first ':'
+ * (i.e MSG:name:text). Nothing is copied or terminated.
+ * command is the parsed command
+ * length is set to the length of the first field, which starts at arg
+ * Returns the second field, empty if there is no ':'
+ */
+char* protocol_field(const Command* command, size_t* length) {
+    if (command->fieldLength != PROTOCOL_BAD) { // Binary, length is known
+        *length = command->fieldLength;
+        return command->arg + command->fieldLength;
+    }
+    char* colon = memchr(command->arg, ':', command->argLength);
+    if (colon == NULL) {
+        *length = command->argLength;
+        return command->arg + command->argLength;
+    }
+    *length = colon - command->arg;
+    return colon + 1;
+}
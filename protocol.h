@@ -0,0 +1,80 @@
+#ifndef _PROTOCOL_H
+#define _PROTOCOL_H
+#include <stddef.h>
+
+/* Every command of the protocol, sent by either side, as
+ * X(opcode, verb, first letter, length, wire code). The first letter and
+ * length are the key commands are looked up by, no two commands may share
+ * one. The wire code stands for the command in binary frames and must never
+ * change. */
+#define PROTOCOL_COMMANDS(X) \
+    X(CMD_AUTH, "AUTH", 'A', 4, 1) \
+    X(CMD_OK, "OK", 'O', 2, 2) \
+    X(CMD_WHO, "WHO", 'W', 3, 3) \
+    X(CMD_NAME, "NAME", 'N', 4, 4) \
+    X(CMD_NAME_TAKEN, "NAME_TAKEN", 'N', 10, 5) \
+    X(CMD_ENTER, "ENTER", 'E', 5, 6) \
+    X(CMD_LEAVE, "LEAVE", 'L', 5, 7) \
+    X(CMD_SAY, "SAY", 'S', 3, 8) \
+    X(CMD_MSG, "MSG", 'M', 3, 9) \
+    X(CMD_KICK, "KICK", 'K', 4, 10) \
+    X(CMD_LIST, "LIST", 'L', 4, 11) \
+    X(CMD_BIN, "BIN", 'B', 3, 12) \
+    X(CMD_JOIN, "JOIN", 'J', 4, 13) \
+    X(CMD_PART, "PART", 'P', 4, 14) \
+    X(CMD_HISTORY, "HISTORY", 'H', 7, 15)
+
+/* Binary framing, offered by the server with BIN: after AUTH: succeeds. A
+ * client opts in by answering BIN:, the server acknowledges with BIN: and
+ * both sides send frames from then on:
+ *     wire code(1 byte), payload length(varint), payload, 0 byte
+ * The varint is little endian base 128, 7 bits a byte with the top bit set
+ * on all but the last. The payload is a command's argument, except for MSG
+ * where it is the name's length(varint), the name, then the text. The 0
+ * byte lets a payload be used in place as a string. */
+#define PROTOCOL_VARINT_MAX 5 // Bytes of the longest varint, 32 bits
+#define PROTOCOL_HEADER_MAX (1 + PROTOCOL_VARINT_MAX)
+#define PROTOCOL_BAD ((size_t)-1) // protocol_split found no valid frame
+
+/* Opcodes, CMD_UNKNOWN for a line that isn't a command */
+#define COMMAND_OPCODE(op, verb, first, length, wire) op,
+enum {
+    CMD_UNKNOWN = 0,
+    PROTOCOL_COMMANDS(COMMAND_OPCODE)
+    CMD_COUNT
+};
+#undef COMMAND_OPCODE
+
+/* A line split into its command and argument. Nothing is copied, arg points
+ * into the line. */
+typedef struct Command {
+    int op;
+    size_t verbLength; // Bytes before the first ':'
+    char* arg; // Everything after the first ':', empty if there is none
+    size_t argLength;
+    size_t fieldLength; // First field of a binary MSG, see protocol_field
+} Command;
+
+int protocol_parse(char* line, size_t length, Command* command);
+
+int protocol_parse_frame(char* frame, size_t length, Command* command);
+
+int protocol_decode(char* data, size_t length, int binary,
+        Command* command);
+
+char* protocol_field(const Command* command, size_t* length);
+
+const char* protocol_verb(int op);
+
+size_t protocol_varint(char* out, size_t value);
+
+size_t protocol_header(char* out, int op, size_t payloadLength);
+
+size_t protocol_split(const char* data, size_t length);
+
+size_t protocol_binary(char* out, const char* text, size_t length);
+
+size_t protocol_msg(char* out, const char* name, size_t nameLength,
+        const char* text, size_t length);
+
+#endif
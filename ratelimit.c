@@ -0,0 +1,50 @@
+#include "ratelimit.h"
+
+/* Microseconds in a second */
+#define USEC 1000000LL
+
+/**
+ * Sets up a full bucket.
+ * limit is the bucket to set up
+ * rate is the number of tokens earned per second, 0 for no limit
+ * burst is the most tokens the bucket holds(at least 1)
+ */
+void rate_init(RateLimit* limit, long rate, long burst) {
+    limit->due = 0;
+    limit->interval = rate > 0 ? USEC / rate : 0;
+    limit->tolerance = (burst > 1 ? burst - 1 : 0) * limit->interval;
+}
+
+/**
+ * Takes a token from a bucket. Nothing is taken if the bucket is empty.
+ * Safe to call from any thread, never blocks.
+ * limit is the bucket
+ * now is the current time(microsecond)
+ * Returns 0 if a token was taken, otherwise how long until one is
+ * available(microsecond)
+ */
+long long rate_take(RateLimit* limit, long long now) {
+    long long due, next;
+    if (!limit->interval) {
+        return 0;
+    }
+    due = __atomic_load_n(&(limit->due), __ATOMIC_RELAXED);
+    do {
+        long long start = due > now ? due : now; // A full bucket stays full
+        if (start - now > limit->tolerance) {
+            return start - now - limit->tolerance;
+        }
+        next = start + limit->interval;
+    } while (!__atomic_compare_exchange_n(&(limit->due), &due, next, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/**
+ * Puts back a token taken by rate_take, for when a second bucket refuses.
+ * Safe to call from any thread.
+ * limit is the bucket
+ */
+void rate_refund(RateLimit* limit) {
+    __atomic_sub_fetch(&(limit->due), limit->interval, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,18 @@
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+/* Token bucket, kept as the time the bucket is next full enough(GCRA) so a
+ * single word is enough to take tokens from any thread */
+typedef struct RateLimit {
+    long long due; // When the next token is earned(microsecond)
+    long long interval; // Microseconds per token, 0 if unlimited
+    long long tolerance; // How far due may run ahead of now(the burst)
+} RateLimit;
+
+void rate_init(RateLimit* limit, long rate, long burst);
+
+long long rate_take(RateLimit* limit, long long now);
+
+void rate_refund(RateLimit* limit);
+
+#endif
@@ -0,0 +1,1600 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include "commonfunction.h"
+#include "epoch.h"
+#include "latency.h"
+#include "linereader.h"
+#include "logger.h"
+#include "metrics.h"
+#include "mpsc.h"
+#include "outqueue.h"
+#include "pool.h"
+#include "protocol.h"
+#include "ratelimit.h"
+#include "roster.h"
+#include "reactor.h"
+#include "server.h"
+#include "uring.h"
+
+/* Number of epoll events handled per wake up */
+#define MAX_EVENTS 256
+
+/* Most frames handed to a single sendmsg call */
+#define IOV_BATCH 64
+
+/* Output held back for coalescing is flushed at once when it gets this big */
+#define HOLD_BYTES 65536
+
+/* Longest a reactor out of descriptors waits before trying to accept again,
+ * a connection of its own closing ends the wait sooner */
+#define ACCEPT_RETRY_USEC 100000
+
+/* Set once epoll_pwait2 turns out to be missing from the kernel */
+static int noPwait2 = 0;
+
+/* What an io_uring request is for, kept in the low bits of its user data
+ * next to the connection it is about(pool objects are 16 byte aligned) */
+#define OP_ACCEPT 0
+#define OP_WAKE 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_MASK 3
+
+/* Reactor run by the calling thread, NULL outside of reactor threads */
+static __thread Reactor* currentReactor = NULL;
+
+/* Reactors of the running server, NULL when running thread per client */
+static ReactorGroup* activeGroup = NULL;
+
+/* Connections and mail come and go with every client and every message */
+static Pool connectionPool = POOL_INIT(sizeof(Connection));
+static Pool mailPool = POOL_INIT(sizeof(Mail));
+
+/**
+ * Determines the current time of a monotonic clock.
+ * Returns the time in microseconds.
+ */
+static long long now_usec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Queues a connection to have its output flushed at the end of the current
+ * loop iteration, or a later one if it is held back to be coalesced.
+ * Queuing twice is harmless.
+ * conn is the connection with output waiting
+ */
+static void connection_mark_dirty(Connection* conn) {
+    Reactor* reactor = conn->reactor;
+    if (!conn->dirty) {
+        conn->dirty = 1;
+        conn->nextDirty = reactor->dirty;
+        reactor->dirty = conn;
+    }
+}
+
+/**
+ * Moves the queued frames and bytes gauges by how much a connection's
+ * outbound queue changed.
+ * conn is the connection
+ * frames is the number of frames queued before the change
+ * bytes is the number of bytes queued before the change
+ */
+static void connection_queue_moved(Connection* conn, unsigned int frames,
+        size_t bytes) {
+    metric_add(METRIC_QUEUED_FRAMES,
+            (long long)conn->out.count - (long long)frames);
+    metric_add(METRIC_QUEUED_BYTES,
+            (long long)conn->out.bytes - (long long)bytes);
+}
+
+/**
+ * Determines the binary framing of a frame, converting it the first time a
+ * binary client needs it. Every binary client then shares the conversion.
+ * A MSG: is converted from the length of the name kept with it, as a ':' in
+ * the name can't be told from the one after it in the line.
+ * frame is the frame, in text framing
+ * Returns the frame's binary twin, owned by the frame
+ */
+static OutFrame* frame_binary(OutFrame* frame) {
+    OutFrame* twin = __atomic_load_n(&(frame->binary), __ATOMIC_ACQUIRE);
+    if (twin != NULL) {
+        return twin;
+    }
+    if (frame->nameLength) { // MSG:name:text
+        const char* name = frame->data + strlen("MSG:");
+        const char* text = name + frame->nameLength + 1; // After the ':'
+        size_t length = frame->data + frame->length - 1 - text; // Less '\n'
+        twin = frame_alloc(protocol_msg(NULL, name, frame->nameLength, text,
+                length));
+        twin->length = protocol_msg(twin->data, name, frame->nameLength,
+                text, length);
+    } else {
+        twin = frame_alloc(protocol_binary(NULL, frame->data,
+                frame->length));
+        twin->length = protocol_binary(twin->data, frame->data,
+                frame->length);
+    }
+    return frame_twin(frame, twin);
+}
+
+/**
+ * Appends a frame to a connection's outbound queue, the connection must
+ * belong to the calling reactor. A client whose queue is full under the
+ * disconnect policy is dropped at the next flush, as this may be called with
+ * the roster lock held.
+ * conn is the connection to send to
+ * frame is the frame to send in text framing, the queue takes its own
+ * reference on it or its binary twin
+ */
+static void connection_append(Connection* conn, OutFrame* frame) {
+    if (conn->state == CONN_CLOSED || conn->overflowed) {
+        return;
+    }
+    if (conn->binary) {
+        frame = frame_binary(frame);
+    }
+    unsigned int frames = conn->out.count;
+    size_t bytes = conn->out.bytes;
+    unsigned long dropped = conn->out.dropped;
+    if (outq_push(&(conn->out), frame) == OUTQ_FULL) {
+        conn->overflowed = 1;
+        metric_add(METRIC_DROPPED, 1);
+    } else {
+        metric_add(METRIC_FRAMES_OUT, 1);
+        metric_add(METRIC_DROPPED, conn->out.dropped - dropped);
+    }
+    connection_queue_moved(conn, frames, bytes);
+    connection_mark_dirty(conn);
+}
+
+/**
+ * Creates mail for a reactor. Mail holds a reference on the connection it is
+ * about and on the frame it carries, so both stay allocated until the mail
+ * has been handled.
+ * type is the kind of mail(MAIL_BROADCAST, MAIL_SEND, MAIL_CLOSE,
+ * MAIL_ADOPT, MAIL_MOVE, MAIL_BATCH)
+ * conn is the connection the mail is about, NULL for broadcasts
+ * frame is the frame to carry, NULL if none
+ * Returns the new mail
+ */
+static Mail* mail_create(int type, Connection* conn, OutFrame* frame) {
+    Mail* mail = pool_get(&mailPool);
+    mail->type = type;
+    mail->flush = 0;
+    mail->conn = conn;
+    mail->frame = frame;
+    mail->room = NULL;
+    mail->batch = NULL;
+    if (frame != NULL) {
+        frame_hold(frame);
+    }
+    if (conn != NULL) {
+        __atomic_add_fetch(&(conn->refs), 1, __ATOMIC_RELAXED);
+    }
+    return mail;
+}
+
+/**
+ * Hands mail to a reactor, waking it up if it is not already due to look
+ * at its inbox.
+ * reactor is the reactor to post to
+ * mail is the mail to post
+ */
+static void reactor_post(Reactor* reactor, Mail* mail) {
+    mpsc_push(&(reactor->inbox), &(mail->node));
+    if (!__atomic_exchange_n(&(reactor->wakePending), 1, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        while (write(reactor->wakeFd, &one, sizeof(one)) < 0 &&
+                errno == EINTR) {
+        }
+    }
+}
+
+/**
+ * Queues a frame to be sent to a connection. Nothing is written here, the
+ * owning reactor flushes every connection with output once per loop
+ * iteration. Safe to call from any thread, a frame for a connection owned by
+ * another reactor is mailed to it.
+ * conn is the connection to send to
+ * frame is the frame to send, the caller keeps its reference
+ */
+void connection_send_frame(Connection* conn, OutFrame* frame) {
+    if (conn->reactor == currentReactor) {
+        connection_append(conn, frame);
+    } else {
+        reactor_post(conn->reactor, mail_create(MAIL_SEND, conn, frame));
+    }
+}
+
+/**
+ * Queues a batch of frames to be sent to a connection, in order. A batch
+ * for a connection owned by another reactor travels as one piece of mail,
+ * and the frames go out together at the reactor's next flush, in as few
+ * writes as the queue allows. Safe to call from any thread.
+ * conn is the connection to send to
+ * frames is the frames(allocated), each held for the call, both taken over
+ * count is the number of frames
+ */
+void connection_send_batch(Connection* conn, OutFrame** frames,
+        size_t count) {
+    if (conn->reactor != currentReactor) {
+        Mail* mail = mail_create(MAIL_BATCH, conn, NULL);
+        mail->batch = frames;
+        mail->batchCount = count;
+        reactor_post(conn->reactor, mail);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        connection_append(conn, frames[i]);
+        frame_release(frames[i]);
+    }
+    free(frames);
+}
+
+/**
+ * Queues a copy of some data to be sent to a connection, see
+ * connection_send_frame.
+ * conn is the connection to send to
+ * data is the data to send, length is its size in bytes
+ */
+void connection_send(Connection* conn, const char* data, size_t length) {
+    OutFrame* frame = frame_create(data, length);
+    connection_send_frame(conn, frame);
+    frame_release(frame);
+}
+
+/**
+ * Stops handling a connection's input for a period of time, this is how a
+ * client is paced without blocking anyone else.
+ * conn is the connection to pace
+ * delay is how long to pause for(microsecond)
+ */
+static void connection_pause(Connection* conn, long long delay) {
+    Reactor* reactor = conn->reactor;
+    conn->resumeAt = now_usec() + delay;
+    conn->prevPaused = NULL;
+    conn->nextPaused = reactor->paused;
+    if (reactor->paused != NULL) {
+        reactor->paused->prevPaused = conn;
+    }
+    reactor->paused = conn;
+}
+
+/**
+ * Takes a connection off the paused list.
+ * conn is the paused connection
+ */
+static void connection_unpause(Connection* conn) {
+    Reactor* reactor = conn->reactor;
+    if (conn->prevPaused != NULL) {
+        conn->prevPaused->nextPaused = conn->nextPaused;
+    } else {
+        reactor->paused = conn->nextPaused;
+    }
+    if (conn->nextPaused != NULL) {
+        conn->nextPaused->prevPaused = conn->prevPaused;
+    }
+    conn->resumeAt = 0;
+}
+
+/**
+ * Moves a connection from the member list of its room, if it is on one, to
+ * that of another room, from then on it receives the room's broadcasts.
+ * Each list only holds the reactor's own connections and is only changed
+ * by it.
+ * conn is the connection, owned by the calling reactor
+ * room is the room, NULL to only leave the current one
+ */
+static void connection_link(Connection* conn, Room* room) {
+    Connection** members;
+    if (conn->room != NULL) {
+        members = &(conn->room->members[conn->reactor->id]);
+        if (conn->prevMember != NULL) {
+            conn->prevMember->nextMember = conn->nextMember;
+        } else {
+            *members = conn->nextMember;
+        }
+        if (conn->nextMember != NULL) {
+            conn->nextMember->prevMember = conn->prevMember;
+        }
+        room_release(conn->room);
+        conn->room = NULL;
+    }
+    if (room == NULL || conn->state == CONN_CLOSED) {
+        return;
+    }
+    members = &(room->members[conn->reactor->id]);
+    conn->prevMember = NULL;
+    conn->nextMember = *members;
+    if (*members != NULL) {
+        (*members)->prevMember = conn;
+    }
+    *members = conn;
+    room_hold(room);
+    conn->room = room;
+}
+
+/**
+ * Closes a connection's socket straight away. The structure itself is freed
+ * at the end of the loop iteration as events may still refer to it.
+ * conn is the connection to destroy
+ */
+static void connection_destroy(Connection* conn) {
+    Reactor* reactor = conn->reactor;
+    if (conn->state == CONN_CLOSED) {
+        return;
+    }
+    if (conn->resumeAt) {
+        connection_unpause(conn);
+    }
+    connection_link(conn, NULL);
+    if (!conn->writeOnly) { // Client threads count their own
+        metric_add(METRIC_CONNECTIONS, -1);
+    }
+    if (reactor->ring != NULL) { // Ends its receive and send in progress
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    close(conn->fd); // Also takes it out of the epoll set
+    conn->fd = -1;
+    if (reactor->acceptResume) { // A descriptor to accept into is free
+        reactor->acceptResume = now_usec();
+    }
+    conn->state = CONN_CLOSED;
+    conn->nextClosed = reactor->closed;
+    reactor->closed = conn;
+}
+
+/**
+ * Closes a connection. No more input is handled after this call. Safe to
+ * call from any thread, a connection owned by another reactor is closed by
+ * mailing it the request.
+ * conn is the connection to close
+ * flush is whether output already queued should still be sent first
+ *     0 -> close straight away
+ *     else -> close once everything queued has been sent
+ */
+void connection_close(Connection* conn, int flush) {
+    if (conn->reactor != currentReactor) {
+        Mail* mail = mail_create(MAIL_CLOSE, conn, NULL);
+        mail->flush = flush;
+        reactor_post(conn->reactor, mail);
+        return;
+    }
+    if (conn->state == CONN_CLOSED) {
+        return;
+    }
+    conn->closing = 1;
+    if (!flush || conn->out.count == 0) {
+        connection_destroy(conn);
+    }
+}
+
+/**
+ * Marks a connection as taken out of the roster and closes it once its
+ * output has been sent. A client thread reading an adopted connection is
+ * woken up as if the client had disconnected. Called with the roster lock
+ * held.
+ * conn is the connection that left the chat
+ */
+void connection_detach(Connection* conn) {
+    __atomic_store_n(&(conn->joined), 0, __ATOMIC_RELEASE);
+    if (conn->writeOnly) {
+        shutdown(conn->fd, SHUT_RD);
+    }
+    connection_close(conn, 1);
+}
+
+/**
+ * Drops a client thread's reference on the connection it was adopted with.
+ * The connection must not be used by the caller afterwards.
+ * conn is the connection
+ */
+void connection_release(Connection* conn) {
+    __atomic_sub_fetch(&(conn->refs), 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Moves a connection from one room to another. The rooms' counts change
+ * straight away, so a broadcast made after this call reaches the reactor
+ * owning the connection, the member lists are changed by that reactor.
+ * Mail it is sent after this call is handled after the move. Safe to call
+ * from any thread, called with the roster lock held.
+ * conn is the connection
+ * from is the room it is in, NULL if none
+ * to is the room it moves to, NULL to take it out of the chat
+ */
+void connection_move(Connection* conn, Room* from, Room* to) {
+    int id = conn->reactor->id;
+    if (from != NULL) {
+        __atomic_sub_fetch(&(from->counts[id]), 1, __ATOMIC_RELAXED);
+    }
+    if (to != NULL) {
+        __atomic_add_fetch(&(to->counts[id]), 1, __ATOMIC_RELAXED);
+    }
+    if (conn->reactor == currentReactor) {
+        connection_link(conn, to);
+        return;
+    }
+    Mail* mail = mail_create(MAIL_MOVE, conn, NULL);
+    if (to != NULL) {
+        room_hold(to);
+        mail->room = to;
+    }
+    reactor_post(conn->reactor, mail);
+}
+
+/**
+ * Takes a token for a SAY: from both the client's and the server wide rate
+ * limit, or from neither.
+ * conn is the connection of the client saying something
+ * Returns 0 if the SAY: may go now, otherwise how long until it
+ * may(microsecond)
+ */
+static long long connection_say_take(Connection* conn) {
+    long long now = now_usec();
+    long long wait = rate_take(&(conn->sayLimit), now);
+    if (wait) {
+        return wait;
+    }
+    if ((wait = rate_take(&(conn->reactor->group->sayLimit), now)) != 0) {
+        rate_refund(&(conn->sayLimit));
+    }
+    return wait;
+}
+
+/**
+ * Applies the SAY: rate limit for a client thread, see CHAT_SAY_POLICY.
+ * Under the pace policy only the calling thread sleeps, with no lock held.
+ * conn is the connection the client thread was adopted with
+ * Returns 1 if the SAY: may be handled, 0 if it is to be dropped
+ */
+int connection_say_wait(Connection* conn) {
+    long long wait;
+    while ((wait = connection_say_take(conn)) != 0) {
+        if (conn->reactor->group->config->sayPolicy == SAY_REJECT) {
+            return 0;
+        }
+        usleep(wait);
+    }
+    return 1;
+}
+
+/**
+ * Handles a connection whose client disconnected or whose socket failed. If
+ * the client was in the chat, everyone else is told they have left.
+ * conn is the lost connection
+ */
+static void connection_lost(Connection* conn) {
+    ReactorGroup* group = conn->reactor->group;
+    if (conn->info != NULL) {
+        latency_lock(group->lock);
+        if (conn->joined) { // Not kicked in the meantime
+            leave_chat(group->roster, conn->name);
+        }
+        pthread_mutex_unlock(group->lock);
+    }
+    connection_close(conn, 0);
+}
+
+/**
+ * Submits a request on a reactor's ring, tagged with what it is for. The
+ * connection it is about holds a reference until it completes, so it isn't
+ * freed while the kernel still uses it.
+ * reactor is the reactor
+ * op is what the request is for(OP_*)
+ * conn is the connection it is about, NULL if none
+ * Returns the submission to fill in, its user data already set
+ */
+static struct io_uring_sqe* reactor_submit(Reactor* reactor, int op,
+        Connection* conn) {
+    struct io_uring_sqe* sqe = uring_sqe(reactor->ring);
+    sqe->user_data = (unsigned long long)(uintptr_t)conn | op;
+    if (conn != NULL) {
+        __atomic_add_fetch(&(conn->refs), 1, __ATOMIC_RELAXED);
+    }
+    return sqe;
+}
+
+/**
+ * Submits a send of the front of a connection's outbound queue, as many
+ * frames as fit in one sendmsg, unless a send is already in progress. Its
+ * completion sends the rest, a slow client only ever holds up its own queue.
+ * Every send submitted in a loop iteration goes to the kernel in the same
+ * io_uring_enter.
+ * conn is the connection to send to
+ */
+static void connection_submit_send(Connection* conn) {
+    if (conn->sending) {
+        return;
+    }
+    if (conn->sendMessage == NULL) {
+        conn->sendMessage = malloc(sizeof(struct msghdr) +
+                IOV_BATCH * sizeof(struct iovec));
+    }
+    struct msghdr* message = conn->sendMessage;
+    struct iovec* iov = (struct iovec*)(message + 1);
+    int count = outq_iov(&(conn->out), iov, IOV_BATCH);
+    if (count == 0) {
+        return;
+    }
+    memset(message, 0, sizeof(struct msghdr));
+    message->msg_iov = iov;
+    message->msg_iovlen = count;
+    conn->out.inFlight = count; // Left alone by the queue's policy
+    conn->sending = 1;
+    conn->sendStart = latency_now();
+    struct io_uring_sqe* sqe = reactor_submit(conn->reactor, OP_SEND, conn);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (unsigned long long)(uintptr_t)message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    metric_add(METRIC_WRITES, 1);
+}
+
+/**
+ * Handles a completed send, sending what is left of the connection's queue
+ * or finishing a close once it is empty.
+ * conn is the connection sent to
+ * result is the number of bytes sent, or a negative errno
+ */
+static void connection_sent(Connection* conn, int result) {
+    unsigned int frames = conn->out.count;
+    size_t bytes = conn->out.bytes;
+    conn->sending = 0;
+    conn->out.inFlight = 0;
+    latency_record(LAT_WRITE, conn->sendStart);
+    if (conn->state == CONN_CLOSED) { // Queue goes when it is freed
+        return;
+    }
+    if (result < 0 && result != -EINTR && result != -EAGAIN) {
+        outq_clear(&(conn->out));
+        connection_queue_moved(conn, frames, bytes);
+        connection_lost(conn);
+        return;
+    }
+    if (result > 0) {
+        outq_advance(&(conn->out), result);
+        metric_add(METRIC_BYTES_OUT, result);
+        connection_queue_moved(conn, frames, bytes);
+    }
+    if (conn->out.count) {
+        connection_mark_dirty(conn);
+    } else if (conn->closing) {
+        connection_destroy(conn);
+    }
+}
+
+/**
+ * Writes as much of a connection's outbound queue as its socket accepts,
+ * up to IOV_BATCH frames per system call. What is left is sent when epoll
+ * reports the socket as writable again, so a slow client only ever holds up
+ * its own queue. A reactor driven by io_uring submits a send instead.
+ * conn is the connection to flush
+ */
+static void connection_flush(Connection* conn) {
+    struct iovec iov[IOV_BATCH];
+    struct msghdr message;
+    int count;
+    unsigned int frames = conn->out.count;
+    size_t bytes = conn->out.bytes;
+    if (conn->overflowed) { // Too slow to keep up, see CHAT_OUTQ_POLICY
+        if (conn->name != NULL) {
+            logger_write(EVENT_SLOW, NULL, conn->name, NULL, 0);
+        }
+        if (!conn->sending) { // Otherwise cleared once the send is done
+            outq_clear(&(conn->out));
+            connection_queue_moved(conn, frames, bytes);
+        }
+        connection_lost(conn);
+        return;
+    }
+    if (conn->reactor->ring != NULL) {
+        connection_submit_send(conn);
+        return;
+    }
+    while ((count = outq_iov(&(conn->out), iov, IOV_BATCH)) > 0) {
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        // sendmsg rather than writev, adopted sockets are left blocking
+        long long writing = latency_now();
+        ssize_t written = sendmsg(conn->fd, &message,
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+        latency_record(LAT_WRITE, writing);
+        metric_add(METRIC_WRITES, 1);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                outq_clear(&(conn->out));
+                connection_queue_moved(conn, frames, bytes);
+                connection_lost(conn);
+                return;
+            }
+            break; // Socket is full, wait for EPOLLOUT
+        }
+        outq_advance(&(conn->out), written);
+        metric_add(METRIC_BYTES_OUT, written);
+    }
+    connection_queue_moved(conn, frames, bytes);
+
+    if (conn->out.count == 0 && conn->closing) {
+        connection_destroy(conn);
+    }
+}
+
+/**
+ * Handles the authentication line of a connection. Same protocol as
+ * auth_check, client gets OK: and the binary framing offer followed by WHO:
+ * if it matches or is closed if it doesn't.
+ * conn is the connection authenticating
+ * length is the length of the line sent by client
+ * command is the parsed line
+ */
+static void connection_auth(Connection* conn, size_t length,
+        Command* command) {
+    ReactorGroup* group = conn->reactor->group;
+
+    if (length == 0) {
+        connection_close(conn, 0);
+        return;
+    }
+    if (command->op == CMD_AUTH) {
+        metric_add(METRIC_AUTH, 1); // Server total stat for SIGHUP
+    }
+
+    // If auth code matches or no server auth needed
+    if (!strcmp(group->serverAuth, command->arg) ||
+            !strcmp(group->serverAuth, "noauth")) {
+        connection_send(conn, "OK:\nBIN:\nWHO:\n",
+                strlen("OK:\nBIN:\nWHO:\n"));
+        conn->state = CONN_NAME;
+        return;
+    }
+    connection_close(conn, 0);
+}
+
+/**
+ * Handles a NAME: line during name negotiation. Same protocol as
+ * name_handler, an empty or taken name gets NAME_TAKEN: and WHO: again, a
+ * unique one adds the client to the chat. A BIN: instead switches the
+ * connection to binary frames, acknowledged with BIN:.
+ * conn is the connection negotiating its name
+ * command is the parsed line
+ */
+static void connection_name(Connection* conn, Command* command) {
+    Reactor* reactor = conn->reactor;
+    ReactorGroup* group = reactor->group;
+
+    if (command->op == CMD_BIN) {
+        if (!conn->binary) { // Last text the client gets
+            connection_send(conn, "BIN:\n", strlen("BIN:\n"));
+            conn->binary = 1;
+            conn->in.split = protocol_split;
+        }
+        return;
+    }
+    if (command->op == CMD_NAME) {
+        metric_add(METRIC_NAME, 1); // Server counter for SIGHUP stat
+    }
+
+    char* clientName = command->arg;
+    latency_lock(group->lock);
+    if (!name_usable(clientName, command->argLength) ||
+            name_exist(group->roster, clientName)) {
+        pthread_mutex_unlock(group->lock);
+        connection_send(conn, "NAME_TAKEN:\nWHO:\n",
+                strlen("NAME_TAKEN:\nWHO:\n"));
+        return;
+    }
+
+    // After finding a unique name
+    conn->name = strdup(clientName);
+    conn->convertName = convert_non_printables(conn->name);
+    conn->info = add_client_info(group->roster, conn->name, conn->fd);
+    conn->info->conn = conn;
+    conn->joined = 1;
+    conn->state = CONN_CHAT;
+
+    connection_send(conn, "OK:\n", strlen("OK:\n"));
+    logger_write(EVENT_ENTER, NULL, conn->name, NULL, 0);
+    move_client(conn->info, room_lobby());
+    pthread_mutex_unlock(group->lock);
+}
+
+/**
+ * Handles a command from a client in the chat(SAY:, LIST:, KICK:, LEAVE:,
+ * JOIN:, PART:, HISTORY:), any other command is silently ignored.
+ * conn is the connection of the client
+ * command is the parsed line sent by client
+ */
+static void connection_chat(Connection* conn, Command* command) {
+    ReactorGroup* group = conn->reactor->group;
+
+    if (command->op == CMD_SAY) { // Roster isn't touched, no lock needed
+        say_handler(conn->info, conn->convertName, command->arg,
+                command->argLength);
+        return;
+    }
+    if (command->op == CMD_LIST) { // Reads a snapshot, no lock needed
+        metric_add(METRIC_LIST, 1); // For server stat
+        metric_bump(&(conn->info->list)); // For client stat
+        list_name(conn->info);
+        return;
+    }
+    if (command->op == CMD_HISTORY) { // Reads the room's history, no lock
+        metric_add(METRIC_HISTORY, 1); // For server stat
+        history_handler(conn->info, command->arg);
+        return;
+    }
+    if (command->op != CMD_KICK && command->op != CMD_LEAVE &&
+            command->op != CMD_JOIN && command->op != CMD_PART) {
+        return;
+    }
+
+    latency_lock(group->lock);
+    if (!conn->joined) { // Kicked by another reactor, close is on its way
+        pthread_mutex_unlock(group->lock);
+        return;
+    }
+    if (command->op == CMD_KICK) {
+        metric_add(METRIC_KICK, 1); // For server stat
+        metric_bump(&(conn->info->kick)); // For client stat
+        kick_named_client(group->roster, conn->info, command->arg);
+    } else if (command->op == CMD_JOIN) {
+        metric_add(METRIC_JOIN, 1); // For server stat
+        join_room(conn->info, command->arg, command->argLength);
+    } else if (command->op == CMD_PART) {
+        metric_add(METRIC_PART, 1); // For server stat
+        join_room(conn->info, "", 0);
+    } else {
+        metric_add(METRIC_LEAVE, 1); // For server stat
+        leave_chat(group->roster, conn->name);
+    }
+    pthread_mutex_unlock(group->lock);
+}
+
+/**
+ * Applies the SAY: rate limit to a line about to be handled, see
+ * CHAT_SAY_POLICY. Under the pace policy the connection is paused and the
+ * line is left buffered until it may go, nobody else waits.
+ * conn is the connection the line came from
+ * command is the line, parsed before being handed out
+ * Returns 1 if the line is to be handled now, 0 if not
+ */
+static int connection_say_allowed(Connection* conn, Command* command) {
+    if (conn->state != CONN_CHAT || command->op != CMD_SAY) {
+        return 1;
+    }
+    long long wait = connection_say_take(conn);
+    if (wait && conn->reactor->group->config->sayPolicy == SAY_PACE) {
+        connection_pause(conn, wait);
+    }
+    return !wait;
+}
+
+/**
+ * Handles every complete line buffered for a connection, stopping early if
+ * the connection gets paused or closed.
+ * conn is the connection to process
+ * Returns 1 if more input can be read, 0 if not
+ */
+static int connection_process(Connection* conn) {
+    size_t length;
+    char* line;
+    Command command;
+
+    while (conn->state != CONN_CLOSED && !conn->closing && !conn->resumeAt
+            && (line = line_peek(&(conn->in), &length)) != NULL) {
+        // Spans stay valid as line_next only terminates the line in place
+        long long parsing = latency_now();
+        protocol_decode(line, length, conn->binary, &command);
+        latency_record(LAT_PARSE, parsing);
+        int allowed = connection_say_allowed(conn, &command);
+        if (!allowed && conn->resumeAt) { // Paced, handled once resumed
+            break;
+        }
+        line_next(&(conn->in), &length); // Rejected lines are skipped
+        metric_add(METRIC_BYTES_IN, length + 1);
+        if (!allowed) {
+            continue;
+        }
+
+        if (conn->state == CONN_AUTH) {
+            connection_auth(conn, length, &command);
+        } else if (conn->state == CONN_NAME) {
+            connection_name(conn, &command);
+        } else {
+            connection_chat(conn, &command);
+        }
+    }
+    if (conn->state == CONN_CLOSED) {
+        return 0;
+    }
+    if (conn->in.tooLong && !conn->closing) { // See CHAT_MAX_LINE
+        connection_lost(conn);
+        return 0;
+    }
+    return !conn->closing && !conn->resumeAt;
+}
+
+/**
+ * Submits a receive for a connection, into whichever of the reactor's
+ * provided buffers the kernel picks when data arrives. Nothing is submitted
+ * if a receive is already in progress.
+ * conn is the connection to receive from
+ */
+static void connection_receive(Connection* conn) {
+    if (conn->receiving) {
+        return;
+    }
+    conn->receiving = 1;
+    struct io_uring_sqe* sqe = reactor_submit(conn->reactor, OP_RECV, conn);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+}
+
+/**
+ * Reads from a connection until its socket is drained(edge triggered),
+ * handling each line as it comes in. A reactor driven by io_uring handles
+ * the lines already received and submits a receive if more can be taken.
+ * conn is the connection to service
+ */
+static void connection_service(Connection* conn) {
+    if (conn->reactor->ring != NULL) {
+        if (connection_process(conn)) {
+            connection_receive(conn);
+        }
+        return;
+    }
+    while (connection_process(conn)) {
+        ssize_t got = line_fill(&(conn->in), conn->fd);
+        if (got > 0 || (got < 0 && errno == EINTR)) {
+            continue;
+        } else if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else { // Client disconnected
+            connection_lost(conn);
+            return;
+        }
+    }
+}
+
+/**
+ * Handles a completed receive. The data is copied into the connection's
+ * input and its buffer handed straight back to the kernel, then the input
+ * is handled as if epoll had reported it.
+ * conn is the connection received from
+ * event is the completion
+ */
+static void connection_received(Connection* conn, UringEvent* event) {
+    Uring* ring = conn->reactor->ring;
+    conn->receiving = 0;
+    if (event->flags & IORING_CQE_F_BUFFER) {
+        unsigned int id = event->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (event->result > 0 && conn->state != CONN_CLOSED &&
+                !conn->closing) {
+            line_append(&(conn->in), uring_buffer(ring, id), event->result);
+        }
+        uring_buffer_return(ring, id);
+    }
+    int retry = event->result == -ENOBUFS || event->result == -EINTR ||
+            event->result == -EAGAIN;
+    if (conn->state == CONN_CLOSED) {
+        return;
+    }
+    if (conn->closing) { // Only waiting for output to drain
+        if (event->result <= 0 && !retry) {
+            connection_close(conn, 0);
+        }
+        return;
+    }
+    if (event->result > 0 || retry) {
+        connection_service(conn);
+    } else { // Client disconnected
+        connection_lost(conn);
+    }
+}
+
+/**
+ * Handles the events epoll reported for a connection.
+ * conn is the connection
+ * events is the epoll event mask
+ */
+static void connection_event(Connection* conn, unsigned int events) {
+    if (conn->state == CONN_CLOSED) {
+        return;
+    }
+    if (conn->writeOnly) { // Failures show up when flushing
+        if (events & EPOLLOUT) {
+            connection_mark_dirty(conn);
+        }
+        return;
+    }
+    if (conn->closing) { // Only waiting for output to drain
+        if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+            connection_close(conn, 0);
+        } else if (events & EPOLLOUT) {
+            connection_mark_dirty(conn);
+        }
+        return;
+    }
+    if ((events & EPOLLOUT) && conn->out.count) {
+        connection_mark_dirty(conn);
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        connection_service(conn);
+    }
+}
+
+/**
+ * Creates a connection for a socket owned by a reactor.
+ * reactor is the reactor that will own the connection
+ * fd is the client's socket
+ * state is the state the connection starts in
+ * Returns the new connection
+ */
+static Connection* connection_create(Reactor* reactor, int fd, int state) {
+    Config* config = reactor->group->config;
+    Connection* conn = pool_get(&connectionPool);
+    memset(conn, 0, sizeof(Connection));
+    conn->fd = fd;
+    conn->state = state;
+    conn->reactor = reactor;
+    outq_init(&(conn->out), config->outqFrames, config->outqBytes,
+            config->outqPolicy);
+    rate_init(&(conn->sayLimit), config->sayRate, config->sayBurst);
+    line_init(&(conn->in), config->maxLine);
+    return conn;
+}
+
+/**
+ * Starts the protocol with a newly accepted client by sending AUTH:.
+ * conn is the client's connection
+ */
+static void connection_greet(Connection* conn) {
+    socket_nodelay(conn->fd);
+    metric_add(METRIC_ACCEPTED, 1);
+    metric_add(METRIC_CONNECTIONS, 1); // Lowered by connection_destroy
+    connection_send(conn, "AUTH:\n", strlen("AUTH:\n"));
+}
+
+/**
+ * Submits a multishot accept on a reactor's listening socket, one request
+ * completing once per client accepted.
+ * reactor is the reactor
+ */
+static void reactor_submit_accept(Reactor* reactor) {
+    struct io_uring_sqe* sqe = reactor_submit(reactor, OP_ACCEPT, NULL);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = reactor->listenFd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/**
+ * Determines whether an accept failed for want of descriptors or memory,
+ * which only someone leaving or time puts right.
+ * error is the error(errno)
+ * Returns 1 if so, 0 if not
+ */
+static int accept_exhausted(int error) {
+    return error == EMFILE || error == ENFILE || error == ENOBUFS ||
+            error == ENOMEM;
+}
+
+/**
+ * Stops a reactor accepting clients after it ran out of descriptors, until
+ * one of its connections closes or ACCEPT_RETRY_USEC has passed. Under
+ * epoll the listening socket stays readable meanwhile, so watching it would
+ * wake the reactor over and over for nothing, and under io_uring an accept
+ * submitted again would fail straight away over and over.
+ * reactor is the reactor
+ */
+static void reactor_pause_accept(Reactor* reactor) {
+    struct epoll_event event;
+    metric_add(METRIC_ACCEPT_FAILED, 1);
+    reactor->acceptResume = now_usec() + ACCEPT_RETRY_USEC;
+    if (reactor->ring == NULL) {
+        event.events = 0;
+        event.data.ptr = NULL;
+        epoll_ctl(reactor->epollFd, EPOLL_CTL_MOD, reactor->listenFd,
+                &event);
+    }
+}
+
+/**
+ * Starts a reactor accepting clients again once its pause is over, see
+ * reactor_pause_accept. Clients that queued up meanwhile are accepted
+ * straight away, the listening socket being watched level-triggered.
+ * reactor is the reactor
+ */
+static void reactor_resume_accept(Reactor* reactor) {
+    struct epoll_event event;
+    if (!reactor->acceptResume || reactor->acceptResume > now_usec()) {
+        return;
+    }
+    reactor->acceptResume = 0;
+    if (reactor->ring != NULL) {
+        reactor_submit_accept(reactor);
+        return;
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_MOD, reactor->listenFd, &event);
+}
+
+/**
+ * Accepts every client waiting on the listening socket and greets them.
+ * reactor is the reactor to add the clients to
+ */
+static void reactor_accept(Reactor* reactor) {
+    for (;;) {
+        int fd = accept4(reactor->listenFd, NULL, NULL,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            } else if (accept_exhausted(errno)) {
+                reactor_pause_accept(reactor); // Until someone leaves
+            }
+            return;
+        }
+
+        Connection* conn = connection_create(reactor, fd, CONN_AUTH);
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            pool_put(&connectionPool, conn);
+            continue;
+        }
+        connection_greet(conn);
+    }
+}
+
+/**
+ * Handles a client accepted through io_uring, greeting it and submitting
+ * its first receive.
+ * reactor is the reactor that accepted it
+ * event is the completion, its result is the client's socket
+ */
+static void reactor_accepted(Reactor* reactor, UringEvent* event) {
+    int ended = !(event->flags & IORING_CQE_F_MORE);
+    if (ended && event->result < 0 && accept_exhausted(-event->result)) {
+        reactor_pause_accept(reactor); // Until someone leaves
+        return;
+    } else if (ended) { // Accept ended, start again
+        reactor_submit_accept(reactor);
+    }
+    if (event->result < 0) {
+        return;
+    }
+    Connection* conn = connection_create(reactor, event->result, CONN_AUTH);
+    connection_greet(conn);
+    connection_receive(conn);
+}
+
+/**
+ * Resumes every paused connection whose pause has run out.
+ * reactor is the reactor the connections belong to
+ */
+static void reactor_resume(Reactor* reactor) {
+    long long now = now_usec();
+    Connection* due = NULL;
+    Connection* conn, *next;
+
+    // Collect first, servicing one connection may close or pause another
+    for (conn = reactor->paused; conn != NULL; conn = next) {
+        next = conn->nextPaused;
+        if (conn->resumeAt <= now) {
+            connection_unpause(conn);
+            conn->nextPaused = due;
+            due = conn;
+        }
+    }
+    while ((conn = due) != NULL) {
+        due = conn->nextPaused;
+        if (conn->state != CONN_CLOSED) {
+            connection_service(conn);
+        }
+    }
+}
+
+/**
+ * Determines how long a reactor may wait for events before a paused
+ * connection is due, output held back for coalescing must be flushed or
+ * accepting resumes.
+ * reactor is the reactor
+ * Returns the timeout in microseconds, -1 if nothing is waiting
+ */
+static long long reactor_timeout(Reactor* reactor) {
+    long long window = reactor->group->config->flushUsec;
+    long long earliest = reactor->acceptResume ? reactor->acceptResume : -1;
+    Connection* conn;
+    for (conn = reactor->paused; conn != NULL; conn = conn->nextPaused) {
+        if (earliest < 0 || conn->resumeAt < earliest) {
+            earliest = conn->resumeAt;
+        }
+    }
+    // Only held connections are left dirty between loop iterations
+    for (conn = reactor->dirty; conn != NULL; conn = conn->nextDirty) {
+        if (earliest < 0 || conn->lastFlush + window < earliest) {
+            earliest = conn->lastFlush + window;
+        }
+    }
+    if (earliest < 0) {
+        return -1;
+    }
+    long long wait = earliest - now_usec();
+    return wait <= 0 ? 0 : wait;
+}
+
+/**
+ * Waits for events on a reactor's epoll set. epoll_pwait2 is used where the
+ * kernel has it, as a coalescing window is usually well under the
+ * millisecond epoll_wait can time out in.
+ * reactor is the reactor
+ * events is where to put the events, MAX_EVENTS of them
+ * Returns the number of events, negative if interrupted
+ */
+static int reactor_wait(Reactor* reactor, struct epoll_event* events) {
+    long long wait = reactor_timeout(reactor);
+    if (!__atomic_load_n(&noPwait2, __ATOMIC_RELAXED)) {
+        struct timespec timeout = {wait / 1000000, wait % 1000000 * 1000};
+        int count = epoll_pwait2(reactor->epollFd, events, MAX_EVENTS,
+                wait < 0 ? NULL : &timeout, NULL);
+        if (count >= 0 || errno != ENOSYS) {
+            return count;
+        }
+        __atomic_store_n(&noPwait2, 1, __ATOMIC_RELAXED);
+    }
+    return epoll_wait(reactor->epollFd, events, MAX_EVENTS,
+            wait < 0 ? -1 : (int)((wait + 999) / 1000));
+}
+
+/**
+ * Determines whether a connection's output should be held back to be sent
+ * along with whatever follows it(see CHAT_FLUSH_USEC). Output is only held
+ * while the connection was flushed less than the window ago, so a lone
+ * message after a quiet spell goes out straight away and a burst costs one
+ * write per window.
+ * conn is the connection with output waiting
+ * now is the current time(microsecond)
+ * window is the coalescing window(microsecond), 0 if off
+ * Returns non-zero if the output should be held
+ */
+static int connection_hold(Connection* conn, long long now,
+        long long window) {
+    return window && now - conn->lastFlush < window && !conn->closing &&
+            !conn->overflowed && conn->out.count < IOV_BATCH &&
+            conn->out.bytes < HOLD_BYTES;
+}
+
+/**
+ * Flushes the output of every connection that has some queued, except
+ * output held back to be coalesced, which stays queued for a later loop
+ * iteration.
+ * reactor is the reactor the connections belong to
+ */
+static void reactor_flush(Reactor* reactor) {
+    long long window = reactor->group->config->flushUsec;
+    long long now = window ? now_usec() : 0;
+    Connection* conn, *held = NULL;
+    // Flushing can lose a client, which queues more output on others
+    while ((conn = reactor->dirty) != NULL) {
+        reactor->dirty = conn->nextDirty;
+        if (conn->state != CONN_CLOSED && connection_hold(conn, now,
+                window)) {
+            conn->nextDirty = held;
+            held = conn;
+            continue;
+        }
+        conn->dirty = 0;
+        if (conn->state != CONN_CLOSED) {
+            conn->lastFlush = now;
+            connection_flush(conn);
+        }
+    }
+    reactor->dirty = held;
+}
+
+/**
+ * Frees the connections closed so far. A connection that mail still refers
+ * to is kept until that mail has been handled.
+ * reactor is the reactor the connections belonged to
+ */
+static void reactor_reap(Reactor* reactor) {
+    Connection* conn, *kept = NULL;
+    while ((conn = reactor->closed) != NULL) {
+        reactor->closed = conn->nextClosed;
+        if (__atomic_load_n(&(conn->refs), __ATOMIC_ACQUIRE)) {
+            conn->nextClosed = kept;
+            kept = conn;
+            continue;
+        }
+        free(conn->name);
+        free(conn->convertName);
+        free(conn->sendMessage);
+        if (conn->info != NULL) { // Snapshot readers may still see it
+            epoch_retire(conn->info, free_client_info);
+        }
+        line_free(&(conn->in));
+        unsigned int frames = conn->out.count;
+        size_t bytes = conn->out.bytes;
+        outq_clear(&(conn->out));
+        connection_queue_moved(conn, frames, bytes);
+        pool_put(&connectionPool, conn);
+    }
+    reactor->closed = kept;
+}
+
+/**
+ * Queues a frame to every connection in a room owned by a reactor. Every
+ * queue shares the one frame.
+ * reactor is the calling reactor
+ * room is the room
+ * frame is the frame to send
+ */
+static void reactor_fan_out(Reactor* reactor, Room* room, OutFrame* frame) {
+    for (Connection* conn = room->members[reactor->id]; conn != NULL;
+            conn = conn->nextMember) {
+        if (!conn->closing) {
+            connection_append(conn, frame);
+        }
+    }
+}
+
+/**
+ * Sends a frame to every client in a room, across all reactors. Clients of
+ * the calling reactor get it queued straight away, every other reactor
+ * owning members of the room is mailed a reference which it fans out to its
+ * own members. The frame is never copied, and reactors with nobody in the
+ * room aren't woken, so the cost follows the room's size rather than the
+ * chat's.
+ * room is the room, held by the caller(or by a member it belongs to)
+ * frame is the frame to send, the caller keeps its reference
+ */
+void reactor_broadcast(Room* room, OutFrame* frame) {
+    ReactorGroup* group = activeGroup;
+    for (int i = 0; i < group->count; i++) {
+        Reactor* reactor = group->reactors[i];
+        if (!__atomic_load_n(&(room->counts[i]), __ATOMIC_RELAXED)) {
+            continue; // Nobody in the room there
+        } else if (reactor == currentReactor) {
+            reactor_fan_out(reactor, room, frame);
+        } else {
+            Mail* mail = mail_create(MAIL_BROADCAST, NULL, frame);
+            room_hold(room);
+            mail->room = room;
+            reactor_post(reactor, mail);
+        }
+    }
+}
+
+/**
+ * Hands the writing side of a thread per client connection to the writer
+ * reactor. The calling thread keeps reading the socket and holds a
+ * reference on the connection until it calls connection_release.
+ * Called with the roster lock held, once the client is in the roster.
+ * fd is a socket descriptor the writer may close when it is done
+ * info is the client's roster entry, freed along with the connection
+ * binary is whether the client asked for binary frames
+ * Returns the connection to send to the client through
+ */
+Connection* reactor_adopt(int fd, ClientInfo* info, int binary) {
+    Reactor* writer = activeGroup->reactors[0];
+    Connection* conn = connection_create(writer, fd, CONN_CHAT);
+    conn->writeOnly = 1;
+    conn->binary = binary;
+    conn->joined = 1;
+    conn->refs = 1;
+    conn->name = strdup(info->name);
+    conn->info = info;
+    reactor_post(writer, mail_create(MAIL_ADOPT, conn, NULL));
+    return conn;
+}
+
+/**
+ * Starts serving an adopted connection: it is watched for writability, and
+ * receives broadcasts once moved into its room. Socket stays blocking as
+ * the client's thread reads it, writes use MSG_DONTWAIT instead.
+ * conn is the adopted connection
+ */
+static void connection_adopted(Connection* conn) {
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLET;
+    event.data.ptr = conn;
+    epoll_ctl(conn->reactor->epollFd, EPOLL_CTL_ADD, conn->fd, &event);
+}
+
+/**
+ * Handles every piece of mail waiting in a reactor's inbox.
+ * reactor is the calling reactor
+ */
+static void reactor_deliver(Reactor* reactor) {
+    uint64_t wakes;
+    while (read(reactor->wakeFd, &wakes, sizeof(wakes)) < 0 &&
+            errno == EINTR) {
+    }
+    // Cleared before draining so mail pushed from here on wakes us again
+    __atomic_store_n(&(reactor->wakePending), 0, __ATOMIC_SEQ_CST);
+
+    MpscNode* node;
+    while ((node = mpsc_pop(&(reactor->inbox))) != NULL) {
+        Mail* mail = (Mail*)node;
+        if (mail->type == MAIL_BROADCAST) {
+            reactor_fan_out(reactor, mail->room, mail->frame);
+        } else if (mail->type == MAIL_SEND) {
+            connection_append(mail->conn, mail->frame);
+        } else if (mail->type == MAIL_CLOSE) {
+            connection_close(mail->conn, mail->flush);
+        } else if (mail->type == MAIL_ADOPT) {
+            connection_adopted(mail->conn);
+        } else if (mail->type == MAIL_MOVE) {
+            connection_link(mail->conn, mail->room);
+        } else if (mail->type == MAIL_BATCH) {
+            connection_send_batch(mail->conn, mail->batch, mail->batchCount);
+        }
+        if (mail->conn != NULL) {
+            __atomic_sub_fetch(&(mail->conn->refs), 1, __ATOMIC_RELEASE);
+        }
+        if (mail->frame != NULL) {
+            frame_release(mail->frame);
+        }
+        if (mail->room != NULL) {
+            room_release(mail->room);
+        }
+        pool_put(&mailPool, mail);
+    }
+}
+
+/**
+ * Submits a multishot poll of a reactor's eventfd, completing whenever mail
+ * arrives.
+ * reactor is the reactor
+ */
+static void reactor_submit_wake(Reactor* reactor) {
+    struct io_uring_sqe* sqe = reactor_submit(reactor, OP_WAKE, NULL);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = reactor->wakeFd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+/**
+ * Waits for io_uring completions and handles each, submitting everything
+ * queued since the last wait on the way in.
+ * reactor is the calling reactor
+ * Exit with 2 if the ring fails
+ */
+static void reactor_complete(Reactor* reactor) {
+    UringEvent event;
+    if (uring_wait(reactor->ring, reactor_timeout(reactor)) < 0) {
+        fprintf(stderr, "Communications error\n");
+        exit(COM_ERROR);
+    }
+    while (uring_next(reactor->ring, &event)) {
+        int op = event.data & OP_MASK;
+        Connection* conn = (Connection*)(uintptr_t)(event.data &
+                ~(unsigned long long)OP_MASK);
+        if (conn != NULL) { // Request is done with it
+            __atomic_sub_fetch(&(conn->refs), 1, __ATOMIC_RELEASE);
+        }
+        if (op == OP_ACCEPT) {
+            reactor_accepted(reactor, &event);
+        } else if (op == OP_WAKE) {
+            if (!(event.flags & IORING_CQE_F_MORE)) {
+                reactor_submit_wake(reactor);
+            }
+            reactor_deliver(reactor);
+        } else if (op == OP_RECV) {
+            connection_received(conn, &event);
+        } else {
+            connection_sent(conn, event.result);
+        }
+    }
+}
+
+/**
+ * Raises the open file limit as far as allowed, every client is a socket.
+ */
+static void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/**
+ * Creates a reactor with its own epoll set, listening socket and inbox.
+ * group is the group the reactor belongs to
+ * id is the reactor's index in the group
+ * listenFd is the reactor's listening socket
+ * Returns the new reactor
+ * Exit with 2 if the reactor cannot be set up
+ */
+static Reactor* reactor_create(ReactorGroup* group, int id, int listenFd) {
+    Reactor* reactor = calloc(1, sizeof(Reactor));
+    reactor->id = id;
+    reactor->group = group;
+    reactor->listenFd = listenFd;
+    mpsc_init(&(reactor->inbox));
+
+    struct epoll_event listenEvent, wakeEvent;
+    listenEvent.events = EPOLLIN;
+    listenEvent.data.ptr = NULL; // NULL marks the listening socket
+    wakeEvent.events = EPOLLIN;
+    wakeEvent.data.ptr = reactor; // The reactor itself marks its inbox
+    reactor->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (group->config->ioMode == IO_URING) { // Falls back to epoll if NULL
+        reactor->ring = uring_create();
+    }
+    if (reactor->ring != NULL) {
+        if (reactor->wakeFd < 0) {
+            fprintf(stderr, "Communications error\n");
+            exit(COM_ERROR);
+        }
+        reactor->epollFd = -1;
+        reactor_submit_wake(reactor);
+        if (listenFd >= 0) {
+            reactor_submit_accept(reactor);
+        }
+        return reactor;
+    }
+
+    reactor->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epollFd < 0 || reactor->wakeFd < 0 ||
+            epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->wakeFd,
+            &wakeEvent) < 0) {
+        fprintf(stderr, "Communications error\n");
+        exit(COM_ERROR);
+    }
+    if (listenFd >= 0) {
+        fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+        if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, listenFd,
+                &listenEvent) < 0) {
+            fprintf(stderr, "Communications error\n");
+            exit(COM_ERROR);
+        }
+    }
+    return reactor;
+}
+
+/**
+ * Runs one reactor's event loop forever.
+ * arg is the reactor to run
+ */
+static void* reactor_loop(void* arg) {
+    Reactor* reactor = (Reactor*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    currentReactor = reactor;
+    pool_thread_cache(); // Takes the pools' locks once per batch
+
+    for (;;) {
+        int count = 0;
+        if (reactor->ring != NULL) {
+            reactor_complete(reactor);
+        } else {
+            count = reactor_wait(reactor, events);
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                reactor_accept(reactor);
+            } else if (events[i].data.ptr == reactor) {
+                reactor_deliver(reactor);
+            } else {
+                connection_event(events[i].data.ptr, events[i].events);
+            }
+        }
+        reactor_resume(reactor);
+        reactor_resume_accept(reactor);
+        reactor_flush(reactor);
+        reactor_reap(reactor);
+    }
+    return NULL;
+}
+
+/**
+ * Creates the state shared by a group of reactors, the reactors themselves
+ * are added by the caller.
+ * count is the number of reactors
+ * config is the server's configuration
+ * roster is the clients in the chat
+ * lock is the roster lock
+ * Returns the new group
+ */
+static ReactorGroup* group_create(int count, Config* config,
+        Roster* roster, pthread_mutex_t* lock) {
+    ReactorGroup* group = calloc(1, sizeof(ReactorGroup));
+    group->count = count;
+    group->reactors = calloc(count, sizeof(Reactor*));
+    group->config = config;
+    group->roster = roster;
+    group->lock = lock;
+    rate_init(&(group->sayLimit), config->sayGlobalRate,
+            config->sayGlobalBurst);
+    room_setup(count, config->history, config->historyReplay, lock);
+    return group;
+}
+
+/**
+ * Starts the writer used when running a thread per client. Client threads
+ * keep reading their sockets and running the protocol, but once a client is
+ * in the chat everything sent to it goes through its outbound queue on the
+ * writer's thread, so a client that stops reading never blocks anyone else.
+ * config is the server's configuration(queue limits)
+ * roster is the clients in the chat
+ * lock is the roster lock
+ * Exit with 2 if the writer cannot be set up
+ */
+void reactor_start_writer(Config* config, Roster* roster,
+        pthread_mutex_t* lock) {
+    ReactorGroup* group = group_create(1, config, roster, lock);
+    group->reactors[0] = reactor_create(group, 0, -1);
+    activeGroup = group;
+    pthread_create(&(group->reactors[0]->thread), NULL, reactor_loop,
+            group->reactors[0]);
+}
+
+/**
+ * Runs the server as epoll event loops instead of a thread per client, one
+ * reactor per thread. Each reactor has its own SO_REUSEPORT listening socket
+ * on the same port, so the kernel spreads new clients across them, and owns
+ * the clients it accepts. Every client is a non-blocking socket driven
+ * through the same protocol as client_handler(authentication, name
+ * negotiation then chat commands) by a per-connection state machine.
+ * Broadcasts reach other reactors' clients through their inboxes, only
+ * roster changes take the roster lock.
+ * listenFd is the listening socket, used by the first reactor
+ * config is the server's configuration(number of reactors, queue limits)
+ * serverAuth is the authentication code of server
+ * roster is the clients in the chat
+ * lock is the roster lock
+ * Exit with 2 if the reactors cannot be set up
+ */
+void reactor_run(int listenFd, Config* config, char* serverAuth,
+        Roster* roster, pthread_mutex_t* lock) {
+    ReactorGroup* group = group_create(config->reactors, config, roster,
+            lock);
+    group->serverAuth = serverAuth;
+    raise_fd_limit();
+
+    char port[sizeof("65535")];
+    snprintf(port, sizeof(port), "%u", listen_port(listenFd));
+    for (int i = 0; i < group->count; i++) {
+        group->reactors[i] = reactor_create(group, i,
+                i ? client_listen(port, 1) : listenFd);
+    }
+    activeGroup = group;
+
+    for (int i = 1; i < group->count; i++) {
+        pthread_create(&(group->reactors[i]->thread), NULL, reactor_loop,
+                group->reactors[i]);
+    }
+    reactor_loop(group->reactors[0]);
+}
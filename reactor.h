@@ -0,0 +1,126 @@
+#ifndef _REACTOR_H
+#define _REACTOR_H
+#include <stddef.h>
+#include <pthread.h>
+#include "commonfunction.h"
+#include "config.h"
+#include "linereader.h"
+#include "mpsc.h"
+#include "outqueue.h"
+#include "ratelimit.h"
+#include "room.h"
+#include "roster.h"
+
+/* States of a connection's protocol state machine */
+#define CONN_AUTH 1
+#define CONN_NAME 2
+#define CONN_CHAT 3
+#define CONN_CLOSED 4
+
+/* Kinds of mail reactors send each other */
+#define MAIL_BROADCAST 1
+#define MAIL_SEND 2
+#define MAIL_CLOSE 3
+#define MAIL_ADOPT 4
+#define MAIL_MOVE 5
+#define MAIL_BATCH 6
+
+typedef struct Connection {
+    int fd;
+    int state;
+    int closing; // No more input is handled, close once output is sent
+    int dirty; // Has output waiting to be flushed this loop iteration
+    int overflowed; // Outbound queue was full under OUTQ_DISCONNECT
+    int writeOnly; // Adopted from a client thread, which does the reading
+    int joined; // In the roster, only changed with the roster lock held
+    int binary; // Sent binary frames rather than lines, see CMD_BIN
+    int refs; // Mail and io_uring requests using it, keeps it allocated
+    long long resumeAt; // Paced until this time(microsecond), 0 if not
+    long long lastFlush; // When output was last flushed(microsecond)
+    int receiving; // io_uring receive submitted and not completed yet
+    int sending; // io_uring send submitted and not completed yet
+    long long sendStart; // When that send was submitted(see latency_now)
+    struct msghdr* sendMessage; // Its message, IOV_BATCH iovecs follow it
+    char* name;
+    char* convertName;
+    ClientInfo* info; // Roster entry, freed along with the connection
+    LineReader in;
+    OutQueue out;
+    RateLimit sayLimit; // Only touched by the thread reading the client
+    struct Reactor* reactor;
+    Room* room; // Room whose member list it is on, NULL if none
+    struct Connection* nextMember;
+    struct Connection* prevMember;
+    struct Connection* nextDirty;
+    struct Connection* nextPaused;
+    struct Connection* prevPaused;
+    struct Connection* nextClosed;
+} Connection;
+
+/* Work handed to a reactor by another thread */
+typedef struct Mail {
+    MpscNode node;
+    int type;
+    int flush; // MAIL_CLOSE only
+    Connection* conn; // Every type but MAIL_BROADCAST
+    OutFrame* frame; // MAIL_BROADCAST and MAIL_SEND, mail holds a reference
+    Room* room; // MAIL_BROADCAST and MAIL_MOVE, mail holds it if set
+    OutFrame** batch; // MAIL_BATCH, mail holds the frames and the array
+    size_t batchCount;
+} Mail;
+
+typedef struct Reactor {
+    int id;
+    int epollFd; // -1 when driven by io_uring
+    struct Uring* ring; // NULL when driven by epoll
+    int listenFd; // -1 for a writer with no clients of its own to accept
+    int wakeFd; // eventfd poked when mail arrives
+    int wakePending;
+    long long acceptResume; // When accepting resumes, 0 while accepting
+    MpscQueue inbox;
+    pthread_t thread;
+    struct ReactorGroup* group;
+    Connection* dirty;
+    Connection* paused;
+    Connection* closed;
+} Reactor;
+
+/* State shared by every reactor */
+typedef struct ReactorGroup {
+    int count;
+    Reactor** reactors;
+    Config* config;
+    char* serverAuth;
+    Roster* roster;
+    pthread_mutex_t* lock; // Roster lock
+    RateLimit sayLimit; // Server wide SAY: limit, shared by every client
+} ReactorGroup;
+
+void connection_send(Connection* conn, const char* data, size_t length);
+
+void connection_send_frame(Connection* conn, OutFrame* frame);
+
+void connection_send_batch(Connection* conn, OutFrame** frames,
+        size_t count);
+
+void connection_close(Connection* conn, int flush);
+
+void connection_detach(Connection* conn);
+
+void connection_release(Connection* conn);
+
+void connection_move(Connection* conn, Room* from, Room* to);
+
+int connection_say_wait(Connection* conn);
+
+Connection* reactor_adopt(int fd, ClientInfo* info, int binary);
+
+void reactor_broadcast(Room* room, OutFrame* frame);
+
+void reactor_start_writer(Config* config, Roster* roster,
+        pthread_mutex_t* lock);
+
+void reactor_run(int listenFd, Config* config, char* serverAuth,
+        Roster* roster, pthread_mutex_t* lock);
+
+#endif
@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "epoch.h"
+#include "metrics.h"
+#include "outqueue.h"
+#include "pool.h"
+#include "roster.h"
+#include "room.h"
+
+/* Buckets the room table starts with, doubled whenever it fills up */
+#define ROOM_BUCKETS 64
+
+/* Rooms by name, chained through Room.next. Only used with the roster lock
+ * held. */
+static Room** table = NULL;
+static size_t tableSize = 0; // Number of buckets, a power of two
+static size_t tableCount = 0; // Rooms in the table
+
+/* Room every client starts in, never dropped */
+static Room* lobby = NULL;
+
+/* Number of reactors, each keeps its own member list of every room */
+static int reactorCount = 0;
+
+/* Roster lock, also guards every room */
+static pthread_mutex_t* rosterLock = NULL;
+
+/* MSG: frames each room keeps, and how many of them a client entering the
+ * room is sent, see CHAT_HISTORY */
+static size_t historySize = 0;
+static size_t replaySize = 0;
+
+/* Entries of the rooms' rosters, one per client in a room */
+static Pool entryPool = POOL_INIT(sizeof(ClientInfo));
+
+/**
+ * Creates a room with no members, held once by the caller.
+ * name is the room's name(copied)
+ * hash is the hash of the name
+ * Returns the new room
+ */
+static Room* room_create(const char* name, unsigned long long hash) {
+    Room* room = malloc(sizeof(Room));
+    room->name = strdup(name);
+    room->hash = hash;
+    roster_init(&(room->roster), rosterLock);
+    room->refs = 1;
+    room->counts = calloc(reactorCount, sizeof(int));
+    room->members = calloc(reactorCount, sizeof(struct Connection*));
+    pthread_mutex_init(&(room->historyLock), NULL);
+    room->history = NULL;
+    room->historyNext = 0;
+    room->next = NULL;
+    metric_add(METRIC_ROOMS, 1);
+    return room;
+}
+
+/**
+ * Frees a room nobody holds any more. Rooms are retired through
+ * epoch_retire as threads sending to a client's room may still be looking
+ * at it.
+ * room is the room to free
+ */
+static void room_free(void* room) {
+    Room* old = room;
+    if (old->history != NULL) {
+        for (size_t i = 0; i < historySize && i < old->historyNext; i++) {
+            frame_release(old->history[i]);
+        }
+        free(old->history);
+    }
+    pthread_mutex_destroy(&(old->historyLock));
+    roster_free(&(old->roster));
+    free(old->counts);
+    free(old->members);
+    free(old->name);
+    free(old);
+}
+
+/**
+ * Frees an entry of a room's roster, see free_client_info.
+ * entry is the entry to free
+ */
+static void room_entry_free(void* entry) {
+    free(((ClientInfo*)entry)->name);
+    pool_put(&entryPool, entry);
+}
+
+/**
+ * Doubles the number of buckets of the room table.
+ */
+static void room_grow(void) {
+    size_t size = tableSize * 2;
+    Room** buckets = calloc(size, sizeof(Room*));
+    for (size_t i = 0; i < tableSize; i++) {
+        Room* room = table[i];
+        while (room != NULL) {
+            Room* next = room->next;
+            room->next = buckets[room->hash & (size - 1)];
+            buckets[room->hash & (size - 1)] = room;
+            room = next;
+        }
+    }
+    free(table);
+    table = buckets;
+    tableSize = size;
+}
+
+/**
+ * Sets up the room table with the lobby in it, before any client joins.
+ * reactors is the number of reactors clients are spread across
+ * history is the number of MSG: frames each room keeps, 0 for none
+ * replay is how many of them a client entering a room is sent
+ * lock is the roster lock
+ */
+void room_setup(int reactors, size_t history, size_t replay,
+        pthread_mutex_t* lock) {
+    reactorCount = reactors;
+    historySize = history;
+    replaySize = replay;
+    rosterLock = lock;
+    tableSize = ROOM_BUCKETS;
+    table = calloc(tableSize, sizeof(Room*));
+    lobby = room_create("", roster_hash(""));
+}
+
+/**
+ * Determines how many MSG: frames each room keeps.
+ * Returns the number of frames, 0 if rooms keep no history
+ */
+size_t room_history_size(void) {
+    return historySize;
+}
+
+/**
+ * Determines how many of its kept MSG: frames a client entering a room is
+ * sent.
+ * Returns the number of frames
+ */
+size_t room_replay_size(void) {
+    return replaySize;
+}
+
+/**
+ * Determines the lobby, the room clients are in until they JOIN: another.
+ * It is never in the room table, so no JOIN: can name it.
+ * Returns the lobby
+ */
+Room* room_lobby(void) {
+    return lobby;
+}
+
+/**
+ * Finds a room by name, making it if nobody is in it yet.
+ * (Note: called with the roster lock held)
+ * name is the room's name, not empty
+ * Returns the room, held by the table for as long as it has members
+ */
+Room* room_open(const char* name) {
+    unsigned long long hash = roster_hash(name);
+    for (Room* room = table[hash & (tableSize - 1)]; room != NULL;
+            room = room->next) {
+        if (room->hash == hash && !strcmp(room->name, name)) {
+            return room;
+        }
+    }
+    if (tableCount + 1 > tableSize) { // Chains kept about one long
+        room_grow();
+    }
+    Room* room = room_create(name, hash);
+    room->next = table[hash & (tableSize - 1)];
+    table[hash & (tableSize - 1)] = room;
+    tableCount++;
+    return room;
+}
+
+/**
+ * Takes a room out of the room table, a JOIN: naming it from now on makes
+ * a new one.
+ * (Note: called with the roster lock held)
+ * room is the room, in the table
+ */
+static void room_close(Room* room) {
+    Room** link = &(table[room->hash & (tableSize - 1)]);
+    while (*link != room) {
+        link = &((*link)->next);
+    }
+    *link = room->next;
+    tableCount--;
+}
+
+/**
+ * Puts a client in a room's roster. The client's connection is moved
+ * separately, see connection_move.
+ * (Note: called with the roster lock held)
+ * room is the room
+ * client is the client, not in any room
+ */
+void room_add(Room* room, ClientInfo* client) {
+    ClientInfo* entry = pool_get(&entryPool);
+    memset(entry, 0, sizeof(ClientInfo));
+    entry->name = strdup(client->name);
+    entry->contact = client->contact;
+    entry->conn = client->conn;
+    roster_insert(&(room->roster), entry);
+    client->roomEntry = entry;
+    __atomic_store_n(&(client->room), room, __ATOMIC_RELEASE);
+}
+
+/**
+ * Takes a client out of its room's roster, dropping the room if that was
+ * its last member.
+ * (Note: called with the roster lock held)
+ * client is the client, in a room
+ */
+void room_drop(ClientInfo* client) {
+    Room* room = client->room;
+    roster_remove(&(room->roster), client->roomEntry);
+    epoch_retire(client->roomEntry, room_entry_free); // Snapshots see it
+    client->roomEntry = NULL;
+    __atomic_store_n(&(client->room), NULL, __ATOMIC_RELEASE);
+    if (room->roster.count == 0 && room != lobby) {
+        room_close(room);
+        room_release(room); // The table's hold
+    }
+}
+
+/**
+ * Adds a MSG: frame to a room's history, numbered with the room's next
+ * sequence number. The oldest frame makes way once the history is full, so
+ * a room's history never holds more than CHAT_HISTORY frames. Safe to call
+ * from any thread.
+ * room is the room, held by the caller
+ * frame is the frame, the history takes over the caller's reference
+ * (Note: only called if rooms keep history, see room_history_size)
+ */
+void room_keep(Room* room, OutFrame* frame) {
+    OutFrame* old = NULL;
+    pthread_mutex_lock(&(room->historyLock));
+    if (room->history == NULL) {
+        room->history = malloc(historySize * sizeof(OutFrame*));
+    }
+    OutFrame** slot = &(room->history[room->historyNext % historySize]);
+    if (room->historyNext >= historySize) {
+        old = *slot;
+    }
+    *slot = frame;
+    room->historyNext++;
+    pthread_mutex_unlock(&(room->historyLock));
+    if (old != NULL) { // Queues it is still in keep their own references
+        frame_release(old);
+    }
+}
+
+/**
+ * Takes the frames of a room's history from a sequence number on, oldest
+ * first. Frames said before that or no longer kept are left out. Safe to
+ * call from any thread.
+ * room is the room, held by the caller
+ * since is the sequence number of the first frame wanted
+ * most is the most frames wanted, the latest are taken
+ * count is set to the number of frames taken
+ * next is set to the sequence number the room's next MSG: gets
+ * Returns the frames(to be freed), each held for the caller
+ */
+OutFrame** room_history(Room* room, unsigned long long since, size_t most,
+        size_t* count, unsigned long long* next) {
+    pthread_mutex_lock(&(room->historyLock));
+    unsigned long long last = room->historyNext;
+    unsigned long long first = last > historySize ? last - historySize : 0;
+    if (since > first) {
+        first = since < last ? since : last;
+    }
+    if (last - first > most) {
+        first = last - most;
+    }
+    OutFrame** frames = malloc((last - first) * sizeof(OutFrame*));
+    for (unsigned long long seq = first; seq < last; seq++) {
+        frames[seq - first] = room->history[seq % historySize];
+        frame_hold(frames[seq - first]);
+    }
+    pthread_mutex_unlock(&(room->historyLock));
+    *count = last - first;
+    *next = last;
+    return frames;
+}
+
+/**
+ * Holds a room so it stays allocated, until the matching room_release. Safe
+ * to call from any thread.
+ * room is the room, already held by the caller or the table
+ */
+void room_hold(Room* room) {
+    __atomic_add_fetch(&(room->refs), 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Lets go of a room, it is freed once nothing holds it and no reader can
+ * still see it. Safe to call from any thread.
+ * room is the room
+ */
+void room_release(Room* room) {
+    if (__atomic_sub_fetch(&(room->refs), 1, __ATOMIC_ACQ_REL) == 0) {
+        metric_add(METRIC_ROOMS, -1);
+        epoch_retire(room, room_free);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef _ROOM_H
+#define _ROOM_H
+#include <stddef.h>
+#include <pthread.h>
+#include "commonfunction.h"
+#include "roster.h"
+
+/* A room clients chat in. Every client in the chat is in exactly one, the
+ * lobby(named "") until it sends JOIN:, and MSG:, ENTER:, LEAVE: and LIST:
+ * only cover the room's own members. A room is made by the first JOIN:
+ * naming it and dropped once its last member leaves, the lobby is kept.
+ * Changed with the roster lock held, except the member lists, which each
+ * reactor keeps for its own connections(see connection_move).
+ */
+typedef struct Room {
+    char* name;
+    unsigned long long hash; // Of the name
+    Roster roster; // Members by name, entries mirror the chat roster's
+    int refs; // Room table, member lists and mail, see room_release
+    int* counts; // Members whose connection each reactor owns
+    struct Connection** members; // Each reactor's list of those connections
+    pthread_mutex_t historyLock; // Guards the history, SAY: takes no other
+    OutFrame** history; // Ring of the last MSG: frames, NULL until the first
+    unsigned long long historyNext; // Sequence number of the next MSG:
+    struct Room* next; // Next room in the same bucket of the room table
+} Room;
+
+void room_setup(int reactors, size_t history, size_t replay,
+        pthread_mutex_t* lock);
+
+size_t room_history_size(void);
+
+size_t room_replay_size(void);
+
+Room* room_lobby(void);
+
+Room* room_open(const char* name);
+
+void room_add(Room* room, ClientInfo* client);
+
+void room_drop(ClientInfo* client);
+
+void room_keep(Room* room, OutFrame* frame);
+
+OutFrame** room_history(Room* room, unsigned long long since, size_t most,
+        size_t* count, unsigned long long* next);
+
+void room_hold(Room* room);
+
+void room_release(Room* room);
+
+#endif
@@ -0,0 +1,382 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "epoch.h"
+#include "outqueue.h"
+#include "roster.h"
+
+/* Slots a roster's hash table starts with */
+#define ROSTER_START 64
+
+/* Marks a slot whose client was removed, probing carries on past it */
+static ClientInfo tombstone;
+#define TOMBSTONE (&tombstone)
+
+/**
+ * Hashes a name(64 bit FNV-1a).
+ * name is the name to hash
+ * Returns the hash
+ */
+unsigned long long roster_hash(const char* name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char* c = (const unsigned char*)name; *c; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Allocates a snapshot, for the caller to fill in before publishing it.
+ * count is the number of clients it holds
+ * length is the length of its LIST: reply in bytes
+ * Returns the snapshot
+ */
+static RosterSnapshot* snapshot_create(size_t count, size_t length) {
+    RosterSnapshot* snapshot = malloc(sizeof(RosterSnapshot) +
+            count * (sizeof(ClientInfo*) + sizeof(size_t)));
+    snapshot->count = count;
+    snapshot->offsets = (size_t*)(snapshot->clients + count);
+    snapshot->listFrame = frame_alloc(length);
+    snapshot->listFrame->length = length;
+    return snapshot;
+}
+
+/**
+ * Frees a snapshot. Requesters still sending its LIST: reply keep their own
+ * references to the frame.
+ * snapshot is the snapshot
+ */
+static void snapshot_free(void* snapshot) {
+    frame_release(((RosterSnapshot*)snapshot)->listFrame);
+    free(snapshot);
+}
+
+/**
+ * Finds where a name is, or belongs, among a snapshot's clients.
+ * snapshot is the snapshot
+ * name is the name
+ * Returns the index of the first client whose name isn't before it
+ */
+static size_t snapshot_search(RosterSnapshot* snapshot, const char* name) {
+    size_t low = 0, high = snapshot->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (strcmp(snapshot->clients[middle]->name, name) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Makes the snapshot following one with a client added. Only copies what
+ * the old one holds around the new name, the roster itself isn't walked.
+ * old is the current snapshot
+ * client is the client added
+ * Returns the new snapshot
+ */
+static RosterSnapshot* snapshot_with(RosterSnapshot* old,
+        ClientInfo* client) {
+    size_t at = snapshot_search(old, client->name);
+    size_t nameLength = strlen(client->name);
+    size_t added = nameLength + (old->count ? 1 : 0); // Name and a comma
+    RosterSnapshot* snapshot = snapshot_create(old->count + 1,
+            old->listFrame->length + added);
+
+    // Before the first name after it, or before the newline if last
+    size_t byte = at < old->count ? old->offsets[at] :
+            old->listFrame->length - 1;
+    char* data = snapshot->listFrame->data;
+    memcpy(data, old->listFrame->data, byte);
+    memcpy(data + added + byte, old->listFrame->data + byte,
+            old->listFrame->length - byte);
+    size_t start = at < old->count || !old->count ? byte : byte + 1;
+    memcpy(data + start, client->name, nameLength);
+    if (old->count) { // After the name, or before it if it is last
+        data[at < old->count ? byte + nameLength : byte] = ',';
+    }
+
+    memcpy(snapshot->clients, old->clients, at * sizeof(ClientInfo*));
+    memcpy(snapshot->offsets, old->offsets, at * sizeof(size_t));
+    snapshot->clients[at] = client;
+    snapshot->offsets[at] = start;
+    for (size_t i = at; i < old->count; i++) {
+        snapshot->clients[i + 1] = old->clients[i];
+        snapshot->offsets[i + 1] = old->offsets[i] + added;
+    }
+    return snapshot;
+}
+
+/**
+ * Makes the snapshot following one with a client taken out. Only copies
+ * what the old one holds around the name, the roster itself isn't walked.
+ * old is the current snapshot
+ * client is the client taken out, it is in the old snapshot
+ * Returns the new snapshot
+ */
+static RosterSnapshot* snapshot_without(RosterSnapshot* old,
+        ClientInfo* client) {
+    size_t at = snapshot_search(old, client->name);
+    size_t length = old->listFrame->length;
+    // The name and the comma after it, or before it if it is the last
+    size_t from = old->offsets[at], to = length - 1;
+    if (at + 1 < old->count) {
+        to = old->offsets[at + 1];
+    } else if (at) {
+        from--;
+    }
+    size_t removed = to - from;
+    RosterSnapshot* snapshot = snapshot_create(old->count - 1,
+            length - removed);
+
+    char* data = snapshot->listFrame->data;
+    memcpy(data, old->listFrame->data, from);
+    memcpy(data + from, old->listFrame->data + to, length - to);
+    memcpy(snapshot->clients, old->clients, at * sizeof(ClientInfo*));
+    memcpy(snapshot->offsets, old->offsets, at * sizeof(size_t));
+    for (size_t i = at + 1; i < old->count; i++) {
+        snapshot->clients[i - 1] = old->clients[i];
+        snapshot->offsets[i - 1] = old->offsets[i] - removed;
+    }
+    return snapshot;
+}
+
+/**
+ * Publishes the snapshot of the roster as it now is, readers see either it
+ * or the one before. The one before is freed once no reader can still be
+ * using it.
+ * (Note: called with the roster lock held)
+ * roster is the roster
+ * snapshot is the new snapshot
+ */
+static void roster_publish(Roster* roster, RosterSnapshot* snapshot) {
+    RosterSnapshot* old = __atomic_exchange_n(&(roster->snapshot), snapshot,
+            __ATOMIC_ACQ_REL);
+    epoch_retire(old, snapshot_free);
+}
+
+/**
+ * Sets up an empty roster.
+ * roster is the roster to set up
+ * lock is the lock writers hold
+ */
+void roster_init(Roster* roster, pthread_mutex_t* lock) {
+    memset(roster, 0, sizeof(Roster));
+    roster->lock = lock;
+    roster->size = ROSTER_START;
+    roster->slots = calloc(roster->size, sizeof(ClientInfo*));
+    roster->levels = 1;
+    roster->seed = 1;
+    roster->snapshot = snapshot_create(0, strlen("LIST:\n"));
+    memcpy(roster->snapshot->listFrame->data, "LIST:\n", strlen("LIST:\n"));
+}
+
+/**
+ * Puts a client in the first free slot of its probe sequence.
+ * slots is the hash table, size is its number of slots
+ * client is the client to put in
+ */
+static void roster_place(ClientInfo** slots, size_t size, ClientInfo* client) {
+    size_t i = client->hash & (size - 1);
+    while (slots[i] != NULL && slots[i] != TOMBSTONE) {
+        i = (i + 1) & (size - 1);
+    }
+    slots[i] = client;
+}
+
+/**
+ * Rebuilds the hash table without tombstones, doubling its size if it is
+ * more than half full of clients.
+ * roster is the roster
+ */
+static void roster_rehash(Roster* roster) {
+    size_t size = roster->size;
+    if (roster->count * 2 >= size) {
+        size *= 2;
+    }
+    ClientInfo** slots = calloc(size, sizeof(ClientInfo*));
+    for (size_t i = 0; i < roster->size; i++) {
+        if (roster->slots[i] != NULL && roster->slots[i] != TOMBSTONE) {
+            roster_place(slots, size, roster->slots[i]);
+        }
+    }
+    free(roster->slots);
+    roster->slots = slots;
+    roster->size = size;
+    roster->used = roster->count;
+}
+
+/**
+ * Frees what a roster holds once nothing can reach it any more, its clients
+ * aren't freed. Readers must be done with its snapshot too, unlike
+ * roster_publish this doesn't wait for them.
+ * roster is the roster
+ */
+void roster_free(Roster* roster) {
+    snapshot_free(roster->snapshot);
+    roster->snapshot = NULL;
+    free(roster->slots);
+    roster->slots = NULL;
+}
+
+/**
+ * Finds a client by name.
+ * roster is the roster
+ * name is the name to look for
+ * Returns the client, NULL if nobody has that name
+ */
+ClientInfo* roster_find(Roster* roster, const char* name) {
+    uint64_t hash = roster_hash(name);
+    size_t i = hash & (roster->size - 1);
+    ClientInfo* client;
+    while ((client = roster->slots[i]) != NULL) {
+        if (client != TOMBSTONE && client->hash == hash &&
+                !strcmp(client->name, name)) {
+            return client;
+        }
+        i = (i + 1) & (roster->size - 1);
+    }
+    return NULL;
+}
+
+/**
+ * Determines the link of a skip list node at a level.
+ * roster is the roster
+ * node is the node, NULL for the head of the list
+ * level is the level
+ * Returns where the node's next node at that level is stored
+ */
+static ClientInfo** roster_link(Roster* roster, ClientInfo* node,
+        int level) {
+    if (node == NULL) {
+        return &(roster->head[level]);
+    }
+    return level ? &(node->skip[level - 1]) : &(node->next);
+}
+
+/**
+ * Finds, at every level, the link after which a name belongs.
+ * roster is the roster
+ * name is the name
+ * update is filled in with the link to follow or change at each level
+ */
+static void roster_search(Roster* roster, const char* name,
+        ClientInfo*** update) {
+    ClientInfo* node = NULL;
+    for (int level = roster->levels - 1; level >= 0; level--) {
+        ClientInfo** link = roster_link(roster, node, level);
+        while (*link != NULL && strcmp((*link)->name, name) < 0) {
+            node = *link;
+            link = roster_link(roster, node, level);
+        }
+        update[level] = link;
+    }
+}
+
+/**
+ * Picks how many levels of the skip list a new client is linked into, each
+ * level holding a quarter of the clients of the one below.
+ * roster is the roster
+ * Returns the number of levels
+ */
+static int roster_random_levels(Roster* roster) {
+    int levels = 1;
+    int bits = rand_r(&(roster->seed));
+    while (levels < ROSTER_LEVELS && (bits & 3) == 0) {
+        levels++;
+        bits >>= 2;
+    }
+    return levels;
+}
+
+/**
+ * Adds a client, its name must not be in the roster already.
+ * roster is the roster
+ * client is the client to add, its name is set
+ */
+void roster_insert(Roster* roster, ClientInfo* client) {
+    ClientInfo** update[ROSTER_LEVELS];
+    client->hash = roster_hash(client->name);
+    if ((roster->used + 1) * 4 > roster->size * 3) { // Over 3/4 full
+        roster_rehash(roster);
+    }
+    size_t i = client->hash & (roster->size - 1);
+    while (roster->slots[i] != NULL && roster->slots[i] != TOMBSTONE) {
+        i = (i + 1) & (roster->size - 1);
+    }
+    if (roster->slots[i] == NULL) {
+        roster->used++;
+    }
+    roster->slots[i] = client;
+    roster->count++;
+    roster_publish(roster, snapshot_with(roster->snapshot, client));
+
+    roster_search(roster, client->name, update);
+    client->levels = roster_random_levels(roster);
+    for (int level = roster->levels; level < client->levels; level++) {
+        update[level] = &(roster->head[level]);
+    }
+    if (client->levels > roster->levels) {
+        roster->levels = client->levels;
+    }
+    client->skip = client->levels > 1 ?
+            malloc((client->levels - 1) * sizeof(ClientInfo*)) : NULL;
+    for (int level = 0; level < client->levels; level++) {
+        *roster_link(roster, client, level) = *update[level];
+        *update[level] = client;
+    }
+}
+
+/**
+ * Takes a client out of the roster. The client itself isn't freed.
+ * roster is the roster
+ * client is the client to remove, it must be in the roster
+ */
+void roster_remove(Roster* roster, ClientInfo* client) {
+    ClientInfo** update[ROSTER_LEVELS];
+    size_t i = client->hash & (roster->size - 1);
+    while (roster->slots[i] != client) {
+        i = (i + 1) & (roster->size - 1);
+    }
+    roster->slots[i] = TOMBSTONE;
+    roster->count--;
+    roster_publish(roster, snapshot_without(roster->snapshot, client));
+
+    roster_search(roster, client->name, update);
+    for (int level = 0; level < client->levels; level++) {
+        if (*update[level] == client) {
+            *update[level] = *roster_link(roster, client, level);
+        }
+    }
+    while (roster->levels > 1 && roster->head[roster->levels - 1] == NULL) {
+        roster->levels--;
+    }
+    free(client->skip);
+    client->skip = NULL;
+    client->next = NULL;
+}
+
+/**
+ * Determines the first client in name order, ClientInfo.next leads through
+ * the rest in order.
+ * roster is the roster
+ * Returns the first client, NULL if the roster is empty
+ */
+ClientInfo* roster_first(Roster* roster) {
+    return roster->head[0];
+}
+
+/**
+ * Determines the current snapshot of the roster. Writers swap in a new one
+ * with every change, so this is a single load and never takes the lock. The
+ * caller must be between epoch_enter and epoch_exit, which keeps the
+ * snapshot and the clients in it allocated.
+ * roster is the roster
+ * Returns the snapshot
+ */
+RosterSnapshot* roster_snapshot(Roster* roster) {
+    return __atomic_load_n(&(roster->snapshot), __ATOMIC_ACQUIRE);
+}
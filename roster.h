@@ -0,0 +1,54 @@
+#ifndef _ROSTER_H
+#define _ROSTER_H
+#include <stddef.h>
+#include <pthread.h>
+#include "commonfunction.h"
+#include "outqueue.h"
+
+/* Most levels of the roster's skip list, plenty for millions of names */
+#define ROSTER_LEVELS 16
+
+/* Immutable copy of the roster for readers that don't take the lock */
+typedef struct RosterSnapshot {
+    size_t count;
+    OutFrame* listFrame; // LIST: reply
+    size_t* offsets; // Where each client's name starts in listFrame
+    ClientInfo* clients[]; // In name order
+} RosterSnapshot;
+
+/* Clients in the chat, indexed by name both ways:
+ *     -open addressing hash table -> finding a name is O(1)
+ *     -skip list through ClientInfo.next -> walking in name order for LIST:,
+ *     adding and removing a client is O(log N)
+ * Writers hold the roster lock. Readers use a published snapshot instead,
+ * see roster_snapshot.
+ */
+typedef struct Roster {
+    ClientInfo** slots; // Hash table, NULL if never used
+    size_t size; // Number of slots, a power of two
+    size_t used; // Slots holding a client or a tombstone
+    size_t count; // Clients in the chat
+    int levels; // Levels of the skip list in use
+    unsigned int seed; // Picks each client's number of levels
+    ClientInfo* head[ROSTER_LEVELS]; // head[0] is the first client by name
+    pthread_mutex_t* lock; // Roster lock
+    RosterSnapshot* snapshot; // Latest snapshot, swapped in by writers
+} Roster;
+
+unsigned long long roster_hash(const char* name);
+
+void roster_init(Roster* roster, pthread_mutex_t* lock);
+
+void roster_free(Roster* roster);
+
+ClientInfo* roster_find(Roster* roster, const char* name);
+
+void roster_insert(Roster* roster, ClientInfo* client);
+
+void roster_remove(Roster* roster, ClientInfo* client);
+
+ClientInfo* roster_first(Roster* roster);
+
+RosterSnapshot* roster_snapshot(Roster* roster);
+
+#endif
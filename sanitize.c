@@ -0,0 +1,90 @@
+#include <stddef.h>
+#include "sanitize.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+/* Shortest run worth handing to the vector kernels */
+#define VECTOR_MIN 16
+
+/**
+ * Replaces non-printables one byte at a time, for short runs and the tail
+ * the vector kernels leave.
+ * dest is where the result goes, may be src itself
+ * src is the bytes to sanitize
+ * length is the number of bytes
+ */
+static void sanitize_scalar(char* dest, const char* src, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        signed char byte = src[i];
+        dest[i] = byte < NON_PRINTABLE ? REPLACEMENT : byte;
+    }
+}
+
+#ifdef HAVE_SSE2
+/**
+ * Replaces non-printables 16 bytes at a time, every x86-64 has SSE2.
+ * dest is where the result goes, may be src itself
+ * src is the bytes to sanitize
+ * length is the number of bytes
+ * Returns the number of bytes done, the rest is under 16 bytes
+ */
+static size_t sanitize_sse2(char* dest, const char* src, size_t length) {
+    const __m128i limit = _mm_set1_epi8(NON_PRINTABLE);
+    const __m128i replacement = _mm_set1_epi8(REPLACEMENT);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i bad = _mm_cmplt_epi8(bytes, limit); // Signed, as scalar
+        bytes = _mm_or_si128(_mm_and_si128(bad, replacement),
+                _mm_andnot_si128(bad, bytes));
+        _mm_storeu_si128((__m128i*)(dest + i), bytes);
+    }
+    return i;
+}
+
+/**
+ * Replaces non-printables 32 bytes at a time, only called once the CPU is
+ * known to have AVX2.
+ * dest is where the result goes, may be src itself
+ * src is the bytes to sanitize
+ * length is the number of bytes
+ * Returns the number of bytes done, the rest is under 32 bytes
+ */
+__attribute__((target("avx2")))
+static size_t sanitize_avx2(char* dest, const char* src, size_t length) {
+    const __m256i limit = _mm256_set1_epi8(NON_PRINTABLE);
+    const __m256i replacement = _mm256_set1_epi8(REPLACEMENT);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i bad = _mm256_cmpgt_epi8(limit, bytes); // Signed, as scalar
+        bytes = _mm256_blendv_epi8(bytes, replacement, bad);
+        _mm256_storeu_si256((__m256i*)(dest + i), bytes);
+    }
+    return i;
+}
+#endif
+
+/**
+ * Copies bytes, replacing every non-printable(< 32) with '?', in one pass.
+ * Works in place when dest is src, which is how a line can be sanitized in
+ * the receive buffer or straight into an outbound frame. Other overlaps are
+ * not allowed. Nothing is terminated, length bytes are written.
+ * dest is where the result goes
+ * src is the bytes to sanitize
+ * length is the number of bytes
+ */
+void sanitize_copy(char* dest, const char* src, size_t length) {
+    size_t done = 0;
+#ifdef HAVE_SSE2
+    if (length >= VECTOR_MIN) {
+        if (length >= 32 && __builtin_cpu_supports("avx2")) {
+            done = sanitize_avx2(dest, src, length);
+        }
+        done += sanitize_sse2(dest + done, src + done, length - done);
+    }
+#endif
+    sanitize_scalar(dest + done, src + done, length - done);
+}
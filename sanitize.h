@@ -0,0 +1,13 @@
+#ifndef _SANITIZE_H
+#define _SANITIZE_H
+#include <stddef.h>
+
+/* Non printables i.e < 32, compared as signed so bytes above 127 count too */
+#define NON_PRINTABLE 32
+
+/* What a non-printable is replaced with */
+#define REPLACEMENT '?'
+
+void sanitize_copy(char* dest, const char* src, size_t length);
+
+#endif
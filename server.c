@@ -7,87 +7,93 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <sys/time.h>
+#include "chatlog.h"
 #include "commonfunction.h"
+#include "config.h"
+#include "epoch.h"
+#include "latency.h"
+#include "linereader.h"
+#include "logger.h"
+#include "metrics.h"
+#include "pool.h"
+#include "protocol.h"
+#include "reactor.h"
+#include "room.h"
+#include "roster.h"
+#include "sanitize.h"
+#include "server.h"
+
+/* Longest a metrics scrape may take to send its request or read the reply,
+ * in seconds */
+#define METRICS_TIMEOUT 2
+
+/* Most of a scrape's request that is read */
+#define METRICS_REQUEST 4096
+
+/* Roster entries, one per client that joins */
+static Pool clientInfoPool = POOL_INIT(sizeof(ClientInfo));
 
-/* Non printables i.e < 32*/
-#define NON_PRINTABLE 32
-
-/* Type of message to be broadcasted to other clients */
-#define MSG_TYPE 1
-#define LEAVE_TYPE 2
-#define ENTER_TYPE 3
-
-/* Delay time after client sends SAY: command(microsecond) */
-#define SAY_DELAY 100000
-
-/**
- * Determines all clients in the chat and send them over to the client who
- * called the LIST: command. 
- * firstClient is the root client
- * write is to write to the client who called the *LIST: command
- */
-void list_name(ClientInfo* firstClient, FILE* write) {
-    size_t currentLength, nameLength;
-    char* allNames = malloc(sizeof(char));
-    allNames[0] = '\0'; // Removes garbage value
-
-    for (ClientInfo* curr = firstClient; curr != NULL; curr = curr->next) {
-        // Storing old length for reallocation
-        currentLength = strlen(allNames); 
-        nameLength = strlen(curr->name);
-        // Reallocation -> old size + new elemnt size
-        allNames = realloc(allNames, 
-                (currentLength + nameLength + 1) * sizeof(char));
-        strcat(allNames, curr->name);
-        if (curr->next != NULL) { // -> No comma after last name
-            strcat(allNames, ",");
-        }
+/**
+ * Sends raw protocol data to a single client in the chat. Data is queued on
+ * the client's connection and written by the reactor that owns it, so this
+ * never blocks on a slow client.
+ * client is the client to send to
+ * data is the data to send, length is its size in bytes
+ */
+void client_send(ClientInfo* client, const char* data, size_t length) {
+    connection_send(client->conn, data, length);
+}
+
+/**
+ * Determines all clients in the requester's room and send them over to the
+ * client who called the LIST: command. The reply comes ready-made with the
+ * room roster's snapshot, which writers swap in as the room changes, so a
+ * LIST: costs the same at any roster size and takes no lock.
+ * (Note: must not be called with the roster lock held)
+ * requester is the client who called the *LIST: command
+ */
+void list_name(ClientInfo* requester) {
+    epoch_enter();
+    Room* room = __atomic_load_n(&(requester->room), __ATOMIC_ACQUIRE);
+    if (room != NULL) { // Not kicked in the meantime
+        connection_send_frame(requester->conn,
+                roster_snapshot(&(room->roster))->listFrame);
     }
-    fprintf(write, "LIST:%s\n", allNames);
-    fflush(write);
-    free(allNames);
+    epoch_exit();
 }
 
 /**
  * Replaces the characters in a word that are non-printable with '?'.
  * word is the word to checked and replaced.
- * Returns the newly word with replaced '?'
- * Note(non-printable means < 32 Ascii value)
+ * Returns the newly word with replaced '?', to be freed by the caller
+ * Note(non-printable means < 32 Ascii value, see sanitize_copy)
  */
 char* convert_non_printables(char* word) {
-    char* converted = malloc(strlen(word) * sizeof(char));;
-
-    for (int i = 0; i < strlen(word); i++) {
-        if (word[i] < NON_PRINTABLE) { // < 32 ascii
-            converted[i] = '?';    
-        } else {
-            converted[i] = word[i];
-        }
-    }
+    size_t length = strlen(word);
+    char* converted = malloc((length + 1) * sizeof(char));
+    sanitize_copy(converted, word, length);
+    converted[length] = '\0';
     return converted;
 }
 
 /**
  * Finds the client with a given name.
- * firstClient is the root client
+ * roster is the clients in the chat
  * name is the name to search for
- * returns the found client.
+ * returns the found client, NULL if there is none.
  */
-ClientInfo* find_client_info(ClientInfo* firstClient, char* name) {
-    ClientInfo* match;
-    for (ClientInfo* curr = firstClient; curr != NULL; curr = curr->next) {
-        if (!strcmp(curr->name, name)) {
-            match = curr;
-        }
-    }
-    return match;
+ClientInfo* find_client_info(Roster* roster, char* name) {
+    return roster_find(roster, name);
 }
 
 /**
- * Broadcasts a message, leave, enter commands to all the clients in the chat.
- * firstClient is the root client
+ * Broadcasts a message, leave, enter commands to all the clients in a room.
+ * The frame is encoded once and shared by every client's queue.
+ * room is the room, held by the caller or the room table
  * name is the name of the broadcasting client
  * message is the message to be broadcasted(Note: only if command is MSG:)
  * type is the type of broadcasting command
@@ -95,251 +101,392 @@ ClientInfo* find_client_info(ClientInfo* firstClient, char* name) {
  *     - 2 -> LEAVE:name 
  *     - else -> ENTER:name
  */
-void broadcast(ClientInfo* firstClient, char* name, char* message, int type) {
-    for (ClientInfo* curr = firstClient; curr != NULL; curr = curr->next) {
-        if (type == MSG_TYPE) { // -> MSG:name:text broadcast
-            fprintf(curr->write, "MSG:%s:%s\n", name, message);
-        } else if (type == LEAVE_TYPE) { // -> Leave:name broadcast
-            fprintf(curr->write, "LEAVE:%s\n", name);
-        } else { // -> ENTER:name broadcoast
-            fprintf(curr->write, "ENTER:%s\n", name);
-        }
-        fflush(curr->write);
+void broadcast(Room* room, char* name, char* message, int type) {
+    OutFrame* frame;
+    if (type == MSG_TYPE) { // -> MSG:name:text broadcast
+        frame = frame_format("MSG:%s:%s\n", name, message);
+    } else if (type == LEAVE_TYPE) { // -> Leave:name broadcast
+        frame = frame_format("LEAVE:%s\n", name);
+    } else { // -> ENTER:name broadcoast
+        frame = frame_format("ENTER:%s\n", name);
     }
+
+    reactor_broadcast(room, frame); // Queued for everyone, never blocks
+    frame_release(frame);
+}
+
+/**
+ * Makes the copy of a MSG: kept in a room's history. The frame sent out
+ * isn't kept itself, its last reference going is what ends its timed
+ * fan-out. Like the frame, its binary twin is only made once a binary
+ * client is sent it.
+ * frame is the MSG: frame sent out
+ * Returns the copy, the caller holds the only reference
+ */
+static OutFrame* msg_kept(OutFrame* frame) {
+    OutFrame* kept = frame_create(frame->data, frame->length);
+    kept->nameLength = frame->nameLength;
+    return kept;
+}
+
+/**
+ * Sends a client the MSG: kept in a room's history from a sequence number
+ * on, then HISTORY:next where next is the sequence number the room's next
+ * MSG: gets. The kept frames are queued as they are, encoded once whoever
+ * they are replayed to(binary ones the first time a binary client is sent
+ * them), and reach the client's reactor as a single batch.
+ * client is the client
+ * room is the room, held by the caller
+ * since is the sequence number of the first MSG: wanted
+ * most is the most MSG: sent, the latest are
+ */
+static void replay_history(ClientInfo* client, Room* room,
+        unsigned long long since, size_t most) {
+    size_t count;
+    unsigned long long next;
+    OutFrame** frames = room_history(room, since, most, &count, &next);
+    metric_add(METRIC_REPLAYED, count);
+    connection_send_batch(client->conn, frames, count);
+    OutFrame* marker = frame_format("HISTORY:%llu\n", next);
+    connection_send_frame(client->conn, marker);
+    frame_release(marker);
+}
+
+/**
+ * Handles HISTORY:since, replaying what the client's room kept from
+ * sequence number since on(everything kept if it is empty), see
+ * replay_history. A client that was away asks from the HISTORY: it was
+ * last sent plus the MSG: it got since.
+ * (Note: must not be called with the roster lock held)
+ * requester is the client who called HISTORY:
+ * since is the argument of HISTORY:
+ */
+void history_handler(ClientInfo* requester, char* since) {
+    epoch_enter();
+    Room* room = __atomic_load_n(&(requester->room), __ATOMIC_ACQUIRE);
+    if (room != NULL) { // Not kicked in the meantime
+        replay_history(requester, room, strtoull(since, NULL, 10),
+                (size_t)-1);
+    }
+    epoch_exit();
 }
 
 /**
  * Handles the procedure when SAY: is sent from client.
  * Procedure:
  *     -Increment SAY: counters for both client and server
- *     -broadcast message to all clients
- *     -Sleep for 100ms
- * statNeeds is to keep track of server's statistics(i.e SAY: count)
+ *     -broadcast message to all clients in the client's room
+ *     -keep it in the room's history, if rooms keep one
+ *     -log it, if events are logged(see CHAT_LOG)
+ * The message is sanitized straight into the MSG: frame, one pass with no
+ * copy in between. Sanitizing and the whole fan-out are timed(see
+ * CHAT_TRACE).
+ * (Note: the caller applies the rate limit beforehand, see CHAT_SAY_RATE)
  * id is to keep track of client's statistics(i.e SAY: count)
- * firstClient is the root client
  * convertName is the name of client after non-printables are converted
- * saveAction is the message after SAY: command
+ * message is the message after SAY: command, length is its size in bytes
  */
-void say_handler(Stat** statNeeds, ClientInfo* id, ClientInfo** firstClient,
-        char* convertName, char* saveAction) {
-    ((*statNeeds)->sayC)++; // Server's stat SAY: counter
-    (id->say)++; // Client's stat SAY: counter
-    char* message = convert_non_printables(saveAction);
-    printf("%s: %s\n", convertName, message);
-    fflush(stdout);
-    broadcast(*firstClient, convertName, message, MSG_TYPE);
-    free(message); 
-    usleep(SAY_DELAY); // Sleep for 100ms
+void say_handler(ClientInfo* id, char* convertName, char* message,
+        size_t length) {
+    long long start = latency_now(); // Fan-out ends as the frame is freed
+    metric_add(METRIC_SAY, 1); // Server's stat SAY: counter
+    metric_bump(&(id->say)); // Client's stat SAY: counter
+    size_t nameLength = strlen(convertName);
+
+    // -> MSG:name:text broadcast
+    OutFrame* frame = frame_alloc(strlen("MSG:") + nameLength + length + 2);
+    char* text = frame->data;
+    memcpy(text, "MSG:", strlen("MSG:"));
+    text += strlen("MSG:");
+    memcpy(text, convertName, nameLength);
+    text += nameLength;
+    *text++ = ':';
+    long long sanitizing = latency_now();
+    sanitize_copy(text, message, length);
+    latency_record(LAT_SANITIZE, sanitizing);
+    text[length] = '\n';
+    frame->length = frame->capacity;
+    frame->born = start;
+    frame->nameLength = nameLength; // Binary twin is made from it if needed
+
+    epoch_enter(); // Keeps the room allocated if a kick takes id out of it
+    Room* room = __atomic_load_n(&(id->room), __ATOMIC_ACQUIRE);
+    logger_write(EVENT_SAY, room != NULL ? room->name : NULL, convertName,
+            text, length);
+    if (room != NULL) {
+        if (room_history_size()) {
+            room_keep(room, msg_kept(frame));
+        }
+        reactor_broadcast(room, frame); // Queued for the room, never blocks
+        chatlog_append(LOG_MSG, room->name, convertName, text, length);
+    }
+    epoch_exit();
+    frame_release(frame);
 }
 
 /**
- * Adds a client to a list in lexographical order of their name. Also will 
- * make the first one of the list as the root if there isn't one.
- * firstClient is the root client
- * name is the client's name to be added
+ * Adds a client to the roster, which keeps the clients in lexographical
+ * order of their name.
+ * roster is the clients in the chat
+ * name is the client's name to be added(copied), it must not be taken
  * contact is the socket connection to client
- * write is to write to client
+ * Returns the newly added client(caller sets its connection)
  */
-void add_client_info(ClientInfo** firstClient, char* name, int contact,
-        FILE* write) {
+ClientInfo* add_client_info(Roster* roster, char* name, int contact) {
     // Allocating before adding
-    ClientInfo* newClient = malloc(sizeof(ClientInfo)); 
+    ClientInfo* newClient = pool_get(&clientInfoPool);
 
-    newClient->name = name;
+    newClient->name = strdup(name);
     newClient->contact = contact;
-    newClient->write = write;
     // New client means they haven't said anything yet, hence 0.
     newClient->say = 0;
     newClient->kick = 0;
     newClient->list = 0;
-    
-    // No clients exists yet
-    if (*firstClient == NULL) {
-        *firstClient = newClient;
-        return;
-    } 
+    newClient->conn = NULL;
+    newClient->room = NULL;
+    newClient->roomEntry = NULL;
+    newClient->next = NULL;
+    roster_insert(roster, newClient);
+    return newClient;
+}
+
+/**
+ * Frees a client's entry. Entries are retired through epoch_retire as
+ * snapshot readers may still be looking at them.
+ * client is the entry to free
+ */
+void free_client_info(void* client) {
+    free(((ClientInfo*)client)->name);
+    pool_put(&clientInfoPool, client);
+}
 
-    // List insertion in lexographical order
-    ClientInfo* prev;
-    ClientInfo* curr = *firstClient; 
+/**
+ * Releases a client that has been taken out of the roster. Its connection is
+ * closed once its pending output has been sent, the entry is freed along
+ * with the connection.
+ * (Note: called with the roster lock held)
+ * toRemove is the client to release
+ */
+static void release_client_info(ClientInfo* toRemove) {
+    connection_detach(toRemove->conn);
+}
 
-    if (strcmp(name, (*firstClient)->name) < 0) {
-        // Name insertion comes before root client
-        newClient->next = *firstClient;
-        *firstClient = newClient;
+/**
+ * Moves a client to another room. The room it leaves is told they have
+ * left, the room it enters, the client included, that they have entered.
+ * If rooms keep history the client is first sent the latest of the room's,
+ * see CHAT_HISTORY_REPLAY. A client entering the chat starts in the lobby
+ * through here.
+ * (Note: called with the roster lock held)
+ * client is the client, its connection set
+ * room is the room to move to, NULL to take the client out of the chat
+ */
+void move_client(ClientInfo* client, Room* room) {
+    Room* from = client->room;
+    if (from == room) {
         return;
-    } 
-   
-    // Searching for lexographical order
-    prev = curr;
-    while (curr && strcmp(curr->name, name) < 0) {
-        prev = curr;
-        curr = curr->next;
     }
-    
-    // Check to see if at the end of list
-    if (!curr) {
-        prev->next = newClient;
-    } else { // Normal insertion in between 2 elements
-        newClient->next = curr;
-        prev->next = newClient;
+    // Moved first, so it misses its own LEAVE: and gets its own ENTER:
+    connection_move(client->conn, from, room);
+    if (from != NULL) {
+        // Out of the room's roster first, so a LIST: sent by anyone told
+        // they have left can't list them. Held as this may drop the room.
+        room_hold(from);
+        room_drop(client);
+        broadcast(from, client->name, NULL, LEAVE_TYPE);
+        chatlog_append(LOG_LEAVE, from->name, client->name, "", 0);
+        room_release(from);
+    }
+    if (room != NULL) {
+        room_add(room, client);
+        chatlog_append(LOG_ENTER, room->name, client->name, "", 0);
+        if (room_history_size()) {
+            replay_history(client, room, 0, room_replay_size());
+        }
+        broadcast(room, client->name, NULL, ENTER_TYPE);
     }
 }
 
 /**
- * Removes the first occurence of a client given a specified name.
- * firstClient is the root client
+ * Handles JOIN:room and PART:, moving a client to the named room(made if
+ * nobody is in it yet) or back to the lobby for an empty name. A name that
+ * couldn't be a client's name is ignored.
+ * (Note: called with the roster lock held)
+ * client is the client
+ * name is the room's name, length is its length in bytes
+ */
+void join_room(ClientInfo* client, char* name, size_t length) {
+    if (length == 0) {
+        move_client(client, room_lobby());
+    } else if (name_usable(name, length)) {
+        move_client(client, room_open(name));
+    }
+}
+
+/**
+ * Removes the client with a specified name, telling the rest of their room
+ * they have left.
+ * roster is the clients in the chat
  * name is the client's name to be removed
  * (Note: if no client exists -> do nothing)
  */
-void remove_client_info(ClientInfo** firstClient, char* name) {
-    ClientInfo* toRemove;
-    if (*firstClient == NULL) {
+void remove_client_info(Roster* roster, char* name) {
+    ClientInfo* toRemove = roster_find(roster, name);
+    if (toRemove == NULL) {
         return;
     }
-    // If specified client is the root
-    if (strcmp((*firstClient)->name, name) == 0) {
-        toRemove = *firstClient; // searches for specified client
-        *firstClient = (*firstClient)->next;
-        // Handles deallocation
-        close(toRemove->contact);
-        fclose(toRemove->write);
-        free(toRemove);
-        return;
-    }
-    // Normal prodcedure if name is not root
-    for (ClientInfo* curr = *firstClient; curr->next != NULL;
-            curr = curr->next) {
-        if (strcmp(curr->next->name, name) == 0) {
-            toRemove = curr->next; // Searches for client to be removed
-            curr->next = curr->next->next;
-            // Handles deallocation 
-            close(toRemove->contact);
-            fclose(toRemove->write);
-            free(toRemove);
-            return;
-        }
-    }
+    roster_remove(roster, toRemove);
+    move_client(toRemove, NULL);
+    release_client_info(toRemove); // Handles deallocation
 }
 
 /**
  * Handle clients who failed authentication or name negotiation, cleaning 
  * up resources/memories.
- * contact is socket connection to client, linked to read
+ * contact is socket connection to client, read through reader
  * contact2 is a duplicate of contact, linked to write
  * write is to write to client
- * read is to read response back from client
+ * reader is to read response back from client
  * Exits failed client thread with error code of 2
  */
-void client_cleanup(int contact, int contact2, FILE* write, FILE* read) {
+void client_cleanup(int contact, int contact2, FILE* write,
+        LineReader* reader) {
+    metric_add(METRIC_CONNECTIONS, -1);
+    line_free(reader);
     close(contact);
-    close(contact2);
-    fclose(read);
-    fclose(write);
+    fclose(write); // Closes contact2
     pthread_exit((void*)COM_ERROR);
 }
 
 /**
- * Handles the LEAVE: command sent by client to the server, which removes 
- * client from the chat with appropriate protocol.
- * firstClient is the root client
+ * Takes a client out of the chat and tells everyone else in their room they
+ * have left.
+ * roster is the clients in the chat
  * name is client's name that is leaving
- * contact is socket connection to client, allowing reading to client
- * contact2 is a duplicate of contact, allowing writing to client
- */
-void leave_procedure(ClientInfo** firstClient, char* name, int contact,
-        int contact2) {
-    printf("(%s has left the chat)\n", name);
-    fflush(stdout);
-    remove_client_info(firstClient, name);
-    broadcast(*firstClient, name, NULL, LEAVE_TYPE);
-    close(contact);
-    close(contact2);
+ */
+void leave_chat(Roster* roster, char* name) {
+    logger_write(EVENT_LEAVE, NULL, name, NULL, 0);
+    remove_client_info(roster, name);
 }
 
 /**
  * Kick a client from the chat with a specified name.
- * firstClient is the root client
+ * roster is the clients in the chat
+ * kicker is the client kicking them
  * name is the name of client to be kicked
  * (Note: if name doesn't exist -> do nothing)
  */
-void kick_named_client(ClientInfo** firstClient, char* name) {
-    for (ClientInfo* curr = *firstClient; curr != NULL; curr = curr->next) {
-        if (!strcmp(curr->name, name)) { // Searching for the right name
-            fprintf(curr->write, "KICK:\n");
-            fflush(curr->write);
-            remove_client_info(firstClient, name);
-            printf("(%s has left the chat)\n", name);
-            fflush(stdout);
-            broadcast(*firstClient, name, NULL, LEAVE_TYPE);
-            return;
-        }
+void kick_named_client(Roster* roster, ClientInfo* kicker, char* name) {
+    ClientInfo* toKick = roster_find(roster, name);
+    if (toKick == NULL) {
+        return;
     }
+    client_send(toKick, "KICK:\n", strlen("KICK:\n"));
+    chatlog_append(LOG_KICK, toKick->room->name, name, kicker->name,
+            strlen(kicker->name));
+    logger_write(EVENT_KICK, NULL, name, kicker->name, strlen(kicker->name));
+    roster_remove(roster, toKick);
+    move_client(toKick, NULL);
+    release_client_info(toKick);
 }
 
 /**
  * Checks if a specified client's name exists in thbe system.
- * firstClient is the root client
+ * roster is the clients in the chat
  * name is the client's name to check for
  * Returns 1 if client exists, 0 if doesn't
  */
-int name_exist(ClientInfo* firstClient, char* name) {
-    ClientInfo* tempFirst = firstClient;
-    while (tempFirst != NULL) {
-        if (!strcmp(tempFirst->name, name)) { // Name matching
-            return 1; 
-        }
-        tempFirst = tempFirst->next;
+int name_exist(Roster* roster, char* name) {
+    return roster_find(roster, name) != NULL;
+}
+
+/**
+ * Determines whether a name may be used at all. Names in binary frames may
+ * hold anything, but an empty one, or one that would break text clients'
+ * lines or be cut short as a string, is refused like a taken one.
+ * name is the name, terminated
+ * length is its length in bytes
+ * Returns 1 if it may be used, 0 if not
+ */
+int name_usable(char* name, size_t length) {
+    return length && !memchr(name, '\n', length) && !memchr(name, '\0',
+            length);
+}
+
+/**
+ * Sends a command without an argument to a client that isn't in the chat
+ * yet, in the framing the client reads.
+ * write is to write to client
+ * reader is to read from client, its framing is the client's
+ * op is the command's opcode
+ */
+static void send_command(FILE* write, LineReader* reader, int op) {
+    if (reader->split != NULL) {
+        char header[PROTOCOL_HEADER_MAX];
+        fwrite(header, 1, protocol_header(header, op, 0), write);
+        fputc('\0', write);
+    } else {
+        fprintf(write, "%s:\n", protocol_verb(op));
     }
-    return 0;
 }
 
 /**
  * Gets a client's name. if their returned name is empty, sends NAME_TAKEN: 
- * command and get their name again.
- * statNeeds is to keep track of server's total statistics(i.e say counter...)
- * contact is socket connection to client, linked to read
+ * command and get their name again. A BIN: sent instead switches the client
+ * to binary frames, acknowledged with BIN:, and the name is read after it.
+ * contact is socket connection to client, read through reader
  * contact2 is a duplicate of contact, linked to write
  * write is to write to client
- * read is to read response back from client
- * Returns the client's name returned back
+ * reader is to read response back from client
+ * Returns the client's name returned back, valid until reader is next used
  * (Note: exit with error code 2 if client fails name negotiation)
  */
-char* extract_name(Stat** statNeeds, int contact, int contact2, FILE* write,
-        FILE* read) {
+char* extract_name(int contact, int contact2, FILE* write,
+        LineReader* reader) {
+    size_t length;
     fflush(write); // for NAME_TAKEN: to go through 
-    fprintf(write, "WHO:\n");
+    send_command(write, reader, CMD_WHO);
     fflush(write);
-    char* response = read_line(read);
-    char* clientName;
+    char* response;
+    Command command;
     
+    while ((response = line_read(reader, contact, &length)) != NULL &&
+            protocol_decode(response, length, reader->split != NULL,
+            &command) == CMD_BIN) {
+        metric_add(METRIC_BYTES_IN, length + 1);
+        if (reader->split == NULL) { // Last text the client gets
+            fprintf(write, "BIN:\n");
+            fflush(write);
+            reader->split = protocol_split;
+        }
+    }
     if (response == NULL) {
-        client_cleanup(contact, contact2, write, read);
+        client_cleanup(contact, contact2, write, reader);
     }
+    metric_add(METRIC_BYTES_IN, length + 1);
 
-    response = strtok_r(response, ":", &clientName);
     /* response in form NAME:name*/
-    if (response != NULL) {
-        if (!strcmp(response, "NAME")) { // Total server counter for SIGHUP
-            ((*statNeeds)->nameC)++;
-        }
-    } 
+    if (command.op == CMD_NAME) {
+        metric_add(METRIC_NAME, 1); // Total server counter for SIGHUP
+    }
 
-    if (clientName[0] == '\0') { // If name is empty -> NAME_TAKEN: -> new name
-        fprintf(write, "NAME_TAKEN:\n");
-        fflush(write);
-        fprintf(write, "WHO:\n");
+    if (command.argLength == 0) { // If name is empty -> NAME_TAKEN: -> new name
+        send_command(write, reader, CMD_NAME_TAKEN);
+        send_command(write, reader, CMD_WHO);
         fflush(write);
         
-        response = read_line(read); 
-        response = strtok_r(response, ":", &clientName); // Extract new name
-        if (response != NULL) {
-            if (!strcmp(response, "NAME")) { // Server counter for SIGHUP stat
-                ((*statNeeds)->nameC)++;
-            }
+        response = line_read(reader, contact, &length); 
+        if (response == NULL) {
+            client_cleanup(contact, contact2, write, reader);
+        }
+        metric_add(METRIC_BYTES_IN, length + 1);
+        // Extract new name
+        if (protocol_decode(response, length, reader->split != NULL,
+                &command) == CMD_NAME) {
+            metric_add(METRIC_NAME, 1); // Server counter for SIGHUP stat
         }
     }
-    return clientName;
+    return command.arg;
 }
 
 /**
@@ -348,71 +495,82 @@ char* extract_name(Stat** statNeeds, int contact, int contact2, FILE* write,
  *     -Sends NAME_TAKEN: and get their name back until they return a unique
  *     name 
  *     -sends OK: if the process is done
- *     -sends ENTER:name to all clients
- * firstClient is the root client
- * statNeeds is to keep track of server's total statistics(i.e say count)
+ *     -hands writing to the client over to the writer thread(write is closed)
+ *     -puts the client in the lobby, sending ENTER:name to everyone there
+ * The lock is only held while checking and adding the name, never while
+ * waiting for the client.
+ * roster is the clients in the chat
  * contact is the socket connection to server, linked to read
  * contact2 is a duplicate of contact, linked to write
  * write is to write to client
- * read is to read response from client
- * Returns the unique client name. 
+ * reader is to read response from client
+ * lock is the roster lock
+ * Returns the client's entry in the chat. 
  */
-char* name_handler(ClientInfo** firstClient, Stat** statNeeds, int contact,
-        int contact2, FILE* write, FILE* read) {
+ClientInfo* name_handler(Roster* roster, int contact, int contact2,
+        FILE* write, LineReader* reader, pthread_mutex_t* lock) {
     char* clientName;
-    clientName = extract_name(statNeeds, contact, contact2, write, read);
+    clientName = extract_name(contact, contact2, write, reader);
     
-    while (name_exist(*firstClient, clientName)) { // Update name if duplicated
-        fprintf(write, "NAME_TAKEN:\n");
+    latency_lock(lock);
+    // Update name if duplicated or unusable
+    while (!name_usable(clientName, strlen(clientName)) ||
+            name_exist(roster, clientName)) {
+        pthread_mutex_unlock(lock);
+        send_command(write, reader, CMD_NAME_TAKEN);
         // flushing inside extract_name
-        clientName = extract_name(statNeeds, contact, contact2, write, read);
+        clientName = extract_name(contact, contact2, write, reader);
+        latency_lock(lock);
     }
 
     // After finding a unique name
-    add_client_info(firstClient, clientName, contact, write); // Adds client
-    fprintf(write, "OK:\n");
+    ClientInfo* id = add_client_info(roster, clientName, contact);
+    clientName = id->name; // Line read is only valid until the next one
+    send_command(write, reader, CMD_OK);
     fflush(write);
-    printf("(%s has entered the chat)\n", clientName);
-    fflush(stdout);
-    // Broadcasts ENTER:name to all other clients
-    broadcast(*firstClient, clientName, NULL, ENTER_TYPE); 
-    return clientName;
+    // Writer sends from now on
+    id->conn = reactor_adopt(dup(contact2), id, reader->split != NULL);
+    fclose(write);
+    logger_write(EVENT_ENTER, NULL, clientName, NULL, 0);
+    // Broadcasts ENTER:name to everyone in the lobby
+    move_client(id, room_lobby());
+    pthread_mutex_unlock(lock);
+    return id;
 }
 
 /**
  * Authentication check with the client. If matches, then client gets added
  * to the client. Else, client's info gets cleaned up. 
- * statNeeds is to keep track of server's total statistics(i.e say count)
  * contact is the socket connection to client
  * contact2 is a duplicated from contact
  * serverAuth is the server's authentication code
- * toClient is to read response from client
- * fromClient is to write to client
+ * toClient is to write to client
+ * fromClient is to read response from client
  * Exit with error code of 2 if client fails authentication
  * (Note: if server is in no authentication mode, any client can join with any 
  * authentication code)
  */
-void auth_check(Stat** statNeeds, int contact, int contact2, char* serverAuth, 
-        FILE* toClient, FILE* fromClient) {
+void auth_check(int contact, int contact2, char* serverAuth, 
+        FILE* toClient, LineReader* fromClient) {
     char* line;
+    size_t length;
     fprintf(toClient, "AUTH:\n");
     fflush(toClient);
-    line = read_line(fromClient);
-    char* clientAuth;
-    char* saveClientAuth;
-    clientAuth = strtok_r(line, ":", &saveClientAuth);
+    line = line_read(fromClient, contact, &length);
+    Command command;
     
-    if (clientAuth == NULL) {
-        pthread_exit((void*)COM_ERROR);
+    if (line == NULL || length == 0) {
+        client_cleanup(contact, contact2, toClient, fromClient);
     }
+    metric_add(METRIC_BYTES_IN, length + 1);
 
-    if (!strcmp(clientAuth, "AUTH")) { // Track server total stat for SIGHUP
-        ((*statNeeds)->authC)++;
+    if (protocol_parse(line, length, &command) == CMD_AUTH) {
+        metric_add(METRIC_AUTH, 1); // Track server total stat for SIGHUP
     }
     
     // If auth code matches or no server auth needed
-    if (!strcmp(serverAuth, saveClientAuth) || !strcmp(serverAuth, "noauth")) {
-        fprintf(toClient, "OK:\n");
+    if (!strcmp(serverAuth, command.arg) || !strcmp(serverAuth, "noauth")) {
+        fprintf(toClient, "OK:\nBIN:\n"); // Binary frames are on offer
         fflush(toClient);
         return;
     }
@@ -420,6 +578,15 @@ void auth_check(Stat** statNeeds, int contact, int contact2, char* serverAuth,
     client_cleanup(contact, contact2, toClient, fromClient);
 }
 
+/**
+ * Frees the details of a client thread that exits before joining the chat,
+ * see client_cleanup.
+ * details is the client's details
+ */
+static void client_abandon(void* details) {
+    client_free((Client*)details);
+}
+
 /**
  * Handles all the protocol of each client entering the chat. Client will
  * need to go through these processes:
@@ -431,78 +598,133 @@ void auth_check(Stat** statNeeds, int contact, int contact2, char* serverAuth,
  *     -LIST:
  *     -KICK:
  *     -LEAVE:
+ *     -JOIN:
+ *     -PART:
+ *     -HISTORY:
  * (Note: any invalid commands are silently ignored by the server)
  * If a client disconnects from the server, all their info gets erased.
  * 
  * details contains client's information which consists of:
  *     -authentication code
  *     -socket connection
- *     -total server stat's tracker(i.e say:)
  * Exit with 2 if kicked otherwise 0
  */
 void* client_handler(void* details) {
     Client* detail = (Client*)details; 
     char* authLine = (*detail).auth;
     int contact = (*detail).contact, contact2 = dup(contact);
-    FILE* read = fdopen(contact, "r"), *write = fdopen(contact2, "w");
-    Stat** statNeeds = detail->statistics; // For total server statistics
+    FILE* write = fdopen(contact2, "w");
+    LineReader reader;
+    line_init(&reader, detail->maxLine);
     char* name, *convertName;
-    // Authentication check and name negotiation
-    auth_check(statNeeds, contact, contact2, authLine, write, read);
-    pthread_mutex_lock(&(detail->lock));
-    name = name_handler(detail->firstClient, statNeeds, contact, contact2,
-            write, read);
+    ClientInfo* id;
+    int status = NORM_EXIT;
+    // Authentication check and name negotiation, either may exit the thread
+    pthread_cleanup_push(client_abandon, detail);
+    auth_check(contact, contact2, authLine, write, &reader);
+    id = name_handler(detail->roster, contact, contact2, write, &reader,
+            detail->lock);
+    pthread_cleanup_pop(0);
+    Connection* conn = id->conn;
+    name = id->name;
     convertName = convert_non_printables(name); // < 32 Ascii
-    ClientInfo* id = find_client_info(*(detail->firstClient), name); 
-    pthread_mutex_unlock(&(detail->lock));
     
-    char* response, *saveAction, *action; 
-    while ((response = read_line(read)) != NULL) {
-        pthread_mutex_lock(&(detail->lock));
-        action = strtok_r(response, ":", &saveAction); // Extract responses
-        if (!strcmp(action, "SAY")) {
-            say_handler(statNeeds, id, detail->firstClient, convertName,
-                    saveAction); // Handles SAY: command
-        } else if (!strcmp(action, "LIST")) {
-            ((*statNeeds)->listC)++; // For server stat
-            (id->list)++; // For client stat
-            list_name(*(detail->firstClient), write);
-        } else if (!strcmp(action, "KICK")) {
-            ((*statNeeds)->kickC)++; // For server stat
-            (id->kick)++; // For client stat
-            kick_named_client(detail->firstClient, saveAction);
-
-            if (!strcmp(saveAction, name)) {
-                pthread_exit((void*)COM_ERROR);
+    char* response;
+    size_t length;
+    Command command;
+    // Lines are views into reader's buffer, nothing to free
+    while ((response = line_read(&reader, contact, &length)) != NULL) {
+        long long parsing = latency_now();
+        int op = protocol_decode(response, length, reader.split != NULL,
+                &command);
+        latency_record(LAT_PARSE, parsing);
+        metric_add(METRIC_BYTES_IN, length + 1);
+        // Paced before taking the lock so only this client waits
+        if (op == CMD_SAY && !connection_say_wait(conn)) {
+            continue; // Rejected, see CHAT_SAY_POLICY
+        }
+        if (!__atomic_load_n(&(conn->joined), __ATOMIC_ACQUIRE)) {
+            break; // Kicked, lines still buffered are dropped
+        } else if (op == CMD_SAY) { // Roster isn't touched, no lock
+            say_handler(id, convertName, command.arg, command.argLength);
+            continue;
+        } else if (op == CMD_LIST) { // Reads a snapshot, no lock
+            metric_add(METRIC_LIST, 1); // For server stat
+            metric_bump(&(id->list)); // For client stat
+            list_name(id);
+            continue;
+        } else if (op == CMD_HISTORY) { // Reads the room's history, no lock
+            metric_add(METRIC_HISTORY, 1); // For server stat
+            history_handler(id, command.arg);
+            continue;
+        } else if (op != CMD_KICK && op != CMD_LEAVE && op != CMD_JOIN &&
+                op != CMD_PART) { // Ignored, no lock
+            continue;
+        }
+
+        latency_lock(detail->lock);
+        if (!conn->joined) { // Kicked in the meantime
+            pthread_mutex_unlock(detail->lock);
+            break;
+        } else if (op == CMD_KICK) {
+            metric_add(METRIC_KICK, 1); // For server stat
+            metric_bump(&(id->kick)); // For client stat
+            kick_named_client(detail->roster, id, command.arg);
+
+            if (!strcmp(command.arg, name)) {
+                pthread_mutex_unlock(detail->lock);
+                status = COM_ERROR;
+                break;
             }
-        } else if (!strcmp(action, "LEAVE")) {
-            ((*statNeeds)->leaveC)++; // For server stat
-            leave_procedure(detail->firstClient, name, contact, contact2);
-            pthread_exit((void*)NORM_EXIT);
+        } else if (op == CMD_JOIN) {
+            metric_add(METRIC_JOIN, 1); // For server stat
+            join_room(id, command.arg, command.argLength);
+        } else if (op == CMD_PART) {
+            metric_add(METRIC_PART, 1); // For server stat
+            join_room(id, "", 0);
+        } else if (op == CMD_LEAVE) {
+            metric_add(METRIC_LEAVE, 1); // For server stat
+            leave_chat(detail->roster, name);
+            pthread_mutex_unlock(detail->lock);
+            break;
         }
-        pthread_mutex_unlock(&(detail->lock));
+        pthread_mutex_unlock(detail->lock);
     }
-    pthread_mutex_lock(&(detail->lock));
-    if (name_exist(*(detail->firstClient), name)) {
-        leave_procedure(detail->firstClient, name, contact, contact2);
+    latency_lock(detail->lock);
+    if (conn->joined) { // Disconnected without LEAVE:
+        leave_chat(detail->roster, name);
     }
-    pthread_mutex_unlock(&(detail->lock));
-    pthread_exit((void*)NORM_EXIT);
+    pthread_mutex_unlock(detail->lock);
+
+    free(convertName);
+    line_free(&reader);
+    close(contact); // The writer closes its own descriptor
+    metric_add(METRIC_CONNECTIONS, -1);
+    connection_release(conn); // id and name may be freed from here on
+    client_free(detail);
+    pthread_exit((void*)(long)status);
 }
 
 /**
- * Actively listens for any client trying to connect to the server. Also prints
- * out the port number that is listening to.
+ * Actively listens for any client trying to connect to the server.
  * port is the port to listen from
+ * reusePort is whether other sockets may listen on the same port, the
+ * kernel then spreads new clients across all of them(SO_REUSEPORT)
+ *     0 -> this socket only
+ *     else -> shared port
  * Returns the socket connection with the client trying to join 
  */
-int client_listen(char* port) {
+int client_listen(char* port, int reusePort) {
     struct addrinfo* addressInfo = addr_set_up(port, SERVER_CALL);
     int clientConnect = socket(AF_INET, SOCK_STREAM, 0);
     
     // Allow socket to be reused immediately
     int optVal = 1;
     setsockopt(clientConnect, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int));
+    if (reusePort) {
+        setsockopt(clientConnect, SOL_SOCKET, SO_REUSEPORT, &optVal,
+                sizeof(int));
+    }
     
     // Binding server to a specific port and listen
     if (bind(clientConnect, addressInfo->ai_addr, sizeof(struct sockaddr))
@@ -511,15 +733,33 @@ int client_listen(char* port) {
         exit(COM_ERROR);
     }
 
-    // Determine ephemeral port chosen
+    listen(clientConnect, SOMAXCONN);// Listens for client connection
+    return clientConnect;
+}
+
+/**
+ * Turns off Nagle's algorithm on a client's socket. Output is already
+ * gathered into as few writes as possible before it is sent, so holding
+ * back a small write for the ACK of the last one would only add latency.
+ * fd is the client's socket
+ */
+void socket_nodelay(int fd) {
+    int optVal = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optVal, sizeof(int));
+}
+
+/**
+ * Determines the port a listening socket is bound to, useful when an 
+ * ephemeral port was chosen.
+ * connection is the listening socket
+ * Returns the port number
+ */
+unsigned int listen_port(int connection) {
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(struct sockaddr_in));
     socklen_t len = sizeof(struct sockaddr_in);
-    getsockname(clientConnect, (struct sockaddr*)&addr, &len);
-    fprintf(stderr, "%u\n", ntohs(addr.sin_port));
-    
-    listen(clientConnect, SOMAXCONN);// Listens for client connection
-    return clientConnect;
+    getsockname(connection, (struct sockaddr*)&addr, &len);
+    return ntohs(addr.sin_port);
 }
 
 /**
@@ -528,33 +768,31 @@ int client_listen(char* port) {
  * stage.
  * connection is the socket connection of client
  * serverAuthLine is the authentication code of server
- * firstClient is the root client
- * statNeeds is to keep track of total server stats(i.e say count)
+ * roster is the clients in the chat
+ * lock is the one lock shared by all clients
+ * maxLine is the longest line accepted from a client
  */
 void process_clients(int connection, char* serverAuthLine,
-        ClientInfo** firstClient, Stat** statNeeds) {
+        Roster* roster, pthread_mutex_t* lock, size_t maxLine) {
     int clientComm;
     struct sockaddr_in fromAddr;
     socklen_t fromAddrSize;
 
-    // Creating one lock for all clients
-    pthread_mutex_t lock;
-    pthread_mutex_init(&lock, NULL);
-
     while (1) { // processing clients whenever they join
         fromAddrSize = sizeof(struct sockaddr_in);
         clientComm = accept(connection, (struct sockaddr*)&fromAddr,
                 &fromAddrSize);
+        socket_nodelay(clientComm);
+        metric_add(METRIC_ACCEPTED, 1);
+        metric_add(METRIC_CONNECTIONS, 1); // Lowered as the thread exits
         /* Creating required data before passing into thread, function doesn't
-        lock or server stat. (Note: will be add later below) 
+        lock. (Note: will be add later below) 
         */
         Client* details = client_create(NULL, serverAuthLine, clientComm,
-                firstClient, 2); 
-        // Add to client's detail to keep track of server stats(SAY: count..)
-        details->statistics = malloc(sizeof(Stat*));
-        details->statistics = statNeeds;
-        // Giving client the lock
+                roster, 2); 
+        // Giving client the shared lock
         details->lock = lock;
+        details->maxLine = maxLine;
         
         pthread_t clientId;
         pthread_create(&clientId, NULL, client_handler, details);
@@ -566,30 +804,99 @@ void process_clients(int connection, char* serverAuthLine,
  * Handles the SIGHUP signal sent to server with appropriate protocol
  *     -output all say, kick, list counts of all clients in the chat
  *     -output overall server stats of auth, name, say, kick, list, leave count
+ * Clients are read from a snapshot of the roster, so clients leaving at the
+ * same time stay allocated until their lines are copied out, which is done
+ * before any is written.
+ * SIGUSR1 instead outputs the latency of each stage of handling a line, and
+ * the trace of recent stages if one is kept(see latency_dump).
  * stats is all the servers stats above
  */
 void* server_stats(void* stats) {
     Stat* statNeeds = (Stat*)stats; // For server's info
     sigset_t* signalSet = (*statNeeds).signalSet; // Contains only for SIGHUP
-    ClientInfo** firstClient = (*statNeeds).firstClient; // For client's info
+    Roster* roster = (*statNeeds).roster; // For client's info
 
     int sighup;
     for (;;) { 
-        sigwait(signalSet, &sighup); // Waiting for SIGHUP 
+        sigwait(signalSet, &sighup); // Waiting for SIGHUP or SIGUSR1
+        if (sighup == SIGUSR1) {
+            fprintf(stderr, "@LATENCY@\n");
+            latency_dump(stderr);
+            fflush(stderr);
+            continue;
+        }
 
-        ClientInfo* tempFirst = *firstClient;
-        fprintf(stderr, "@CLIENTS@\n"); // Printing client's data
-        while (tempFirst != NULL) { 
-            fprintf(stderr, "%s:SAY:%d:KICK:%d:LIST:%d\n",tempFirst->name,
-                    tempFirst->say, tempFirst->kick, tempFirst->list);
-            tempFirst = tempFirst->next;
+        // Copied out first, a blocked stderr mustn't hold up the epoch
+        char* clients;
+        size_t length;
+        FILE* copy = open_memstream(&clients, &length);
+        epoch_enter();
+        RosterSnapshot* snapshot = roster_snapshot(roster);
+        for (size_t i = 0; i < snapshot->count; i++) { 
+            ClientInfo* client = snapshot->clients[i];
+            fprintf(copy, "%s:SAY:%d:KICK:%d:LIST:%d\n", client->name,
+                    __atomic_load_n(&(client->say), __ATOMIC_RELAXED),
+                    __atomic_load_n(&(client->kick), __ATOMIC_RELAXED),
+                    __atomic_load_n(&(client->list), __ATOMIC_RELAXED));
         }
+        epoch_exit();
+        fclose(copy);
+        fprintf(stderr, "@CLIENTS@\n"); // Printing client's data
+        fwrite(clients, 1, length, stderr);
+        free(clients);
 
         fprintf(stderr, "@SERVER@\n"); // Printing server's data
-        fprintf(stderr, "server:AUTH:%d:NAME:%d:SAY:%d:KICK:%d:LIST:%d:"
-                "LEAVE:%d\n", statNeeds->authC, statNeeds->nameC,
-                statNeeds->sayC, statNeeds->kickC, statNeeds->listC,
-                statNeeds->leaveC);
+        fprintf(stderr, "server:AUTH:%lld:NAME:%lld:SAY:%lld:KICK:%lld:"
+                "LIST:%lld:LEAVE:%lld\n", metric_read(METRIC_AUTH),
+                metric_read(METRIC_NAME), metric_read(METRIC_SAY),
+                metric_read(METRIC_KICK), metric_read(METRIC_LIST),
+                metric_read(METRIC_LEAVE));
+    }
+}
+
+/**
+ * Serves the metrics to whoever connects to the metrics port, one scrape at
+ * a time, so the server can be watched without signals. The request is read
+ * but not looked at, every scrape gets every metric in the Prometheus text
+ * format over HTTP/1.0.
+ * stats is the server's stats, holding the metrics listening socket
+ */
+void* metrics_listener(void* stats) {
+    Stat* statNeeds = (Stat*)stats;
+    Roster* roster = statNeeds->roster;
+    struct timeval timeout = {METRICS_TIMEOUT, 0};
+    char request[METRICS_REQUEST];
+
+    for (;;) {
+        int scraper = accept(statNeeds->metricsFd, NULL, NULL);
+        if (scraper < 0) {
+            continue;
+        }
+        // A scraper that stalls is dropped rather than holding up the next
+        setsockopt(scraper, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                sizeof(timeout));
+        setsockopt(scraper, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                sizeof(timeout));
+        size_t got = 0;
+        ssize_t length;
+        // Up to the blank line ending the headers, so nothing is left unread
+        while (got < sizeof(request) - 1 && (length = recv(scraper,
+                request + got, sizeof(request) - 1 - got, 0)) > 0) {
+            got += length;
+            request[got] = '\0';
+            if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+                break;
+            }
+        }
+
+        FILE* out = fdopen(scraper, "w");
+        fprintf(out, "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Connection: close\r\n\r\n");
+        metrics_write(out, __atomic_load_n(&(roster->count),
+                __ATOMIC_RELAXED));
+        latency_write(out);
+        fclose(out);
     }
 }
 
@@ -602,7 +909,13 @@ int main(int argc, char* argv[]) {
     } else {
         port = "0";
     }
-    ClientInfo* firstClient = NULL;
+    pthread_mutex_t lock; // Guards the client list
+    pthread_mutex_init(&lock, NULL);
+    Roster roster;
+    roster_init(&roster, &lock);
+    Config config;
+    config_load(&config);
+    latency_init(config.traceEvents);
     
     struct sigaction ignore;
     ignore.sa_handler = SIG_IGN;
@@ -612,24 +925,43 @@ int main(int argc, char* argv[]) {
     sigset_t signalSet;
     sigemptyset(&signalSet);
     sigaddset(&signalSet, SIGHUP);
+    sigaddset(&signalSet, SIGUSR1);
 
     Stat* statNeeds = malloc(sizeof(Stat));
-    statNeeds->authC = 0;
-    statNeeds->nameC = 0;
-    statNeeds->sayC = 0;
-    statNeeds->kickC = 0;
-    statNeeds->listC = 0;
-    statNeeds->leaveC = 0;
 
     statNeeds->signalSet = &signalSet;
-    statNeeds->firstClient = &firstClient;
+    statNeeds->roster = &roster;
     pthread_sigmask(SIG_BLOCK, &signalSet, NULL);
+    statNeeds->metricsFd = -1;
     pthread_create(&sighupCatch, NULL, &server_stats, statNeeds);
+    // Started with the signals blocked, like every other thread
+    logger_start(config.outputLevel, config.outputFormat);
+    if (config.logDir != NULL && chatlog_start(config.logDir,
+            config.logSegment, config.logSync) < 0) {
+        fprintf(stderr, "Communications error\n");
+        exit(COM_ERROR);
+    }
+    if (config.metricsPort) { // Local only, see CHAT_METRICS_PORT
+        pthread_t metricsServe;
+        char metricsPort[sizeof("65535")];
+        snprintf(metricsPort, sizeof(metricsPort), "%ld", config.metricsPort);
+        statNeeds->metricsFd = client_listen(metricsPort, 0);
+        pthread_create(&metricsServe, NULL, &metrics_listener, statNeeds);
+    }
      
     FILE* authentication = fopen(argv[1], "r");
     char* authLine = get_auth_line(authentication);
-    connection = client_listen(port);
-    process_clients(connection, authLine, &firstClient, &statNeeds);
+    if (config.ioMode == IO_THREADS) { // Client threads need a writer
+        reactor_start_writer(&config, &roster, &lock);
+    }
+    connection = client_listen(port, config.ioMode != IO_THREADS);
+    fprintf(stderr, "%u\n", listen_port(connection));
+    if (config.ioMode != IO_THREADS) {
+        reactor_run(connection, &config, authLine, &roster, &lock);
+    } else {
+        process_clients(connection, authLine, &roster, &lock,
+                config.maxLine);
+    }
 
     return NORM_EXIT;   
 }
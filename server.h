@@ -0,0 +1,51 @@
+#ifndef _SERVER_H
+#define _SERVER_H
+#include <stdio.h>
+#include <stddef.h>
+#include "commonfunction.h"
+#include "room.h"
+#include "roster.h"
+
+/* Type of message to be broadcasted to other clients */
+#define MSG_TYPE 1
+#define LEAVE_TYPE 2
+#define ENTER_TYPE 3
+
+void client_send(ClientInfo* client, const char* data, size_t length);
+
+void list_name(ClientInfo* requester);
+
+void history_handler(ClientInfo* requester, char* since);
+
+char* convert_non_printables(char* word);
+
+void broadcast(Room* room, char* name, char* message, int type);
+
+void say_handler(ClientInfo* id, char* convertName, char* message,
+        size_t length);
+
+ClientInfo* add_client_info(Roster* roster, char* name, int contact);
+
+void free_client_info(void* client);
+
+void move_client(ClientInfo* client, Room* room);
+
+void join_room(ClientInfo* client, char* name, size_t length);
+
+void remove_client_info(Roster* roster, char* name);
+
+void leave_chat(Roster* roster, char* name);
+
+void kick_named_client(Roster* roster, ClientInfo* kicker, char* name);
+
+int name_exist(Roster* roster, char* name);
+
+int name_usable(char* name, size_t length);
+
+int client_listen(char* port, int reusePort);
+
+void socket_nodelay(int fd);
+
+unsigned int listen_port(int connection);
+
+#endif
@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+/**
+ * Unmaps and closes whatever part of a ring was set up.
+ * ring is the ring, fields not set up yet are NULL
+ */
+static void uring_destroy(Uring* ring) {
+    if (ring->buffers != NULL) {
+        munmap(ring->buffers, ring->buffersSize);
+    }
+    free(ring->bufferData);
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqMap != NULL && ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapSize);
+    }
+    if (ring->sqMap != NULL) {
+        munmap(ring->sqMap, ring->sqMapSize);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+/**
+ * Maps part of a ring into memory.
+ * ring is the ring
+ * size is the number of bytes to map
+ * offset is which part to map(IORING_OFF_*)
+ * Returns the mapping, NULL if it failed
+ */
+static void* uring_map(Uring* ring, size_t size, long long offset) {
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, offset);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+/**
+ * Registers the ring of buffers the kernel picks from when a receive
+ * completes, and fills it with every buffer.
+ * ring is the ring
+ * Returns 0 on success, -1 if the kernel can't provide buffers this way
+ */
+static int uring_register_buffers(Uring* ring) {
+    ring->buffersSize = URING_BUFFERS * sizeof(struct io_uring_buf);
+    void* map = mmap(NULL, ring->buffersSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    ring->buffers = map;
+    ring->bufferData = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)ring->buffers;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+            &reg, 1) < 0) {
+        return -1;
+    }
+    for (unsigned int id = 0; id < URING_BUFFERS; id++) {
+        uring_buffer_return(ring, id);
+    }
+    return 0;
+}
+
+/**
+ * Creates an io_uring instance with its rings mapped and receive buffers
+ * registered. Everything the reactors use has to be there: provided buffer
+ * rings, multishot accept and poll(Linux 5.19) and waits with a timeout
+ * (IORING_FEAT_EXT_ARG).
+ * Returns the new ring, NULL if io_uring is unavailable or too old
+ */
+Uring* uring_create(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 2;
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+    Uring* ring = calloc(1, sizeof(Uring));
+    ring->fd = fd;
+    if (!(params.features & IORING_FEAT_EXT_ARG) ||
+            !(params.features & IORING_FEAT_NODROP)) {
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sqMapSize = params.sq_off.array +
+            params.sq_entries * sizeof(unsigned int);
+    ring->cqMapSize = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) { // One map for both
+        if (ring->cqMapSize > ring->sqMapSize) {
+            ring->sqMapSize = ring->cqMapSize;
+        }
+        ring->sqMap = uring_map(ring, ring->sqMapSize, IORING_OFF_SQ_RING);
+        ring->cqMap = ring->sqMap;
+    } else {
+        ring->sqMap = uring_map(ring, ring->sqMapSize, IORING_OFF_SQ_RING);
+        ring->cqMap = uring_map(ring, ring->cqMapSize, IORING_OFF_CQ_RING);
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = uring_map(ring, ring->sqesSize, IORING_OFF_SQES);
+    if (ring->sqMap == NULL || ring->cqMap == NULL || ring->sqes == NULL) {
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    char* sq = ring->sqMap;
+    char* cq = ring->cqMap;
+    ring->sqHead = (unsigned int*)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned int*)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqArray = (unsigned int*)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned int*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned int*)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    if (uring_register_buffers(ring) < 0) {
+        uring_destroy(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+/**
+ * Enters the kernel to submit what has been queued and optionally wait.
+ * ring is the ring
+ * waitFor is the number of completions to wait for
+ * timeout is the longest to wait(microsecond), -1 for no limit
+ * Returns what io_uring_enter returned
+ */
+static int uring_enter(Uring* ring, unsigned int waitFor,
+        long long timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec wait;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        wait.tv_sec = timeout / 1000000;
+        wait.tv_nsec = timeout % 1000000 * 1000;
+        arg.ts = (unsigned long long)(uintptr_t)&wait;
+    }
+    unsigned int submit = *(ring->sqTail) -
+            __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    return syscall(__NR_io_uring_enter, ring->fd, submit, waitFor,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+            sizeof(arg));
+}
+
+/**
+ * Takes the next free submission slot, cleared. It is submitted by the next
+ * uring_wait and must be filled in before then.
+ * ring is the ring
+ * Returns the submission to fill in
+ */
+struct io_uring_sqe* uring_sqe(Uring* ring) {
+    unsigned int tail = *(ring->sqTail); // Only this thread moves it
+    while (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >=
+            ring->sqEntries) { // Full, submit what is there to make room
+        if (uring_enter(ring, 0, -1) < 0 && errno != EINTR &&
+                errno != EBUSY && errno != EAGAIN) {
+            abort(); // Ring is broken, nothing sensible left to do
+        }
+    }
+    unsigned int index = tail & ring->sqMask;
+    struct io_uring_sqe* sqe = &(ring->sqes[index]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/**
+ * Submits everything queued and waits until a completion is ready, unless
+ * one already is.
+ * ring is the ring
+ * timeout is the longest to wait(microsecond), -1 for no limit
+ * Returns 0, or -1 if the ring failed
+ */
+int uring_wait(Uring* ring, long long timeout) {
+    unsigned int ready = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) -
+            *(ring->cqHead);
+    if (uring_enter(ring, ready ? 0 : 1, timeout) < 0 && errno != EINTR &&
+            errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Takes the next completion off the ring.
+ * ring is the ring
+ * event is filled in with the completion
+ * Returns 1 if there was one, 0 if not
+ */
+int uring_next(Uring* ring, UringEvent* event) {
+    unsigned int head = *(ring->cqHead); // Only this thread moves it
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    struct io_uring_cqe* cqe = &(ring->cqes[head & ring->cqMask]);
+    event->data = cqe->user_data;
+    event->result = cqe->res;
+    event->flags = cqe->flags;
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Determines where a provided buffer the kernel received into is.
+ * ring is the ring
+ * id is the buffer's id, from the completion's flags
+ * Returns the buffer
+ */
+char* uring_buffer(Uring* ring, unsigned int id) {
+    return ring->bufferData + (size_t)id * URING_BUFFER_SIZE;
+}
+
+/**
+ * Hands a provided buffer back to the kernel once its data has been used.
+ * ring is the ring
+ * id is the buffer's id
+ */
+void uring_buffer_return(Uring* ring, unsigned int id) {
+    unsigned short tail = ring->buffers->tail; // Only this thread moves it
+    struct io_uring_buf* buffer =
+            &(ring->buffers->bufs[tail & (URING_BUFFERS - 1)]);
+    buffer->addr = (unsigned long long)(uintptr_t)uring_buffer(ring, id);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = id; // Not resv, the first buffer's overlays the tail
+    __atomic_store_n(&(ring->buffers->tail), tail + 1, __ATOMIC_RELEASE);
+}
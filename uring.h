@@ -0,0 +1,60 @@
+#ifndef _URING_H
+#define _URING_H
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/* Submissions the ring holds, completions get twice as many */
+#define URING_ENTRIES 4096
+
+/* Receive buffers the kernel picks from(a power of two), and their size */
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE 4096
+
+/* Buffer group the receive buffers are registered as */
+#define URING_GROUP 0
+
+/* A completion taken off the ring */
+typedef struct UringEvent {
+    unsigned long long data; // user_data of the submission it completes
+    int result;
+    unsigned int flags;
+} UringEvent;
+
+/* An io_uring instance driven through the raw system calls, with a ring of
+ * provided buffers receives are made into. Only used by the thread that
+ * created it. */
+typedef struct Uring {
+    int fd;
+    unsigned int* sqHead;
+    unsigned int* sqTail;
+    unsigned int sqMask;
+    unsigned int sqEntries;
+    unsigned int* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqMap; // Mappings of the rings, kept to unmap them
+    size_t sqMapSize;
+    void* cqMap; // Same as sqMap if the kernel maps both rings at once
+    size_t cqMapSize;
+    size_t sqesSize;
+    struct io_uring_buf_ring* buffers; // Ring of buffers handed back
+    size_t buffersSize;
+    char* bufferData; // URING_BUFFERS buffers of URING_BUFFER_SIZE bytes
+} Uring;
+
+Uring* uring_create(void);
+
+struct io_uring_sqe* uring_sqe(Uring* ring);
+
+int uring_wait(Uring* ring, long long timeout);
+
+int uring_next(Uring* ring, UringEvent* event);
+
+char* uring_buffer(Uring* ring, unsigned int id);
+
+void uring_buffer_return(Uring* ring, unsigned int id);
+
+#endif